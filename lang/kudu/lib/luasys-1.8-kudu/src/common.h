@@ -3,6 +3,10 @@
 
 #define _FILE_OFFSET_BITS  64
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  /* splice() */
+#endif
+
 #include <sys/types.h>
 #include <string.h>
 #include <stdlib.h>
@@ -38,18 +42,21 @@
 
 #define SYS_ERRNO	GetLastError()
 #define SYS_EAGAIN(e)	((e) == WSAEWOULDBLOCK)
+#define SYS_ENOMEM	ERROR_NOT_ENOUGH_MEMORY
 
 extern int is_WinNT;
 
 #else
 
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <signal.h>
 #include <fcntl.h>
 
 #define SYS_ERRNO	errno
 #define SYS_EAGAIN(e)	((e) == EAGAIN || (e) == EWOULDBLOCK)
+#define SYS_ENOMEM	ENOMEM
 
 #define SYS_SIGINTR	SIGWINCH
 
@@ -146,6 +153,40 @@ int sys_buffer_write_next (lua_State *L, struct sys_buffer *sb,
 int sys_buffer_write_done (lua_State *L, struct sys_buffer *sb,
                            char *buf, size_t tail);
 
+/* Vectored I/O */
+
+#define SYS_IOV_MAX	64  /* buffers per call */
+
+#ifndef _WIN32
+typedef struct iovec	sys_iovec;
+#define sys_iov_set(v,p,l)	((v)->iov_base = (void *) (size_t) (p), (v)->iov_len = (l))
+#define sys_iov_len(v)		((v)->iov_len)
+#else
+typedef WSABUF		sys_iovec;
+#define sys_iov_set(v,p,l)	((v)->buf = (char *) (size_t) (p), (v)->len = (ULONG) (l))
+#define sys_iov_len(v)		((v)->len)
+#endif
+
+struct sys_vbuffer {
+    sys_iovec iov[SYS_IOV_MAX];
+    struct membuf *mb[SYS_IOV_MAX];
+    int n;  /* number of buffers */
+    size_t size;  /* total size */
+};
+
+int sys_buffer_readv_init (lua_State *L, int idx, int last,
+                           struct sys_vbuffer *vb);
+void sys_buffer_readv_next (struct sys_vbuffer *vb, size_t n);
+
+int sys_buffer_writev_init (lua_State *L, int idx, int last,
+                            struct sys_vbuffer *vb);
+void sys_buffer_writev_done (struct sys_vbuffer *vb, size_t n);
+
+/* Receive Buffer Pool */
+
+int sys_buffer_pool_get (lua_State *L, int idx);
+int sys_buffer_pool_put (lua_State *L, int idx, int buf_idx);
+
 
 /*
  * Error Reporting
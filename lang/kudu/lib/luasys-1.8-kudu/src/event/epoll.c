@@ -8,9 +8,18 @@ evq_init (struct event_queue *evq)
 {
     fd_t *sig_fd = evq->sig_fd;
 
+    evq->ep_events = malloc(NEVENT * sizeof(struct epoll_event));
+    if (!evq->ep_events)
+	return -1;
+
+    evq->max_events = NEVENT;
+    evq->max_batches = 1;
+
     evq->epoll_fd = epoll_create(NEVENT);
-    if (evq->epoll_fd == -1)
+    if (evq->epoll_fd == -1) {
+	free(evq->ep_events);
 	return -1;
+    }
 
     {
 	struct epoll_event epev;
@@ -37,6 +46,24 @@ evq_done (struct event_queue *evq)
     close(evq->sig_fd[1]);
 
     close(evq->epoll_fd);
+
+    free(evq->ep_events);
+}
+
+static unsigned int
+epoll_events (unsigned int ev_flags)
+{
+    unsigned int events = 0;
+
+    if (ev_flags & EVENT_READ)
+	events = EPOLLIN;
+    if (ev_flags & EVENT_WRITE)
+	events |= EPOLLOUT;
+    if (ev_flags & (EVENT_ONESHOT | EVENT_REARM))
+	events |= EPOLLONESHOT;
+    if (ev_flags & EVENT_EDGE)
+	events |= EPOLLET;
+    return events;
 }
 
 int
@@ -53,11 +80,8 @@ evq_add (struct event_queue *evq, struct event *ev)
 	struct epoll_event epev;
 
 	memset(&epev, 0, sizeof(struct epoll_event));
-	if (ev_flags & EVENT_READ)
-	    epev.events = EPOLLIN;
-	if (ev_flags & EVENT_WRITE)
-	    epev.events |= EPOLLOUT;
-	epev.events |= (ev_flags & EVENT_ONESHOT) ? EPOLLONESHOT : 0;
+	epev.events = epoll_events(ev_flags)
+	 | ((ev_flags & EVENT_EXCLUSIVE) ? EPOLLEXCLUSIVE : 0);
 	epev.data.ptr = ev;
 	if (epoll_ctl(evq->epoll_fd, EPOLL_CTL_ADD, ev->fd, &epev) == -1)
 	    return -1;
@@ -113,30 +137,74 @@ evq_del (struct event *ev, int reuse_fd)
 int
 evq_modify (struct event *ev, unsigned int flags)
 {
+    struct event_queue *evq = ev->evq;
+    const unsigned int ev_flags = ev->flags;
     struct epoll_event epev;
 
     memset(&epev, 0, sizeof(struct epoll_event));
-    if (flags & EVENT_READ)
-	epev.events = EPOLLIN;
-    if (flags & EVENT_WRITE)
-	epev.events |= EPOLLOUT;
+    epev.events = epoll_events((ev_flags & ~(EVENT_READ | EVENT_WRITE))
+     | flags);
     epev.data.ptr = ev;
-    return epoll_ctl(ev->evq->epoll_fd, EPOLL_CTL_MOD, ev->fd, &epev);
+
+    /* exclusive wakeup can't be modified, so re-register */
+    if (ev_flags & EVENT_EXCLUSIVE) {
+	epev.events |= EPOLLEXCLUSIVE;
+	if (epoll_ctl(evq->epoll_fd, EPOLL_CTL_DEL, ev->fd, NULL))
+	    return -1;
+	return epoll_ctl(evq->epoll_fd, EPOLL_CTL_ADD, ev->fd, &epev);
+    }
+    return epoll_ctl(evq->epoll_fd, EPOLL_CTL_MOD, ev->fd, &epev);
+}
+
+/*
+ * Double the ready events array, when epoll_wait() filled it up
+ */
+static int
+epoll_grow (struct event_queue *evq)
+{
+    const unsigned int n = 2 * evq->max_events;
+    void *p;
+
+    if (n > NEVENT_MAX
+     || !(p = realloc(evq->ep_events, n * sizeof(struct epoll_event))))
+	return -1;
+
+    evq->ep_events = p;
+    evq->max_events = n;
+    return 0;
 }
 
 int
 evq_wait (struct event_queue *evq, msec_t timeout)
 {
-    struct epoll_event ep_events[NEVENT];
     struct epoll_event *epev;
     struct event *ev_ready;
+    unsigned int nbatches = evq->max_batches;
     int nready;
+    const msec_t loop_timeout = timeout;
 
     timeout = timeout_get(evq->tq, timeout, evq->now);
 
     sys_vm_leave();
 
-    nready = epoll_wait(evq->epoll_fd, ep_events, NEVENT, (int) timeout);
+    nready = epoll_wait(evq->epoll_fd, evq->ep_events, evq->max_events,
+     (int) timeout);
+    evq->nwaits++;
+
+    /* drain full batches without re-entering the VM */
+    while (nready == (int) evq->max_events) {
+	int n;
+
+	evq->nsaturated++;
+	if (epoll_grow(evq) || !--nbatches)
+	    break;
+
+	n = epoll_wait(evq->epoll_fd, evq->ep_events + nready,
+	 evq->max_events - nready, 0);
+	evq->nwaits++;
+	if (n <= 0) break;
+	nready += n;
+    }
     evq->now = get_milliseconds();
 
     sys_vm_enter();
@@ -146,17 +214,18 @@ evq_wait (struct event_queue *evq, msec_t timeout)
 
     if (timeout != TIMEOUT_INFINITE) {
 	if (!nready) {
-	    ev_ready = !evq->tq ? NULL
-	     : timeout_process(evq->tq, NULL, evq->now);
+	    ev_ready = !evq->tq ? evq->ev_ready
+	     : timeout_process(evq->tq, evq->ev_ready, evq->now);
 	    if (ev_ready) goto end;
-	    return EVQ_TIMEOUT;
+	    /* not the caller's timeout: keep waiting */
+	    return (timeout == loop_timeout) ? EVQ_TIMEOUT : 0;
 	}
 
 	timeout = evq->now;
     }
 
-    ev_ready = NULL;
-    for (epev = ep_events; nready--; ++epev) {
+    ev_ready = evq->ev_ready;  /* triggered by other threads */
+    for (epev = evq->ep_events; nready--; ++epev) {
 	const int revents = epev->events;
 	struct event *ev;
 	unsigned int res;
@@ -169,6 +238,9 @@ evq_wait (struct event_queue *evq, msec_t timeout)
 		ev_ready = signal_process(evq, ev_ready, timeout);
 	    continue;
 	}
+	/* level-triggered descriptor is repeated by drained batches */
+	if (ev->flags & EVENT_ACTIVE)
+	    continue;
 
 	res = EVENT_ACTIVE;
 	if ((revents & EPOLLFD_READ) && (ev->flags & EVENT_READ)) {
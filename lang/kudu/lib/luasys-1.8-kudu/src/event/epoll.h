@@ -4,9 +4,14 @@
 #include <sys/epoll.h>
 #include <sys/inotify.h>
 
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE	(1U << 28)
+#endif
+
 #define EVQ_SOURCE	"epoll.c"
 
 #define NEVENT		64
+#define NEVENT_MAX	(NEVENT * 64)  /* limit of the ready events array */
 
 #define EVENT_EXTRA							\
     struct event_queue *evq;
@@ -14,6 +19,10 @@
 #define EVQ_EXTRA							\
     struct timeout_queue *tq;						\
     fd_t sig_fd[2];  /* pipe to notify about signals */			\
-    int epoll_fd;  /* epoll descriptor */
+    int epoll_fd;  /* epoll descriptor */				\
+    struct epoll_event *ep_events;  /* ready events array */		\
+    unsigned int max_events;  /* size of ready events array */		\
+    unsigned int max_batches;  /* number of full batches to drain */	\
+    unsigned int nwaits, nsaturated;  /* statistics of epoll_wait */
 
 #endif
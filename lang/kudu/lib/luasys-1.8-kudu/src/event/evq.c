@@ -3,7 +3,11 @@
 #include "evq.h"
 
 
+#ifndef USE_TIMER_WHEEL
 #include "timeout.c"
+#else
+#include "timewheel.c"
+#endif
 
 #ifdef _WIN32
 
@@ -19,7 +23,7 @@ evq_set_timeout (struct event *ev, msec_t msec)
     struct event_queue *evq = ev->evq;
 
     if (ev->tq) {
-	if (ev->tq->msec == msec) {
+	if (event_get_timeout(ev) == msec) {
 	    timeout_reset(ev, evq->now);
 	    return 0;
 	}
@@ -47,3 +51,7 @@ evq_add_timer (struct event_queue *evq, struct event *ev, msec_t msec)
 
 #include EVQ_SOURCE
 
+#ifdef EVQ_RELAY
+#include "relay.c"
+#endif
+
@@ -8,6 +8,8 @@ struct event_queue;
 #include "win32.h"
 #elif defined(USE_KQUEUE)
 #include "kqueue.h"
+#elif defined(USE_IO_URING)
+#include "iouring.h"
 #elif defined(USE_EPOLL)
 #include "epoll.h"
 #elif defined(USE_POLL)
@@ -26,6 +28,7 @@ struct event_queue;
 #define EVQ_OBJ_UDATA	1  /* table: event objects */
 #define EVQ_CALLBACK	2  /* table: callback functions */
 #define EVQ_ON_INTR	3  /* function */
+#define EVQ_POOL	4  /* receive buffer pool */
 #define EVQ_BUF_IDX	6  /* initial buffer index */
 
 /* Directory watcher filter flags */
@@ -38,6 +41,7 @@ struct event {
     struct event *prev, *next;
     struct timeout_queue *tq;
     msec_t timeout_at;
+    EVENT_TIMEOUT_EXTRA
 
 #define EVENT_READ		0x00000001
 #define EVENT_WRITE		0x00000002
@@ -55,7 +59,11 @@ struct event {
 #define EVENT_CALLBACK_THREAD	0x00002000  /* callback is coroutine */
 #define EVENT_SOCKET_ACC_CONN	0x00004000  /* IOCP: don't use listening or connecting socket */
 #define EVENT_PENDING		0x00008000  /* AIO request not completed */
-#define EVENT_MASK		0x0000FFFF
+#define EVENT_EDGE		0x00020000  /* edge-triggered */
+#define EVENT_REARM		0x00040000  /* disabled after trigger until modified */
+#define EVENT_EXCLUSIVE		0x00080000  /* wake up one of queues sharing the fd */
+#define EVENT_RELAY		0x00800000  /* pumped by relay, not by callback */
+#define EVENT_MASK		0x008EFFFF
 /* triggered events (result of waiting) */
 #define EVENT_ACTIVE		0x00010000
 #define EVENT_READ_RES		0x00100000
@@ -64,6 +72,7 @@ struct event {
 #define EVENT_EOF_RES		0x01000000
 #define EVENT_EOF_MASK_RES	0xFF000000
 #define EVENT_EOF_SHIFT_RES	24  /* last byte is error status */
+#define EVENT_PACKED_SHIFT_RES	20  /* results for compact callbacks */
     unsigned int flags;
 
     int ev_id;
@@ -75,6 +84,7 @@ struct event {
 struct event_queue {
     unsigned int stop:		1;  /* break the loop? */
     unsigned int intr:		1;  /* is interrupted? */
+    unsigned int compact:	1;  /* callbacks get packed results */
 
     unsigned int nevents;  /* number of alive events */
 
@@ -89,6 +99,7 @@ struct event_queue {
     struct sys_thread *vmtd;  /* for inter-vm events (eg. threads i/o) */
 
     EVQ_EXTRA
+    EVQ_TIMEOUT_EXTRA
 };
 
 int evq_init (struct event_queue *evq);
@@ -109,6 +120,35 @@ int evq_ignore_signal (struct event_queue *evq, int signo, int ignore);
 int evq_interrupt (struct event_queue *evq);
 
 
+#if defined(__linux__)
+
+#define EVQ_RELAY
+
+#include <sys/socket.h>
+
+/* Relay result */
+#define RELAY_PUMP	0  /* still pumping */
+#define RELAY_EOF	1
+#define RELAY_BUDGET	2
+#define RELAY_ERROR	3
+
+struct relay {
+    struct event *ev[2];
+    fd_t fd[2];
+    fd_t pipe[2][2];  /* direction d: fd[d] -> pipe[d] -> fd[!d] */
+    size_t pending[2];  /* bytes in pipe */
+    int64_t nbytes[2];  /* bytes moved */
+    int64_t budget;  /* bytes to read, -1: unlimited */
+    unsigned int armed[2];  /* registered READ/WRITE flags */
+    unsigned int eof:	2;  /* directions read to the end */
+    unsigned int shut:	2;  /* directions shut down */
+    unsigned int paused:	1;  /* budget is reported */
+    int err;
+};
+
+#endif /* EVQ_RELAY */
+
+
 #ifndef _WIN32
 
 #define evq_post_call(ev, ev_flags)	((void) 0)
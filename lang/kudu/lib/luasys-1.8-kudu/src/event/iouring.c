@@ -0,0 +1,540 @@
+/* io_uring */
+
+/*
+ * Readiness is polled by one-shot IORING_OP_POLL_ADD requests, which are
+ * re-armed by next waiting (i.e. after the callbacks), so the descriptors
+ * are level-triggered and the changes are submitted by the same system
+ * call as the waiting.
+ *
+ * Edge-triggered descriptors use multi-shot polls, which stay armed.
+ *
+ * Poll request keeps its slot until completion: result of the request of
+ * deleted or modified event is ignored even if the event is reused.
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <endian.h>
+
+#define RING_REMOVE	0  /* user data of poll removals */
+#define RING_SIGNAL	((__u64) -1)  /* user data of signal pipe poll */
+
+#define RING_REARM	((unsigned int) -1)  /* slot of event to be re-armed */
+
+#define RINGFD_READ	(POLLIN | POLLERR | POLLHUP)
+#define RINGFD_WRITE	(POLLOUT | POLLERR | POLLHUP)
+
+#define ring_used(evq)	((evq)->ring.fd != -1)
+
+
+/* EPoll is used, when io_uring is not available */
+static int evq_epoll_init (struct event_queue *evq);
+static void evq_epoll_done (struct event_queue *evq);
+static int evq_epoll_add (struct event_queue *evq, struct event *ev);
+static int evq_epoll_add_dirwatch (struct event_queue *evq, struct event *ev,
+                                   const char *path);
+static int evq_epoll_del (struct event *ev, int reuse_fd);
+static int evq_epoll_modify (struct event *ev, unsigned int flags);
+static int evq_epoll_wait (struct event_queue *evq, msec_t timeout);
+
+#define evq_init		evq_epoll_init
+#define evq_done		evq_epoll_done
+#define evq_add			evq_epoll_add
+#define evq_add_dirwatch	evq_epoll_add_dirwatch
+#define evq_del			evq_epoll_del
+#define evq_modify		evq_epoll_modify
+#define evq_wait		evq_epoll_wait
+
+#include "epoll.c"
+
+#undef evq_init
+#undef evq_done
+#undef evq_add
+#undef evq_add_dirwatch
+#undef evq_del
+#undef evq_modify
+#undef evq_wait
+
+
+static int
+ring_enter (struct iouring *ring, unsigned int to_submit,
+            unsigned int flags, struct io_uring_getevents_arg *arg)
+{
+    return syscall(__NR_io_uring_enter, ring->fd, to_submit,
+     (flags ? 1 : 0), flags, arg, (arg ? sizeof(*arg) : 0));
+}
+
+static int
+ring_submit (struct iouring *ring)
+{
+    const unsigned int n = *ring->sq_tail
+     - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    return (ring_enter(ring, n, 0, NULL) == -1) ? -1 : 0;
+}
+
+/*
+ * Queue the request to be submitted by next waiting
+ */
+static int
+ring_push (struct iouring *ring, int opcode, int fd, unsigned int events,
+           unsigned int len, __u64 addr, __u64 user_data)
+{
+    const unsigned int tail = *ring->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+     >= ring->sq_entries && ring_submit(ring))
+	return -1;
+
+    sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = (__u8) opcode;
+    sqe->fd = fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    events = (events << 16) | (events >> 16);
+#endif
+    sqe->poll32_events = events;
+    sqe->len = len;
+    sqe->addr = addr;
+    sqe->user_data = user_data;
+
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int
+ring_arm (struct event_queue *evq, struct event *ev, unsigned int ev_flags)
+{
+    struct iouring *ring = &evq->ring;
+    unsigned int slot, events = 0;
+
+    if (ring->nfree)
+	slot = ring->free_polls[--ring->nfree];
+    else {
+	slot = ring->npolls + 1;
+	if (slot >= ring->max_polls) {
+	    const unsigned int n = 2 * ring->max_polls;
+	    void *p;
+
+	    if (!(p = realloc(ring->polls, n * sizeof(void *))))
+		return -1;
+	    ring->polls = p;
+
+	    if (!(p = realloc(ring->free_polls, n * sizeof(unsigned int))))
+		return -1;
+	    ring->free_polls = p;
+
+	    if (!(p = realloc(ring->rearms, n * sizeof(void *))))
+		return -1;
+	    ring->rearms = p;
+	    ring->max_polls = n;
+	}
+	ring->npolls = slot;
+    }
+
+    if (ev_flags & EVENT_READ)
+	events = POLLIN;
+    if (ev_flags & EVENT_WRITE)
+	events |= POLLOUT;
+    if (ev_flags & EVENT_EXCLUSIVE)
+	events |= EPOLLEXCLUSIVE;
+
+    if (ring_push(ring, IORING_OP_POLL_ADD, ev->fd, events,
+     ((ev_flags & (EVENT_EDGE | EVENT_ONESHOT | EVENT_REARM)) == EVENT_EDGE)
+     ? IORING_POLL_ADD_MULTI : 0, 0, slot)) {
+	ring->free_polls[ring->nfree++] = slot;
+	return -1;
+    }
+
+    ring->polls[slot] = ev;
+    ev->ring_slot = slot;
+    return 0;
+}
+
+static void
+ring_disarm (struct event_queue *evq, struct event *ev)
+{
+    struct iouring *ring = &evq->ring;
+    const unsigned int slot = ev->ring_slot;
+
+    if (!slot) return;
+    if (slot == RING_REARM) {
+	ev->ring_slot = 0;
+	return;
+    }
+
+    /* the slot is released by completion of the poll request */
+    ring->polls[slot] = NULL;
+    ev->ring_slot = 0;
+
+    ring_push(ring, IORING_OP_POLL_REMOVE, -1, 0, 0, slot, RING_REMOVE);
+}
+
+static void
+ring_done (struct iouring *ring)
+{
+    if (ring->sqes)
+	munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+	munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+	munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+
+    free(ring->rearms);
+    free(ring->free_polls);
+    free(ring->polls);
+
+    memset(ring, 0, sizeof(struct iouring));
+    ring->fd = -1;
+}
+
+static int
+ring_init (struct event_queue *evq)
+{
+    struct iouring *ring = &evq->ring;
+    struct io_uring_params params;
+    void *p;
+
+    memset(&params, 0, sizeof(struct io_uring_params));
+    ring->fd = syscall(__NR_io_uring_setup, NURING, &params);
+    if (ring->fd == -1)
+	return -1;
+
+    /* wait with timeout & keep overflowed completions */
+    if ((params.features & (IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP))
+     != (IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP))
+	goto err;
+
+    ring->sq_ring_size = params.sq_off.array
+     + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes
+     + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP)
+     && ring->sq_ring_size < ring->cq_ring_size)
+	ring->sq_ring_size = ring->cq_ring_size;
+
+    p = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (p == MAP_FAILED) goto err;
+    ring->sq_ring = p;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+	ring->cq_ring = p;
+    else {
+	p = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+	 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (p == MAP_FAILED) goto err;
+	ring->cq_ring = p;
+    }
+
+    ring->sq_entries = params.sq_entries;
+    p = mmap(NULL, ring->sq_entries * sizeof(struct io_uring_sqe),
+     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+     ring->fd, IORING_OFF_SQES);
+    if (p == MAP_FAILED) goto err;
+    ring->sqes = p;
+
+    {
+	char *sq = ring->sq_ring, *cq = ring->cq_ring;
+	unsigned int i;
+
+	ring->sq_head = (void *) (sq + params.sq_off.head);
+	ring->sq_tail = (void *) (sq + params.sq_off.tail);
+	ring->sq_flags = (void *) (sq + params.sq_off.flags);
+	ring->sq_array = (void *) (sq + params.sq_off.array);
+	ring->sq_mask = *(unsigned int *) (void *) (sq + params.sq_off.ring_mask);
+
+	ring->cq_head = (void *) (cq + params.cq_off.head);
+	ring->cq_tail = (void *) (cq + params.cq_off.tail);
+	ring->cqes = (void *) (cq + params.cq_off.cqes);
+	ring->cq_mask = *(unsigned int *) (void *) (cq + params.cq_off.ring_mask);
+
+	/* submission entries are used in order */
+	for (i = 0; i < ring->sq_entries; ++i)
+	    ring->sq_array[i] = i;
+    }
+
+    ring->polls = malloc(NEVENT * sizeof(void *));
+    ring->free_polls = malloc(NEVENT * sizeof(unsigned int));
+    ring->rearms = malloc(NEVENT * sizeof(void *));
+    if (!ring->polls || !ring->free_polls || !ring->rearms)
+	goto err;
+    ring->max_polls = NEVENT;
+
+    evq->epoll_fd = -1;
+    evq->max_events = params.cq_entries;
+    return 0;
+ err:
+    ring_done(ring);
+    return -1;
+}
+
+
+int
+evq_init (struct event_queue *evq)
+{
+    fd_t *sig_fd = evq->sig_fd;
+
+    if (ring_init(evq))
+	return evq_epoll_init(evq);
+
+    sig_fd[0] = sig_fd[1] = (fd_t) -1;
+    if (pipe(sig_fd) || fcntl(sig_fd[0], F_SETFL, O_NONBLOCK)
+     || ring_push(&evq->ring, IORING_OP_POLL_ADD, sig_fd[0], POLLIN,
+     0, 0, RING_SIGNAL)) {
+	evq_done(evq);
+	return -1;
+    }
+
+    evq->now = get_milliseconds();
+    return 0;
+}
+
+void
+evq_done (struct event_queue *evq)
+{
+    if (!ring_used(evq)) {
+	evq_epoll_done(evq);
+	return;
+    }
+
+    close(evq->sig_fd[0]);
+    close(evq->sig_fd[1]);
+
+    ring_done(&evq->ring);
+}
+
+int
+evq_add (struct event_queue *evq, struct event *ev)
+{
+    if (!ring_used(evq))
+	return evq_epoll_add(evq, ev);
+
+    ev->evq = evq;
+
+    if (ev->flags & EVENT_SIGNAL)
+	return signal_add(evq, ev);
+
+    if (ring_arm(evq, ev, ev->flags))
+	return -1;
+
+    evq->nevents++;
+    return 0;
+}
+
+int
+evq_add_dirwatch (struct event_queue *evq, struct event *ev, const char *path)
+{
+    const unsigned int filter = (ev->flags >> EVENT_EOF_SHIFT_RES)
+     ? IN_MODIFY : IN_ALL_EVENTS ^ IN_ACCESS;
+
+    if (!ring_used(evq))
+	return evq_epoll_add_dirwatch(evq, ev, path);
+
+    ev->flags &= ~EVENT_EOF_MASK_RES;
+
+    ev->fd = inotify_init();
+    if (ev->fd == -1) return -1;
+
+    if (inotify_add_watch(ev->fd, path, filter) == -1) {
+	close(ev->fd);
+	return -1;
+    }
+
+    return evq_add(evq, ev);
+}
+
+int
+evq_del (struct event *ev, int reuse_fd)
+{
+    struct event_queue *evq = ev->evq;
+    const unsigned int ev_flags = ev->flags;
+
+    if (!ring_used(evq))
+	return evq_epoll_del(ev, reuse_fd);
+
+    if (ev->tq) timeout_del(ev);
+
+    ev->evq = NULL;
+    evq->nevents--;
+
+    if (ev_flags & EVENT_TIMER) return 0;
+
+    if (ev_flags & EVENT_SIGNAL)
+	return signal_del(evq, ev);
+
+    /* pending poll request holds the file open */
+    ring_disarm(evq, ev);
+
+    if (ev_flags & EVENT_DIRWATCH)
+	return close(ev->fd);
+    return 0;
+}
+
+int
+evq_modify (struct event *ev, unsigned int flags)
+{
+    struct event_queue *evq = ev->evq;
+
+    if (!ring_used(evq))
+	return evq_epoll_modify(ev, flags);
+
+    ring_disarm(evq, ev);
+    return ring_arm(evq, ev,
+     (ev->flags & ~(EVENT_READ | EVENT_WRITE)) | flags);
+}
+
+int
+evq_wait (struct event_queue *evq, msec_t timeout)
+{
+    struct iouring *ring = &evq->ring;
+    struct event *ev_ready;
+    unsigned int head, tail;
+    int res;
+    const msec_t loop_timeout = timeout;
+
+    if (!ring_used(evq))
+	return evq_epoll_wait(evq, timeout);
+
+    /* poll again the processed events */
+    {
+	const unsigned int n = ring->nrearms;
+	unsigned int i;
+
+	ring->nrearms = 0;
+	for (i = 0; i < n; ++i) {
+	    struct event *ev = ring->rearms[i];
+
+	    if (ev->ring_slot == RING_REARM) {
+		ev->ring_slot = 0;
+		ring_arm(evq, ev, ev->flags);
+	    }
+	}
+    }
+
+    timeout = timeout_get(evq->tq, timeout, evq->now);
+
+    sys_vm_leave();
+
+    /* submit the queued requests and wait for completions */
+    {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+
+	memset(&arg, 0, sizeof(struct io_uring_getevents_arg));
+	if (timeout != TIMEOUT_INFINITE) {
+	    ts.tv_sec = timeout / 1000;
+	    ts.tv_nsec = (timeout % 1000) * 1000000L;
+	    arg.ts = (__u64) (size_t) &ts;
+	}
+
+	res = ring_enter(ring, *ring->sq_tail
+	 - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE),
+	 IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg);
+	evq->nwaits++;
+    }
+    evq->now = get_milliseconds();
+
+    sys_vm_enter();
+
+    if (res == -1 && errno != ETIME && errno != EINTR && errno != EBUSY)
+	return EVQ_FAILED;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+	if (res == -1 && errno == EINTR)
+	    return 0;
+	if (timeout != TIMEOUT_INFINITE) {
+	    ev_ready = !evq->tq ? evq->ev_ready
+	     : timeout_process(evq->tq, evq->ev_ready, evq->now);
+	    if (ev_ready) goto end;
+	    /* not the caller's timeout: keep waiting */
+	    return (timeout == loop_timeout) ? EVQ_TIMEOUT : 0;
+	}
+	return 0;
+    }
+
+    ev_ready = evq->ev_ready;  /* triggered by other threads */
+    for (; head != tail; ++head) {
+	const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+	const __u64 user_data = cqe->user_data;
+	const int revents = cqe->res;
+	struct event *ev;
+	unsigned int slot, rw;
+
+	/* release the entry before re-arming polls */
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	if (user_data == RING_REMOVE)
+	    continue;
+	if (user_data == RING_SIGNAL) {
+	    if (revents > 0)
+		ev_ready = signal_process(evq, ev_ready, evq->now);
+	    ring_push(ring, IORING_OP_POLL_ADD, evq->sig_fd[0], POLLIN,
+	     0, 0, RING_SIGNAL);
+	    continue;
+	}
+
+	slot = (unsigned int) user_data;
+	ev = ring->polls[slot];
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+	    ring->free_polls[ring->nfree++] = slot;
+	    if (ev) ev->ring_slot = 0;
+	}
+
+	if (!ev) continue;  /* deleted or modified */
+	/* multi-shot poll may be repeated */
+	if (ev->flags & EVENT_ACTIVE)
+	    continue;
+
+	rw = EVENT_ACTIVE;
+	if (revents < 0)  /* bad descriptor */
+	    rw |= EVENT_EOF_RES | (ev->flags & EVENT_READ ? EVENT_READ_RES
+	     : EVENT_WRITE_RES);
+	else {
+	    if ((revents & RINGFD_READ) && (ev->flags & EVENT_READ)) {
+		rw |= EVENT_READ_RES;
+
+		if (ev->flags & EVENT_DIRWATCH) {  /* skip inotify data */
+		    char buf[BUFSIZ];
+		    int n;
+		    do n = read(ev->fd, buf, sizeof(buf));
+		    while (n == -1 && errno == EINTR);
+		}
+	    }
+	    if ((revents & RINGFD_WRITE) && (ev->flags & EVENT_WRITE))
+		rw |= EVENT_WRITE_RES;
+	    if (revents & POLLHUP)
+		rw |= EVENT_EOF_RES;
+	}
+
+	ev->flags |= rw;
+	if (ev->flags & EVENT_ONESHOT)
+	    evq_del(ev, 1);
+	else {
+	    /* descriptor must be polled after the callback */
+	    if (!ev->ring_slot && !(ev->flags & EVENT_REARM) && revents >= 0) {
+		ev->ring_slot = RING_REARM;
+		ring->rearms[ring->nrearms++] = ev;
+	    }
+	    if (ev->tq)
+		timeout_reset(ev, evq->now);
+	}
+
+	ev->next_ready = ev_ready;
+	ev_ready = ev;
+    }
+
+    /* overflowed completions are flushed by next waiting */
+    if (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED)
+     & IORING_SQ_CQ_OVERFLOW)
+	evq->nsaturated++;
+ end:
+    evq->ev_ready = ev_ready;
+    return 0;
+}
+
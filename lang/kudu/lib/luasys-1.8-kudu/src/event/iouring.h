@@ -0,0 +1,54 @@
+#ifndef IOURING_H
+#define IOURING_H
+
+#include <poll.h>
+#include <linux/io_uring.h>
+
+#include "epoll.h"  /* fallback, when the kernel lacks io_uring */
+
+#undef EVQ_SOURCE
+#undef EVQ_EXTRA
+
+#define EVQ_SOURCE	"iouring.c"
+
+#define NURING		256  /* entries of submission queue */
+
+/* Submission & completion rings */
+struct iouring {
+    int fd;  /* io_uring descriptor, -1 for epoll */
+
+    unsigned int *sq_head, *sq_tail, *sq_flags, *sq_array;
+    unsigned int sq_mask, sq_entries;
+    struct io_uring_sqe *sqes;
+
+    unsigned int *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+
+    /* armed polls: slot is released by completion of its request */
+    struct event **polls;  /* slot => event, NULL for deleted event */
+    unsigned int *free_polls;  /* stack of released slots */
+    unsigned int npolls, nfree, max_polls;
+
+    struct event **rearms;  /* triggered events to be polled again */
+    unsigned int nrearms;
+};
+
+#define EVQ_EXTRA							\
+    struct timeout_queue *tq;						\
+    fd_t sig_fd[2];  /* pipe to notify about signals */			\
+    int epoll_fd;  /* epoll descriptor */				\
+    struct epoll_event *ep_events;  /* ready events array */		\
+    unsigned int max_events;  /* size of ready events array */		\
+    unsigned int max_batches;  /* number of full batches to drain */	\
+    unsigned int nwaits, nsaturated;  /* statistics of waits */		\
+    struct iouring ring;
+
+#undef EVENT_EXTRA
+#define EVENT_EXTRA							\
+    struct event_queue *evq;						\
+    unsigned int ring_slot;  /* armed poll request */
+
+#endif
@@ -44,6 +44,10 @@ kqueue_set (struct event_queue *evq, struct event *ev, int filter, int action)
     kev->ident = ev->fd;
     kev->filter = filter;
     kev->flags = action | ((ev->flags & EVENT_ONESHOT) ? EV_ONESHOT : 0);
+    if (action == EV_ADD) {
+	kev->flags |= ((ev->flags & EVENT_EDGE) ? EV_CLEAR : 0)
+	 | ((ev->flags & EVENT_REARM) ? EV_DISPATCH : 0);
+    }
     kev->udata = ev;
     return 0;
 }
@@ -139,7 +143,9 @@ int
 evq_modify (struct event *ev, unsigned int flags)
 {
     struct event_queue *evq = ev->evq;
-    const unsigned int ev_flags = ev->flags;
+    /* re-add kept filters to enable the dispatched ones */
+    const unsigned int ev_flags = (ev->flags & EVENT_REARM)
+     ? ev->flags & ~flags : ev->flags;
 
     if (ev_flags & EVENT_READ) {
 	if (flags & EVENT_READ)
@@ -174,6 +180,7 @@ evq_wait (struct event_queue *evq, msec_t timeout)
     struct kevent *kev = evq->kev_list;
     struct timespec ts, *tsp;
     int nready;
+    const msec_t loop_timeout = timeout;
 
     timeout = timeout_get(evq->tq, timeout, evq->now);
     if (timeout == TIMEOUT_INFINITE)
@@ -197,16 +204,17 @@ evq_wait (struct event_queue *evq, msec_t timeout)
 
     if (tsp) {
 	if (!nready) {
-	    ev_ready = !evq->tq ? NULL
-	     : timeout_process(evq->tq, NULL, evq->now);
+	    ev_ready = !evq->tq ? evq->ev_ready
+	     : timeout_process(evq->tq, evq->ev_ready, evq->now);
 	    if (ev_ready) goto end;
-	    return EVQ_TIMEOUT;
+	    /* not the caller's timeout: keep waiting */
+	    return (timeout == loop_timeout) ? EVQ_TIMEOUT : 0;
 	}
 
 	timeout = evq->now;
     }
 
-    ev_ready = NULL;
+    ev_ready = evq->ev_ready;  /* triggered by other threads */
     for (; nready--; ++kev) {
 	struct event *ev;
 	const int flags = kev->flags;
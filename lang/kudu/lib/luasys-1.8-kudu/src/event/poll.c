@@ -168,6 +168,7 @@ evq_wait (struct event_queue *evq, msec_t timeout)
     struct pollfd *fdset = evq->fdset;
     const int npolls = evq->npolls;
     int i, nready;
+    const msec_t loop_timeout = timeout;
 
     timeout = timeout_get(evq->tq, timeout, evq->now);
 
@@ -183,16 +184,17 @@ evq_wait (struct event_queue *evq, msec_t timeout)
 
     if (timeout != TIMEOUT_INFINITE) {
 	if (!nready) {
-	    ev_ready = !evq->tq ? NULL
-	     : timeout_process(evq->tq, NULL, evq->now);
+	    ev_ready = !evq->tq ? evq->ev_ready
+	     : timeout_process(evq->tq, evq->ev_ready, evq->now);
 	    if (ev_ready) goto end;
-	    return EVQ_TIMEOUT;
+	    /* not the caller's timeout: keep waiting */
+	    return (timeout == loop_timeout) ? EVQ_TIMEOUT : 0;
 	}
 
 	timeout = evq->now;
     }
 
-    ev_ready = NULL;
+    ev_ready = evq->ev_ready;  /* triggered by other threads */
     if (fdset[0].revents & POLLIN) {
 	fdset[0].revents = 0;
 	ev_ready = signal_process(evq, ev_ready, timeout);
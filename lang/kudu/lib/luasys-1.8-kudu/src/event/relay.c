@@ -0,0 +1,163 @@
+/* Event Queue: Splice Relay between descriptors */
+
+/*
+ * Each direction moves data from fd[d] to fd[!d] through own kernel
+ * pipe by splice(), so the bytes are never copied to user space.
+ * The events are "rearm"-ed: they are disabled after trigger and
+ * re-armed with the wanted READ/WRITE flags after the pumping.
+ */
+
+#define RELAY_CHUNK	(64 * 1024)  /* default pipe capacity */
+
+static int
+relay_init (struct relay *rl, fd_t a, fd_t b, int64_t budget)
+{
+    int d;
+
+    memset(rl, 0, sizeof(struct relay));
+    rl->pipe[0][0] = rl->pipe[0][1] = (fd_t) -1;
+    rl->pipe[1][0] = rl->pipe[1][1] = (fd_t) -1;
+    rl->fd[0] = a;
+    rl->fd[1] = b;
+    rl->budget = budget;
+
+    for (d = 0; d < 2; ++d) {
+	fd_t *p = rl->pipe[d];
+
+	if (pipe(p)) {
+	    p[0] = p[1] = (fd_t) -1;
+	    return -1;
+	}
+	if (fcntl(p[0], F_SETFL, O_NONBLOCK)
+	 || fcntl(p[1], F_SETFL, O_NONBLOCK))
+	    return -1;
+	/* the socket reads must not block inside of splice() */
+	if (fcntl(rl->fd[d], F_SETFL,
+	 fcntl(rl->fd[d], F_GETFL) | O_NONBLOCK))
+	    return -1;
+    }
+    return 0;
+}
+
+static void
+relay_done (struct relay *rl)
+{
+    int d;
+
+    for (d = 0; d < 2; ++d) {
+	fd_t *p = rl->pipe[d];
+
+	if (p[0] != (fd_t) -1) close(p[0]);
+	if (p[1] != (fd_t) -1) close(p[1]);
+	p[0] = p[1] = (fd_t) -1;
+    }
+}
+
+/*
+ * Move the data of direction d until the source or destination blocks.
+ * Returns: -1, when failed
+ */
+static int
+relay_pump (struct relay *rl, int d)
+{
+    const fd_t src = rl->fd[d], dst = rl->fd[!d];
+    ssize_t n;
+
+    for (; ; ) {
+	if (rl->pending[d]) {
+	    do n = splice(rl->pipe[d][0], NULL, dst, NULL, rl->pending[d],
+	     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	    while (n == -1 && errno == EINTR);
+	    if (n == -1)
+		return SYS_EAGAIN(errno) ? 0 : -1;
+	    rl->pending[d] -= n;
+	    rl->nbytes[d] += n;
+	    continue;
+	}
+	if (rl->eof & (1 << d)) {
+	    if (!(rl->shut & (1 << d))) {
+		rl->shut |= 1 << d;
+		shutdown(dst, SHUT_WR);  /* ENOTSOCK for the pipe is ok */
+	    }
+	    return 0;
+	}
+	if (!rl->budget)
+	    return 0;
+	{
+	    size_t len = RELAY_CHUNK;
+
+	    if (rl->budget > 0 && rl->budget < (int64_t) len)
+		len = (size_t) rl->budget;
+	    do n = splice(src, NULL, rl->pipe[d][1], NULL, len,
+	     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	    while (n == -1 && errno == EINTR);
+	}
+	if (n == -1)
+	    return SYS_EAGAIN(errno) ? 0 : -1;
+	if (!n)
+	    rl->eof |= 1 << d;
+	else {
+	    rl->pending[d] = n;
+	    if (rl->budget > 0) rl->budget -= n;
+	}
+    }
+}
+
+/*
+ * Re-arm the events with the wanted flags.
+ * Returns: -1, when failed
+ */
+static int
+relay_arm (struct relay *rl)
+{
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+	struct event *ev = rl->ev[i];
+	unsigned int flags = 0;
+
+	if (!ev || event_deleted(ev)) continue;
+
+	if (!(rl->eof & (1 << i)) && !rl->pending[i] && rl->budget)
+	    flags |= EVENT_READ;
+	if (rl->pending[!i])
+	    flags |= EVENT_WRITE;
+
+	if (flags != rl->armed[i]) {
+	    if (evq_modify(ev, flags))
+		return -1;
+	    ev->flags &= ~(EVENT_READ | EVENT_WRITE);
+	    ev->flags |= flags;
+	    rl->armed[i] = flags;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Returns: RELAY_PUMP | RELAY_EOF | RELAY_BUDGET | RELAY_ERROR
+ */
+static int
+relay_process (struct relay *rl, struct event *ev, unsigned int ev_flags)
+{
+    const int i = (ev == rl->ev[1]);
+
+    rl->armed[i] = 0;  /* disabled after trigger */
+
+    if (((ev_flags & (EVENT_READ_RES | EVENT_EOF_RES)) && relay_pump(rl, i))
+     || ((ev_flags & (EVENT_WRITE_RES | EVENT_EOF_RES)) && relay_pump(rl, !i))
+     || relay_arm(rl))
+	goto err;
+
+    if (rl->eof == 3 && !rl->pending[0] && !rl->pending[1])
+	return RELAY_EOF;
+    if (!rl->budget && !rl->pending[0] && !rl->pending[1]) {
+	if (rl->paused) return RELAY_PUMP;
+	rl->paused = 1;
+	return RELAY_BUDGET;
+    }
+    return RELAY_PUMP;
+ err:
+    rl->err = errno;
+    return RELAY_ERROR;
+}
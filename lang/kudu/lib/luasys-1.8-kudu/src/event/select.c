@@ -148,6 +148,7 @@ evq_wait (struct event_queue *evq, msec_t timeout)
     struct event **events = evq->events;
     const int npolls = evq->npolls;
     int i, nready;
+    const msec_t loop_timeout = timeout;
 
     int max_fd = evq->max_fd;
 
@@ -181,16 +182,17 @@ evq_wait (struct event_queue *evq, msec_t timeout)
 
     if (tvp) {
 	if (!nready) {
-	    ev_ready = !evq->tq ? NULL
-	     : timeout_process(evq->tq, NULL, evq->now);
+	    ev_ready = !evq->tq ? evq->ev_ready
+	     : timeout_process(evq->tq, evq->ev_ready, evq->now);
 	    if (ev_ready) goto end;
-	    return EVQ_TIMEOUT;
+	    /* not the caller's timeout: keep waiting */
+	    return (timeout == loop_timeout) ? EVQ_TIMEOUT : 0;
 	}
 
 	timeout = evq->now;
     }
 
-    ev_ready = NULL;
+    ev_ready = evq->ev_ready;  /* triggered by other threads */
     if (FD_ISSET(evq->sig_fd[0], &work_readset)) {
 	ev_ready = signal_process(evq, ev_ready, timeout);
 	--nready;
@@ -8,10 +8,50 @@
 
 #define MIN_TIMEOUT	10  /* milliseconds */
 
+#if defined(USE_TIMER_WHEEL) && defined(_WIN32)
+#undef USE_TIMER_WHEEL  /* win32 threads keep own timeout queues */
+#endif
+
+#ifndef USE_TIMER_WHEEL
+
 struct timeout_queue {
     struct timeout_queue *tq_prev, *tq_next;
     struct event *ev_head, *ev_tail;
     msec_t msec;
 };
 
+#define EVENT_TIMEOUT_EXTRA
+#define EVQ_TIMEOUT_EXTRA
+
+#define event_get_timeout(ev)	(ev)->tq->msec
+
+#else
+
+/*
+ * Hierarchical timing wheel: each level has TW_SLOTS slots,
+ * slot of level N spans (TW_SLOTS ^ N) milliseconds.
+ */
+
+#define TW_BITS		5
+#define TW_SLOTS	(1 << TW_BITS)
+#define TW_MASK		(TW_SLOTS - 1)
+#define TW_LEVELS	((32 + TW_BITS - 1) / TW_BITS)
+
+struct timeout_queue {
+    unsigned int curr;  /* time of the wheel */
+    unsigned int pending[TW_LEVELS];  /* bitmaps of non-empty slots */
+    struct event *ev_expired;  /* timeouts already passed by the wheel */
+    struct event *slots[TW_LEVELS][TW_SLOTS];
+};
+
+#define EVENT_TIMEOUT_EXTRA						\
+    msec_t timeout_msec;
+
+#define EVQ_TIMEOUT_EXTRA						\
+    struct timeout_queue tq_wheel;
+
+#define event_get_timeout(ev)	(ev)->timeout_msec
+
+#endif
+
 #endif
@@ -0,0 +1,241 @@
+/* Timeouts: Hierarchical Timing Wheel */
+
+/*
+ * Event is kept at the level of the highest bit differing between
+ * its expiration time and time of the wheel, so its slot is derived
+ * from timeout_at and unlinking does not need a search.
+ */
+
+#define timeout_after(a,b) \
+    ((int) ((unsigned int) (a) - (unsigned int) (b)) > 0)
+
+
+static struct event **
+timeout_slot (struct timeout_queue *tq, const struct event *ev, int *levelp)
+{
+    const unsigned int timeout_at = (unsigned int) ev->timeout_at;
+    unsigned int diff;
+    int level;
+
+    if (!timeout_after(timeout_at, tq->curr)) {
+	*levelp = -1;
+	return &tq->ev_expired;
+    }
+
+    diff = (timeout_at ^ tq->curr) >> TW_BITS;
+    for (level = 0; diff; ++level)
+	diff >>= TW_BITS;
+
+    *levelp = level;
+    return &tq->slots[level][(timeout_at >> (level * TW_BITS)) & TW_MASK];
+}
+
+static void
+timeout_link (struct timeout_queue *tq, struct event *ev)
+{
+    int level;
+    struct event **ev_headp = timeout_slot(tq, ev, &level);
+    struct event *ev_head = *ev_headp;
+
+    if (level != -1) {
+	const unsigned int slot = (unsigned int) (ev_headp - tq->slots[level]);
+	tq->pending[level] |= 1U << slot;
+    }
+
+    ev->prev = NULL;
+    ev->next = ev_head;
+    if (ev_head) ev_head->prev = ev;
+    *ev_headp = ev;
+}
+
+static void
+timeout_unlink (struct timeout_queue *tq, struct event *ev)
+{
+    struct event *ev_prev = ev->prev;
+    struct event *ev_next = ev->next;
+
+    if (ev_prev)
+	ev_prev->next = ev_next;
+    else {
+	int level;
+	struct event **ev_headp = timeout_slot(tq, ev, &level);
+
+	*ev_headp = ev_next;
+	if (!ev_next && level != -1) {
+	    const unsigned int slot = (unsigned int) (ev_headp - tq->slots[level]);
+	    tq->pending[level] &= ~(1U << slot);
+	}
+    }
+
+    if (ev_next)
+	ev_next->prev = ev_prev;
+}
+
+static void
+timeout_reset (struct event *ev, msec_t now)
+{
+    struct timeout_queue *tq = ev->tq;
+    const msec_t msec = ev->timeout_msec;
+
+    if (msec == TIMEOUT_INFINITE)
+	return;
+
+    timeout_unlink(tq, ev);
+    ev->timeout_at = msec + now;
+    timeout_link(tq, ev);
+}
+
+static void
+timeout_del (struct event *ev)
+{
+    struct timeout_queue *tq = ev->tq;
+
+    if (!tq) return;
+    ev->tq = NULL;
+
+    if (ev->timeout_msec != TIMEOUT_INFINITE)
+	timeout_unlink(tq, ev);
+}
+
+static int
+timeout_add (struct event *ev, msec_t msec, msec_t now)
+{
+    struct timeout_queue **tq_headp = &event_get_tq_head(ev);
+    struct timeout_queue *tq = *tq_headp;
+
+    if (!tq) {
+	tq = &event_get_evq(ev)->tq_wheel;
+	memset(tq, 0, sizeof(struct timeout_queue));
+	tq->curr = (unsigned int) now;
+	*tq_headp = tq;
+    }
+
+    ev->tq = tq;
+    ev->timeout_msec = msec;
+    if (msec != TIMEOUT_INFINITE) {
+	ev->timeout_at = msec + now;
+	timeout_link(tq, ev);
+    }
+    return 0;
+}
+
+/*
+ * Returns the nearest expiration time, it is exact for expired events
+ * and the lowest level; higher levels give the start of their slot.
+ */
+static msec_t
+timeout_get (const struct timeout_queue *tq, msec_t min, msec_t now)
+{
+    unsigned int t;
+
+    if (!tq) return min;
+
+    if (tq->ev_expired) {
+	const struct event *ev = tq->ev_expired;
+
+	t = (unsigned int) ev->timeout_at;
+	while ((ev = ev->next)) {
+	    if (timeout_after(t, ev->timeout_at))
+		t = (unsigned int) ev->timeout_at;
+	}
+    } else {
+	int level;
+
+	for (level = 0; level < TW_LEVELS; ++level) {
+	    const unsigned int pending = tq->pending[level];
+
+	    if (pending) {
+		const int shift = level * TW_BITS;
+		const unsigned int curr = tq->curr >> shift;
+		unsigned int slot = curr & TW_MASK;
+
+		do slot = (slot + 1) & TW_MASK;
+		while (!(pending & (1U << slot)));
+
+		t = (curr + ((slot - curr) & TW_MASK)) << shift;
+		break;
+	    }
+	}
+	if (level == TW_LEVELS)
+	    return min;
+    }
+
+    {
+	const int timeout = (int) (t - (unsigned int) now);
+
+	if (timeout <= 0)
+	    return 0;
+	return (min != TIMEOUT_INFINITE && min < timeout) ? min : timeout;
+    }
+}
+
+static struct event *
+timeout_process (struct timeout_queue *tq, struct event *ev_ready, msec_t now)
+{
+    const unsigned int timeout_at = (unsigned int) now + MIN_TIMEOUT;
+    struct event *ev = tq->ev_expired;
+    struct event *ev_todo = NULL;
+
+    tq->ev_expired = NULL;
+    while (ev) {
+	struct event *ev_next = ev->next;
+	ev->next = ev_todo;
+	ev_todo = ev;
+	ev = ev_next;
+    }
+
+    /* collect slots passed by the wheel */
+    if (timeout_after(timeout_at, tq->curr)) {
+	int level;
+
+	for (level = 0; level < TW_LEVELS; ++level) {
+	    const int shift = level * TW_BITS;
+	    unsigned int pending = tq->pending[level];
+	    unsigned int slot;
+
+	    if (!pending) continue;
+
+	    /* less than full turn of the level: slots from curr to timeout_at */
+	    if ((timeout_at >> shift) - (tq->curr >> shift) < TW_SLOTS) {
+		const unsigned int first = (tq->curr >> shift) & TW_MASK;
+		const unsigned int last = (timeout_at >> shift) & TW_MASK;
+		const unsigned int lo = ~((1U << first) - 1);
+		const unsigned int hi = (2U << last) - 1;
+
+		pending &= (first <= last) ? (lo & hi) : (lo | hi);
+	    }
+	    tq->pending[level] &= ~pending;
+
+	    for (slot = 0; pending; ++slot, pending >>= 1) {
+		if (pending & 1) {
+		    struct event **ev_headp = &tq->slots[level][slot];
+
+		    for (ev = *ev_headp; ev; ) {
+			struct event *ev_next = ev->next;
+			ev->next = ev_todo;
+			ev_todo = ev;
+			ev = ev_next;
+		    }
+		    *ev_headp = NULL;
+		}
+	    }
+	}
+	tq->curr = timeout_at;
+    }
+
+    /* fire expired and cascade the rest to lower levels */
+    while (ev_todo) {
+	ev = ev_todo;
+	ev_todo = ev->next;
+
+	if (!timeout_after(ev->timeout_at, timeout_at)) {
+	    ev->flags |= EVENT_ACTIVE | EVENT_TIMEOUT_RES;
+	    ev->timeout_at = ev->timeout_msec + now;
+
+	    ev->next_ready = ev_ready;
+	    ev_ready = ev;
+	}
+	timeout_link(tq, ev);
+    }
+    return ev_ready;
+}
@@ -130,7 +130,7 @@ evq_set_timeout (struct event *ev, msec_t msec)
 	win32thr_sleep(wth);
 
     if (ev->tq) {
-	if (ev->tq->msec == msec) {
+	if (event_get_timeout(ev) == msec) {
 	    timeout_reset(ev, evq->now);
 	    return 0;
 	}
@@ -91,30 +91,118 @@ fcgi_decode_params (lua_State *L, const unsigned char *cp, size_t size)
     return NULL;
 }
 
-static const char *
-fcgi_decode_stdin (lua_State *L, const unsigned char *cp, size_t size)
+/*
+ * Arguments: ..., request (table)
+ * Returns: -1, when the stdin buffer is full | 1, when callback failed
+ */
+static int
+fcgi_decode_stdin (lua_State *L, const unsigned char *cp, size_t size,
+                   int *pause)
 {
-    int concat = 1;
+    const int req = lua_gettop(L);
+
+    /* stream to callback */
+    lua_getfield(L, req, "on_stdin");
+    if (lua_isfunction(L, -1)) {
+	lua_pushvalue(L, req);
+	if (size)
+	    lua_pushlstring(L, (const char *) cp, size);
+	else
+	    lua_pushnil(L);  /* end of stream */
+	if (lua_pcall(L, 2, 1, 0)) {
+	    lua_setfield(L, req, "error");
+	    return 1;
+	}
+	if (lua_isboolean(L, -1) && !lua_toboolean(L, -1))
+	    *pause = 1;
+	lua_settop(L, req);
+	return 0;
+    }
+    lua_pop(L, 1);
 
-    lua_getfield(L, -1, "stdin");
-    if (lua_isnil(L, -1)) {
-	lua_pop(L, 1);
-	concat = 0;
+    /* append to buffer */
+    lua_pushliteral(L, "stdin");
+    lua_rawget(L, req);
+    if (lua_isuserdata(L, -1)) {
+	struct sys_buffer sb;
+
+	sys_buffer_write_init(L, -1, &sb, NULL, 0);
+	if (sb.size < size && !sys_buffer_write_next(L, &sb, NULL, size)) {
+	    lua_settop(L, req);
+	    *pause = 1;
+	    return -1;
+	}
+	memcpy(sb.ptr.w, cp, size);
+	sys_buffer_write_done(L, &sb, NULL, size);
+	lua_settop(L, req);
+	return 0;
     }
+    lua_pop(L, 1);
 
-    lua_pushlstring(L, (const char *) cp, size);
-    if (concat) lua_concat(L, 2);
-    lua_setfield(L, -2, "stdin");
+    /* collect the chunks to join them at the end */
+    lua_pushliteral(L, "stdin_parts");
+    lua_rawget(L, req);
+    if (size) {
+	if (lua_isnil(L, -1)) {
+	    lua_pop(L, 1);
+	    lua_newtable(L);
+	    lua_pushvalue(L, -1);
+	    lua_setfield(L, req, "stdin_parts");
+	}
+	lua_pushlstring(L, (const char *) cp, size);
+	lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+    }
+    else if (!lua_isnil(L, -1)) {
+	const int parts = lua_gettop(L);
+	const int n = lua_objlen(L, parts);
+	luaL_Buffer b;
+	int i;
+
+	luaL_buffinit(L, &b);
+	for (i = 1; i <= n; ++i) {
+	    lua_rawgeti(L, parts, i);
+	    luaL_addvalue(&b);
+	}
+	luaL_pushresult(&b);
+	lua_setfield(L, req, "stdin");
 
+	lua_pushnil(L);
+	lua_setfield(L, req, "stdin_parts");
+    }
+    lua_settop(L, req);
+    return 0;
+}
+
+/*
+ * Arguments: ..., channel (table), request (table)
+ * Returns: error message
+ */
+static const char *
+fcgi_decode_params_end (lua_State *L, int *pause)
+{
+    lua_getfield(L, -2, "on_request");
+    if (!lua_isfunction(L, -1)) {
+	lua_pop(L, 1);
+	return NULL;
+    }
+    lua_pushvalue(L, -2);
+    if (lua_pcall(L, 1, 1, 0)) {
+	lua_setfield(L, -2, "error");
+	return "";
+    }
+    if (lua_isboolean(L, -1) && !lua_toboolean(L, -1))
+	*pause = 1;
+    lua_pop(L, 1);
     return NULL;
 }
 
 /*
  * Arguments: ..., channel (table)
+ * Returns: length of record | 0, when incomplete or the stdin buffer is full
  */
 static int
 fcgi_decode_record (lua_State *L, const unsigned char *cp, size_t size,
-                    unsigned int *ready_request_id)
+                    unsigned int *ready_request_id, int *pause)
 {
     unsigned int version, type, request_id, content_len, padding_len, len;
     int is_ready = 0;
@@ -133,7 +221,18 @@ fcgi_decode_record (lua_State *L, const unsigned char *cp, size_t size,
     if (len > size) return 0;
 
     lua_rawgeti(L, -1, request_id);
-    if (!lua_istable(L, -1)) {
+    if (lua_istable(L, -1) && type != FCGI_BEGIN_REQUEST) {
+	/* the request is already given out */
+	lua_pushliteral(L, "next_ready");
+	lua_rawget(L, -2);
+	if (!lua_isnil(L, -1)) {
+	    lua_pop(L, 2);
+	    return len;
+	}
+	lua_pop(L, 1);
+    }
+    else {
+	/* new request replaces the completed one with the same id */
 	lua_pop(L, 1);
 	lua_newtable(L);
 	lua_pushvalue(L, -1);
@@ -157,16 +256,25 @@ fcgi_decode_record (lua_State *L, const unsigned char *cp, size_t size,
 	    err = fcgi_decode_begin_request(L, cp, content_len);
 	    break;
 	case FCGI_ABORT_REQUEST:
+	    err = "aborted";
 	    break;
 	case FCGI_PARAMS:
 	    if (content_len)
 		err = fcgi_decode_params(L, cp, content_len);
+	    else
+		err = fcgi_decode_params_end(L, pause);
 	    break;
 	case FCGI_STDIN:
-	    if (content_len)
-		err = fcgi_decode_stdin(L, cp, content_len);
-	    else
-		is_ready = 1;
+	    switch (fcgi_decode_stdin(L, cp, content_len, pause)) {
+	    case -1:
+		lua_pop(L, 1);
+		return 0;
+	    case 1:
+		err = "";  /* message is set */
+		break;
+	    default:
+		if (!content_len) is_ready = 1;
+	    }
 	    break;
 	default:
 	    err = "bad type";
@@ -174,8 +282,10 @@ fcgi_decode_record (lua_State *L, const unsigned char *cp, size_t size,
     }
 
     if (err) {
-	lua_pushstring(L, err);
-	lua_setfield(L, -2, "error");
+	if (*err) {
+	    lua_pushstring(L, err);
+	    lua_setfield(L, -2, "error");
+	}
 
 	/*
 	lua_pushinteger(L, version);
@@ -194,7 +304,7 @@ fcgi_decode_record (lua_State *L, const unsigned char *cp, size_t size,
 	if (*ready_request_id != FCGI_NULL_REQUEST_ID)
 	    lua_pushinteger(L, *ready_request_id);
 	else
-	    lua_pushnil(L);
+	    lua_pushboolean(L, 0);  /* the last in chain */
 	lua_setfield(L, -2, "next_ready");
 
 	*ready_request_id = request_id;
@@ -205,7 +315,12 @@ fcgi_decode_record (lua_State *L, const unsigned char *cp, size_t size,
 
 /*
  * Arguments: {string | membuf_udata}, channel (table)
- * Returns: [request_id (number)]
+ * Returns: [request_id (number)], [paused (boolean)]
+ *
+ * Channel's on_request(request) is called when the parameters are decoded;
+ * stdin is streamed to request's on_stdin(request, string | nil)
+ * or appended to request.stdin (membuf_udata).
+ * Decoding is paused when they return false or the buffer can't grow.
  */
 static int
 fcgi_decode (lua_State *L)
@@ -213,15 +328,17 @@ fcgi_decode (lua_State *L)
     struct sys_buffer sb;
     const char *cp;
     unsigned int ready_request_id = FCGI_NULL_REQUEST_ID;
+    int pause = 0;
 
     if (!sys_buffer_read_init(L, 1, &sb))
 	return 0;
     luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
 
     cp = sb.ptr.r;
-    while (sb.size >= FCGI_HEADER_LEN) {
+    while (sb.size >= FCGI_HEADER_LEN && !pause) {
 	const int len = fcgi_decode_record(L,
-	 (const unsigned char *) cp, sb.size, &ready_request_id);
+	 (const unsigned char *) cp, sb.size, &ready_request_id, &pause);
 
 	if (!len) break;
 	cp += len;
@@ -229,17 +346,106 @@ fcgi_decode (lua_State *L)
     }
     sys_buffer_read_next(&sb, cp - sb.ptr.r);
 
-    if (ready_request_id != FCGI_NULL_REQUEST_ID) {
+    if (ready_request_id != FCGI_NULL_REQUEST_ID)
 	lua_pushinteger(L, ready_request_id);
-	return 1;
-    }
-    return 0;
+    else if (pause)
+	lua_pushnil(L);
+    else
+	return 0;
+    if (!pause) return 1;
+    lua_pushboolean(L, 1);
+    return 2;
 }
 
 
+static void
+fcgi_encode_header (unsigned char *cp, int type, unsigned int request_id,
+                    size_t content_len)
+{
+    *cp++ = FCGI_VERSION;
+    *cp++ = (unsigned char) type;
+    *cp++ = (unsigned char) (request_id >> 8);
+    *cp++ = (unsigned char) request_id;
+    *cp++ = (unsigned char) (content_len >> 8);
+    *cp++ = (unsigned char) content_len;
+    *cp++ = 0;  /* padding_len */
+    *cp = 0;  /* reserved */
+}
+
+/*
+ * Arguments: list (table), request_id (number),
+ *	[{string | membuf_udata} ...]
+ * Returns: list (table)
+ *
+ * Append the records for gathered sd:send(list): the data of buffers
+ * is not copied, but listed as parts {membuf_udata, count}.
+ * Each record of up to 64 KiB takes two entries of the list, which is
+ * sent by SYS_IOV_MAX entries.
+ * No data ends the request.
+ */
+static int
+fcgi_encode_list (lua_State *L)
+{
+    const unsigned int request_id = lua_tointeger(L, 2);
+    const int nargs = lua_gettop(L);
+    int i, n = lua_objlen(L, 1);
+
+    for (i = 3; i <= nargs; ++i) {
+	struct sys_buffer sb;
+	size_t off, len;
+
+	if (!sys_buffer_read_init(L, i, &sb))
+	    luaL_typerror(L, i, "string or membuf");
+
+	for (off = 0; off < sb.size; off += len) {
+	    unsigned char header[FCGI_HEADER_LEN];
+
+	    len = sb.size - off;
+	    if (len > FCGI_MAX_CONTENT_LEN)
+		len = FCGI_MAX_CONTENT_LEN;
+
+	    fcgi_encode_header(header, FCGI_STDOUT, request_id, len);
+	    lua_pushlstring(L, (const char *) header, FCGI_HEADER_LEN);
+	    lua_rawseti(L, 1, ++n);
+
+	    if (sb.mb) {
+		lua_createtable(L, 2, 0);
+		lua_pushvalue(L, i);
+		lua_rawseti(L, -2, 1);
+		lua_pushinteger(L, len);
+		lua_rawseti(L, -2, 2);
+		lua_rawseti(L, 1, ++n);
+	    }
+	    else {
+		if (len == sb.size)
+		    lua_pushvalue(L, i);
+		else
+		    lua_pushlstring(L, sb.ptr.r + off, len);
+		lua_rawseti(L, 1, ++n);
+	    }
+	}
+    }
+    if (nargs < 3) {
+	unsigned char rec[2 * FCGI_HEADER_LEN + FCGI_END_REQUEST_LEN];
+
+	fcgi_encode_header(rec, FCGI_STDOUT, request_id, 0);
+	fcgi_encode_header(rec + FCGI_HEADER_LEN, FCGI_END_REQUEST,
+	 request_id, FCGI_END_REQUEST_LEN);
+	memset(rec + 2 * FCGI_HEADER_LEN, 0, FCGI_END_REQUEST_LEN);
+
+	lua_pushlstring(L, (const char *) rec, sizeof(rec));
+	lua_rawseti(L, 1, ++n);
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
 /*
  * Arguments: membuf_udata, request_id (number), prev_offset (number), string
  * Returns: offset (number)
+ *
+ * Arguments: list (table), ... (see fcgi_encode_list)
+ * Returns: list (table)
  */
 static int
 fcgi_encode (lua_State *L)
@@ -254,6 +460,9 @@ fcgi_encode (lua_State *L)
     unsigned char *lenp;
     int data_len, padding_len;
 
+    if (lua_istable(L, 1))
+	return fcgi_encode_list(L);
+
     if (len > FCGI_MAX_CONTENT_LEN)
 	luaL_argerror(L, 4, "too long");
 
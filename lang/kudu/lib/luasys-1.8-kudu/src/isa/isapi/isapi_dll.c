@@ -93,7 +93,7 @@ lisapi_init (void)
 
 	g_ISAPI.nthreads = 0;
 	g_ISAPI.L = L;
-	sys_vm_leave();
+	sys_vm2_leave(g_ISAPI.vmtd);
 	sys_set_thread(NULL);
 	return 0;
     }
@@ -253,6 +253,10 @@ createmeta (lua_State *L)
 	{PID_TYPENAME,		pid_meth,	1},
 	{RAND_TYPENAME,		rand_meth,	0},
 	{LOG_TYPENAME,		log_meth,	0},
+	{MEMPOOL_TYPENAME,	mempool_meth,	1},
+#ifdef EVQ_RELAY
+	{RELAY_TYPENAME,	relay_meth,	1},
+#endif
     };
     int i;
 
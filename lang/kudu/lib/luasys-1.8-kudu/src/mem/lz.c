@@ -0,0 +1,209 @@
+/* Lua System: Memory Buffers: LZ Block Codec */
+
+/*
+ * Block: sequences of a token (literal run length, match length - 4),
+ * extra length bytes, the literals, 16-bit offset of the match and
+ * extra length bytes; the last 5 bytes are literals.
+ *
+ * Frame: raw length and stored length (4 bytes little-endian each),
+ * the stored bytes: block or raw bytes when the block is not smaller.
+ */
+
+#define LZ_HASHLOG	13
+#define LZ_MINMATCH	4
+#define LZ_LASTLIT	5   /* trailing literals */
+#define LZ_MFLIMIT	12  /* no match starts in the last bytes */
+#define LZ_MAXOFFSET	65535
+
+#define LZ_HEADER	8
+#define LZ_FRAME_MAX	(1 << 26)  /* maximal raw length of frame */
+
+#define lz_bound(n)	((n) + (n) / 255 + 16)
+
+
+static unsigned int
+lz_read32 (const unsigned char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static unsigned int
+lz_hash (unsigned int v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASHLOG);
+}
+
+static unsigned char *
+lz_putlen (unsigned char *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+	*op++ = 255;
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+/*
+ * Compress n bytes to dst of lz_bound(n) bytes.
+ * Returns: compressed length
+ */
+static size_t
+lz_compress (const char *src, size_t n, char *dst)
+{
+    unsigned int table[1 << LZ_HASHLOG];
+    const unsigned char *base = (const unsigned char *) src;
+    const unsigned char *iend = base + n;
+    const unsigned char *ip = base, *anchor = base;
+    unsigned char *op = (unsigned char *) dst;
+    size_t lit;
+
+    memset(table, 0, sizeof(table));
+    if (n > LZ_MFLIMIT) {
+	const unsigned char *mflimit = iend - LZ_MFLIMIT;
+	const unsigned char *matchlimit = iend - LZ_LASTLIT;
+
+	ip++;
+	while (ip < mflimit) {
+	    const unsigned int seq = lz_read32(ip);
+	    const unsigned int h = lz_hash(seq);
+	    const unsigned char *ref = base + table[h];
+	    const unsigned char *mp;
+	    unsigned char *token;
+	    size_t len, off;
+
+	    table[h] = ip - base;
+	    if (ref >= ip || ip - ref > LZ_MAXOFFSET || lz_read32(ref) != seq) {
+		/* skip faster through the incompressible data */
+		ip += 1 + ((ip - anchor) >> 6);
+		continue;
+	    }
+	    while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+		ip--;
+		ref--;
+	    }
+	    mp = ip + LZ_MINMATCH;
+	    off = LZ_MINMATCH;
+	    while (mp < matchlimit && *mp == ref[off]) {
+		mp++;
+		off++;
+	    }
+
+	    lit = ip - anchor;
+	    len = mp - ip - LZ_MINMATCH;
+	    token = op++;
+	    *token = (lit < 15 ? lit : 15) << 4;
+	    if (lit >= 15) op = lz_putlen(op, lit - 15);
+	    memcpy(op, anchor, lit);
+	    op += lit;
+	    off = ip - ref;
+	    *op++ = (unsigned char) off;
+	    *op++ = (unsigned char) (off >> 8);
+	    *token |= (len < 15 ? len : 15);
+	    if (len >= 15) op = lz_putlen(op, len - 15);
+
+	    ip = anchor = mp;
+	    if (ip < mflimit)
+		table[lz_hash(lz_read32(ip - 2))] = ip - 2 - base;
+	}
+    }
+    lit = iend - anchor;
+    *op++ = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15) op = lz_putlen(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - (unsigned char *) dst;
+}
+
+/*
+ * Returns: 0, unless the block decodes to exactly n bytes
+ */
+static int
+lz_decompress (const char *src, size_t len, char *dst, size_t n)
+{
+    const unsigned char *ip = (const unsigned char *) src;
+    const unsigned char *iend = ip + len;
+    unsigned char *op = (unsigned char *) dst;
+    unsigned char *oend = op + n;
+
+    for (; ; ) {
+	const unsigned char *ref;
+	unsigned int token;
+	size_t lit, mlen, off;
+	unsigned char b;
+
+	if (ip >= iend) return 0;
+	token = *ip++;
+	lit = token >> 4;
+	if (lit == 15) {
+	    do {
+		if (ip >= iend) return 0;
+		lit += b = *ip++;
+	    } while (b == 255);
+	}
+	if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op))
+	    return 0;
+	memcpy(op, ip, lit);
+	op += lit;
+	ip += lit;
+	if (ip == iend) return op == oend;
+
+	if (iend - ip < 2) return 0;
+	off = ip[0] | (ip[1] << 8);
+	ip += 2;
+	if (!off || off > (size_t) (op - (unsigned char *) dst))
+	    return 0;
+	mlen = token & 15;
+	if (mlen == 15) {
+	    do {
+		if (ip >= iend) return 0;
+		mlen += b = *ip++;
+	    } while (b == 255);
+	}
+	mlen += LZ_MINMATCH;
+	if (mlen > (size_t) (oend - op)) return 0;
+	ref = op - off;
+	if (off >= mlen) {
+	    memcpy(op, ref, mlen);
+	    op += mlen;
+	} else {
+	    while (mlen--)
+		*op++ = *ref++;
+	}
+    }
+}
+
+static void
+lz_put32 (char *p, size_t v)
+{
+    p[0] = (char) v;
+    p[1] = (char) (v >> 8);
+    p[2] = (char) (v >> 16);
+    p[3] = (char) (v >> 24);
+}
+
+static size_t
+lz_get32 (const char *p)
+{
+    const unsigned char *u = (const unsigned char *) p;
+    return u[0] | ((size_t) u[1] << 8) | ((size_t) u[2] << 16)
+     | ((size_t) u[3] << 24);
+}
+
+/*
+ * Compress n bytes to the frame in dst of LZ_HEADER + lz_bound(n) bytes.
+ * Returns: frame length
+ */
+static size_t
+lz_frame (const char *src, size_t n, char *dst)
+{
+    size_t z = lz_compress(src, n, dst + LZ_HEADER);
+
+    if (z >= n) {
+	memcpy(dst + LZ_HEADER, src, n);
+	z = n;
+    }
+    lz_put32(dst, n);
+    lz_put32(dst + 4, z);
+    return LZ_HEADER + z;
+}
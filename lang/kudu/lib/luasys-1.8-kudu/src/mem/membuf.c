@@ -9,9 +9,12 @@
 static int
 stream_write (lua_State *L, struct membuf *mb)
 {
-    const int bufio = (mb->flags & SYSMEM_OSTREAM_BUFIO);
+    const int lz = (mb->flags & SYSMEM_OSTREAM_LZ);
+    const int bufio = !lz && (mb->flags & SYSMEM_OSTREAM_BUFIO);
     int res;
 
+    if (lz && !mb->offset) return 1;
+
     lua_getfenv(L, 1);
     lua_rawgeti(L, -1, SYSMEM_OUTPUT);  /* stream object */
     lua_getfield(L, -1, "write");
@@ -19,7 +22,22 @@ stream_write (lua_State *L, struct membuf *mb)
 
     if (bufio)
 	lua_pushvalue(L, 1);
-    else
+    else if (lz) {
+	const size_t n = mb->offset;
+	size_t i, len = 0;
+	char *z = malloc((n / LZ_FRAME_MAX + 1) * LZ_HEADER + lz_bound(n));
+
+	if (!z) {
+	    lua_pop(L, 3);
+	    return 0;
+	}
+	for (i = 0; i < n; i += LZ_FRAME_MAX) {
+	    const size_t k = (n - i < LZ_FRAME_MAX) ? n - i : LZ_FRAME_MAX;
+	    len += lz_frame(mb->data + i, k, z + len);
+	}
+	lua_pushlstring(L, z, len);
+	free(z);
+    } else
 	lua_pushlstring(L, mb->data, mb->offset);
     lua_call(L, 2, 1);
 
@@ -300,19 +318,27 @@ membuf_reverse (lua_State *L)
 
 
 /*
- * Arguments: membuf_udata, stream
+ * Arguments: membuf_udata, stream, [filter (string: "lz")]
  */
 static int
 membuf_assosiate (lua_State *L, int type)
 {
     struct membuf *mb = checkudata(L, 1, MEM_TYPENAME);
     const int idx = (type == SYSMEM_ISTREAM) ? SYSMEM_INPUT : SYSMEM_OUTPUT;
+    const int lz = (type == SYSMEM_ISTREAM)
+     ? SYSMEM_ISTREAM_LZ : SYSMEM_OSTREAM_LZ;
+    const char *filter = luaL_optstring(L, 3, NULL);
+
+    if (filter && strcmp(filter, "lz"))
+	luaL_argerror(L, 3, "unknown filter");
 
     lua_settop(L, 2);
+    mb->flags &= ~lz;
     if (lua_isnoneornil(L, 2))
 	mb->flags &= ~type;
     else {
 	mb->flags |= type;
+	if (filter) mb->flags |= lz;
 
 	lua_getfield(L, -1, SYS_BUFIO_TAG);
 	if (!lua_isnil(L, -1)) {
@@ -335,7 +361,7 @@ membuf_assosiate (lua_State *L, int type)
 }
 
 /*
- * Arguments: membuf_udata, consumer_stream
+ * Arguments: membuf_udata, consumer_stream, [filter (string)]
  */
 static int
 membuf_output (lua_State *L)
@@ -344,7 +370,7 @@ membuf_output (lua_State *L)
 }
 
 /*
- * Arguments: membuf_udata, producer_stream
+ * Arguments: membuf_udata, producer_stream, [filter (string)]
  */
 static int
 membuf_input (lua_State *L)
@@ -376,12 +402,81 @@ stream_read (lua_State *L, size_t l, const int bufio)
     lua_call(L, nargs, 1);
 }
 
+/*
+ * Arguments: membuf_udata, ..., function, stream
+ * Returns: string of n bytes, shorter at the end of stream
+ */
+static size_t
+lz_read (lua_State *L, size_t n)
+{
+    const int top = lua_gettop(L);
+    size_t len = 0;
+
+    while (len < n) {
+	size_t l;
+
+	lua_pushvalue(L, top - 1);
+	lua_pushvalue(L, top);
+	lua_pushinteger(L, n - len);
+	lua_call(L, 2, 1);
+	lua_tolstring(L, -1, &l);
+	if (!l) {
+	    lua_pop(L, 1);
+	    break;
+	}
+	len += l;
+    }
+    lua_concat(L, lua_gettop(L) - top);
+    return len;
+}
+
+/*
+ * Arguments: membuf_udata, ..., function, stream
+ * Returns: 0 at the end of stream
+ */
+static int
+lz_fill (lua_State *L, struct membuf *mb)
+{
+    const char *s;
+    size_t n, z;
+
+    if (!lz_read(L, LZ_HEADER)) {
+	lua_pop(L, 1);
+	return 0;
+    }
+    s = lua_tostring(L, -1);
+    if (lua_rawlen(L, -1) != LZ_HEADER)
+	luaL_error(L, "truncated frame");
+    n = lz_get32(s);
+    z = lz_get32(s + 4);
+    lua_pop(L, 1);
+    if (z > n || n > LZ_FRAME_MAX)
+	luaL_error(L, "bad frame");
+
+    if (lz_read(L, z) != z)
+	luaL_error(L, "truncated frame");
+    s = lua_tostring(L, -1);
+    if (!membuf_addlstring(L, mb, NULL, n))
+	luaL_error(L, "buffer too small");
+    if (z == n)
+	memcpy(mb->data + mb->offset, s, n);
+    else if (!lz_decompress(s, z, mb->data + mb->offset, n))
+	luaL_error(L, "bad frame");
+    mb->offset += n;
+    lua_pop(L, 1);
+    return 1;
+}
+
 static int
 read_bytes (lua_State *L, struct membuf *mb, size_t l)
 {
     int n = mb->offset;
 
-    if (!n && (mb->flags & SYSMEM_ISTREAM)) {
+    if (mb->flags & SYSMEM_ISTREAM_LZ) {
+	while (!mb->offset && lz_fill(L, mb))
+	    continue;
+	n = mb->offset;
+    } else if (!n && (mb->flags & SYSMEM_ISTREAM)) {
 	stream_read(L, l, (mb->flags & SYSMEM_ISTREAM_BUFIO));
 	return 1;
     }
@@ -392,7 +487,7 @@ read_bytes (lua_State *L, struct membuf *mb, size_t l)
 	lua_pushlstring(L, p, l);
 	n -= l;
 	mb->offset = n;
-	if (n) memmove(p, p + 1, n);
+	if (n) memmove(p, p + l, n);
     } else
 	lua_pushnil(L);
     return 1;
@@ -401,8 +496,18 @@ read_bytes (lua_State *L, struct membuf *mb, size_t l)
 static int
 read_line (lua_State *L, struct membuf *mb)
 {
-    const char *nl, *s = mb->data;
-    size_t l, n = mb->offset;
+    const char *nl, *s;
+    size_t l, n;
+
+    if (mb->flags & SYSMEM_ISTREAM_LZ) {
+	size_t from = 0;
+	while (!memchr(mb->data + from, '\n', mb->offset - from)) {
+	    from = mb->offset;
+	    if (!lz_fill(L, mb)) break;
+	}
+    }
+    s = mb->data;
+    n = mb->offset;
 
     if (n && (nl = memchr(s, '\n', n))) {
 	char *p = mb->data;  /* avoid warning */
@@ -413,7 +518,7 @@ read_line (lua_State *L, struct membuf *mb)
 	if (n) memmove(p, nl + 1, n);
 	return 1;
     }
-    if (!(mb->flags & SYSMEM_ISTREAM)) {
+    if (!(mb->flags & SYSMEM_ISTREAM) || (mb->flags & SYSMEM_ISTREAM_LZ)) {
 	n = 1;
 	goto end;
     }
@@ -474,6 +579,10 @@ membuf_read (lua_State *L)
 	case 'l':
 	    return read_line(L, mb);
 	case 'a':
+	    if (mb->flags & SYSMEM_ISTREAM_LZ) {
+		while (lz_fill(L, mb))
+		    continue;
+	    }
 	    read_bytes(L, mb, ~((size_t) 0));
 	    break;
 	default:
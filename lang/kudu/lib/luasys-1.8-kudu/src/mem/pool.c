@@ -0,0 +1,309 @@
+/* Lua System: Memory Buffers: Receive Buffer Pool */
+
+/*
+ * Fixed-size buffers are carved from shared slabs and handed out as
+ * pointers (membuf_udata), so small receive buffers cost one allocation
+ * per slab and none per read.
+ *
+ * Pool environ. table: [1 .. nfree] = free buffers,
+ *	[membuf_udata] = true (in use) | false (free).
+ */
+
+#define MEMPOOL_TYPENAME	"sys.mem.pool"
+
+#define MEMPOOL_SLABSIZE	(64 * 1024)
+
+struct mempool {
+    size_t size;  /* buffer size */
+    int count;  /* buffers per slab */
+    int nfree;  /* number of free buffers */
+    int nslabs;
+    char **slabs;
+};
+
+/* Pooled buffer */
+struct mempool_buf {
+    struct membuf mb;
+    char *chunk;  /* memory of buffer in slab */
+};
+
+
+static struct mempool *
+mempool_topool (lua_State *L, int idx)
+{
+    struct mempool *mp = lua_touserdata(L, idx);
+
+    if (mp && lua_getmetatable(L, idx)) {
+	int is_pool;
+
+	luaL_getmetatable(L, MEMPOOL_TYPENAME);
+	is_pool = lua_rawequal(L, -2, -1);
+	lua_pop(L, 2);
+	if (is_pool) return mp;
+    }
+    return NULL;
+}
+
+static void
+mempool_reset (struct mempool_buf *pb, size_t size)
+{
+    struct membuf *mb = &pb->mb;
+
+    if ((mb->flags & SYSMEM_ALLOC) && mb->data != pb->chunk)
+	free(mb->data);
+    mb->data = pb->chunk;
+    mb->len = (int) size;
+    mb->offset = 0;
+    mb->flags = SYSMEM_TCHAR;
+}
+
+/*
+ * Arguments: ..., environ. (table)
+ * Returns: 0, when out of memory
+ */
+static int
+mempool_grow (lua_State *L, struct mempool *mp)
+{
+    const int env_idx = lua_gettop(L);
+    char **slabs = realloc(mp->slabs, (mp->nslabs + 1) * sizeof(char *));
+    char *slab;
+    int i;
+
+    if (!slabs) return 0;
+    mp->slabs = slabs;
+    slab = malloc(mp->count * mp->size);
+    if (!slab) return 0;
+    slabs[mp->nslabs++] = slab;
+
+    luaL_getmetatable(L, MEM_TYPENAME);
+    for (i = 0; i < mp->count; ++i) {
+	struct mempool_buf *pb = lua_newuserdata(L, sizeof(struct mempool_buf));
+
+	memset(pb, 0, sizeof(struct mempool_buf));
+	pb->chunk = slab + i * mp->size;
+	mempool_reset(pb, mp->size);
+	lua_pushvalue(L, -2);
+	lua_setmetatable(L, -2);
+
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, env_idx, ++mp->nfree);
+	lua_pushboolean(L, 0);
+	lua_rawset(L, env_idx);
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+
+/*
+ * Push the free buffer from the pool.
+ * Arguments: ..., pool_udata, ...
+ * Returns: 1 | 0, when idx is not a pool | -1, when out of memory
+ */
+int
+sys_buffer_pool_get (lua_State *L, int idx)
+{
+    struct mempool *mp = mempool_topool(L, idx);
+
+    if (!mp) return 0;
+
+    lua_getfenv(L, idx);
+    if (!mp->nfree && !mempool_grow(L, mp)) {
+	lua_pop(L, 1);
+	return -1;
+    }
+    lua_rawgeti(L, -1, mp->nfree);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, mp->nfree--);
+
+    lua_pushvalue(L, -1);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -4);
+    lua_remove(L, -2);
+    return 1;
+}
+
+/*
+ * Return the buffer to the pool.
+ * Arguments: ..., pool_udata, ..., membuf_udata, ...
+ * Returns: 0, when the buffer is not in use from the pool
+ */
+int
+sys_buffer_pool_put (lua_State *L, int idx, int buf_idx)
+{
+    struct mempool *mp = lua_touserdata(L, idx);
+    int res;
+
+    lua_getfenv(L, idx);
+    lua_pushvalue(L, buf_idx);
+    lua_rawget(L, -2);
+    res = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    if (res) {
+	mempool_reset(lua_touserdata(L, buf_idx), mp->size);
+
+	lua_pushvalue(L, buf_idx);
+	lua_pushboolean(L, 0);
+	lua_rawset(L, -3);
+	lua_pushvalue(L, buf_idx);
+	lua_rawseti(L, -2, ++mp->nfree);
+    }
+    lua_pop(L, 1);
+    return res;
+}
+
+
+/*
+ * Returns: pool_udata
+ */
+static void
+mempool_new (lua_State *L, size_t size, int count)
+{
+    struct mempool *mp = lua_newuserdata(L, sizeof(struct mempool));
+
+    memset(mp, 0, sizeof(struct mempool));
+    mp->size = size;
+    mp->count = (count > 0) ? count
+     : (size < MEMPOOL_SLABSIZE) ? (int) (MEMPOOL_SLABSIZE / size) : 1;
+
+    luaL_getmetatable(L, MEMPOOL_TYPENAME);
+    lua_setmetatable(L, -2);
+
+    lua_newtable(L);
+    lua_setfenv(L, -2);
+}
+
+/*
+ * Arguments: [buffer_size (number), slab_buffers (number)]
+ * Returns: pool_udata
+ */
+static int
+mempool_create (lua_State *L)
+{
+    const lua_Integer size = luaL_optinteger(L, 1, SYS_BUFSIZE);
+    const lua_Integer count = luaL_optinteger(L, 2, 0);
+
+    luaL_argcheck(L, size > 0 && (int) size == size, 1, "invalid size");
+    luaL_argcheck(L, count >= 0 && (int) count == count, 2, "invalid count");
+
+    mempool_new(L, (size_t) size, (int) count);
+    return 1;
+}
+
+/*
+ * Arguments: pool_udata
+ * Returns: [membuf_udata]
+ */
+static int
+mempool_get (lua_State *L)
+{
+    (void) checkudata(L, 1, MEMPOOL_TYPENAME);
+
+    if (sys_buffer_pool_get(L, 1) > 0)
+	return 1;
+    return sys_seterror(L, SYS_ENOMEM);
+}
+
+/*
+ * Arguments: pool_udata, membuf_udata ...
+ * Returns: pool_udata
+ */
+static int
+mempool_put (lua_State *L)
+{
+    const int top = lua_gettop(L);
+    int i;
+
+    (void) checkudata(L, 1, MEMPOOL_TYPENAME);
+
+    for (i = 2; i <= top; ++i) {
+	if (!sys_buffer_pool_put(L, 1, i))
+	    luaL_argerror(L, i, "buffer is not in use from the pool");
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: pool_udata
+ * Returns: buffer_size (number), total_buffers (number),
+ *	free_buffers (number)
+ */
+static int
+mempool_stats (lua_State *L)
+{
+    struct mempool *mp = checkudata(L, 1, MEMPOOL_TYPENAME);
+
+    lua_pushinteger(L, mp->size);
+    lua_pushinteger(L, mp->nslabs * mp->count);
+    lua_pushinteger(L, mp->nfree);
+    return 3;
+}
+
+/*
+ * Arguments: pool_udata
+ * Returns: free_buffers (number)
+ */
+static int
+mempool_length (lua_State *L)
+{
+    struct mempool *mp = checkudata(L, 1, MEMPOOL_TYPENAME);
+
+    lua_pushinteger(L, mp->nfree);
+    return 1;
+}
+
+/*
+ * Arguments: pool_udata
+ */
+static int
+mempool_done (lua_State *L)
+{
+    struct mempool *mp = checkudata(L, 1, MEMPOOL_TYPENAME);
+
+    if (!mp->slabs) return 0;
+
+    /* buffers, which are still in use, become closed pointers */
+    lua_getfenv(L, 1);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+	if (lua_type(L, -2) == LUA_TUSERDATA) {
+	    struct mempool_buf *pb = lua_touserdata(L, -2);
+
+	    mempool_reset(pb, 0);
+	    pb->mb.data = NULL;
+	}
+	lua_pop(L, 1);
+    }
+
+    while (mp->nslabs)
+	free(mp->slabs[--mp->nslabs]);
+    free(mp->slabs);
+    mp->slabs = NULL;
+    mp->nfree = 0;
+    return 0;
+}
+
+/*
+ * Arguments: pool_udata
+ * Returns: string
+ */
+static int
+mempool_tostring (lua_State *L)
+{
+    struct mempool *mp = checkudata(L, 1, MEMPOOL_TYPENAME);
+
+    lua_pushfstring(L, MEMPOOL_TYPENAME " (%p)", mp);
+    return 1;
+}
+
+
+static luaL_reg mempool_meth[] = {
+    {"get",		mempool_get},
+    {"put",		mempool_put},
+    {"stats",		mempool_stats},
+    {"__len",		mempool_length},
+    {"__gc",		mempool_done},
+    {"__tostring",	mempool_tostring},
+    {NULL, NULL}
+};
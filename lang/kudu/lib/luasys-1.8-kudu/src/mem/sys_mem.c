@@ -47,6 +47,8 @@ struct membuf {
 #define SYSMEM_OSTREAM		0x200000  /* buffer assosiated with output stream */
 #define SYSMEM_ISTREAM_BUFIO	0x400000  /* input stream can operate with buffers */
 #define SYSMEM_OSTREAM_BUFIO	0x800000  /* output stream can operate with buffers */
+#define SYSMEM_ISTREAM_LZ	0x1000000  /* input stream of compressed frames */
+#define SYSMEM_OSTREAM_LZ	0x2000000  /* output stream of compressed frames */
     unsigned int flags;
 };
 
@@ -164,9 +166,13 @@ sys_buffer_write_next (lua_State *L, struct sys_buffer *sb,
     struct membuf *mb = sb->mb;
 
     if (mb) {
+	const int offset = mb->offset;
+
 	if (!buflen) mb->offset = mb->len;
-	if (!membuf_addlstring(L, mb, NULL, buflen))
+	if (!membuf_addlstring(L, mb, NULL, buflen)) {
+	    mb->offset = offset;  /* fixed buffer is full */
 	    return 0;
+	}
 	sb->ptr.w = mb->data + mb->offset;
 	sb->size = mb->len - mb->offset;
     }
@@ -217,6 +223,154 @@ sys_buffer_write_done (lua_State *L, struct sys_buffer *sb,
 }
 
 
+/*
+ * Gather the strings and buffers to write up to SYS_IOV_MAX.
+ * A part of buffer is limited by count, the next listing of the same
+ * buffer continues after it.
+ * Arguments: ..., {string | membuf_udata
+ *	| part (table: {membuf_udata, count (number)})} ...
+ * Returns: index of the next argument
+ */
+int
+sys_buffer_readv_init (lua_State *L, int idx, int last,
+                       struct sys_vbuffer *vb)
+{
+    vb->n = 0;
+    vb->size = 0;
+    for (; idx <= last && vb->n < SYS_IOV_MAX; ++idx) {
+	struct sys_buffer sb;
+	size_t count = (size_t) -1;
+
+	if (lua_istable(L, idx)) {
+	    int res;
+
+	    luaL_checkstack(L, 4, NULL);
+	    lua_rawgeti(L, idx, 1);
+	    lua_rawgeti(L, idx, 2);
+	    if (lua_type(L, -1) != LUA_TNUMBER)
+		luaL_argerror(L, idx, "count expected");
+	    count = (size_t) lua_tointeger(L, -1);
+	    res = sys_buffer_read_init(L, -2, &sb);
+	    lua_pop(L, 2);  /* the table keeps the buffer */
+	    if (!res) luaL_argerror(L, idx, "buffer expected");
+	}
+	else if (!sys_buffer_read_init(L, idx, &sb))
+	    continue;
+
+	if (sb.mb) {
+	    int i;
+
+	    for (i = 0; i < vb->n; ++i) {
+		if (vb->mb[i] == sb.mb) {
+		    const size_t len = sys_iov_len(&vb->iov[i]);
+
+		    sb.ptr.r += len;
+		    sb.size -= len;
+		}
+	    }
+	}
+	if (sb.size > count) sb.size = count;
+	if (!sb.size) continue;
+	sys_iov_set(&vb->iov[vb->n], sb.ptr.r, sb.size);
+	vb->mb[vb->n++] = sb.mb;
+	vb->size += sb.size;
+    }
+    return idx;
+}
+
+/*
+ * Consume n bytes written from the buffers.
+ * The tail of each buffer is moved once, though it is listed many times.
+ */
+void
+sys_buffer_readv_next (struct sys_vbuffer *vb, size_t n)
+{
+    size_t done[SYS_IOV_MAX];
+    int i;
+
+    for (i = 0; n && i < vb->n; ++i) {
+	struct membuf *mb = vb->mb[i];
+	size_t len = sys_iov_len(&vb->iov[i]);
+	int j;
+
+	if (len > n) len = n;
+	n -= len;
+	done[i] = 0;
+	if (!mb) continue;
+
+	/* sum by the first listing of the buffer */
+	for (j = 0; vb->mb[j] != mb; ++j)
+	    continue;
+	done[j] += len;
+    }
+
+    while (i--) {
+	struct membuf *mb = vb->mb[i];
+
+	if (mb && done[i]) {
+	    struct sys_buffer sb;
+
+	    sb.mb = mb;
+	    sys_buffer_read_next(&sb, done[i]);
+	}
+    }
+}
+
+/*
+ * Scatter to the free space of buffers, a count reserves the bytes.
+ * Arguments: ..., {membuf_udata, [count (number)]} ...
+ * Returns: number of buffers, -1 when a buffer can't grow
+ */
+int
+sys_buffer_writev_init (lua_State *L, int idx, int last,
+                        struct sys_vbuffer *vb)
+{
+    vb->n = 0;
+    vb->size = 0;
+    for (; idx <= last; ++idx) {
+	struct membuf *mb = checkudata(L, idx, MEM_TYPENAME);
+	size_t len = mb->len - mb->offset;
+	int i;
+
+	for (i = 0; i < vb->n; ++i) {
+	    if (vb->mb[i] == mb)
+		luaL_argerror(L, idx, "buffer listed twice");
+	}
+	if (idx < last && lua_type(L, idx + 1) == LUA_TNUMBER) {
+	    const size_t n = lua_tointeger(L, ++idx);
+
+	    if (n > len && !membuf_addlstring(L, mb, NULL, n))
+		return -1;
+	    len = n;
+	}
+	if (!len) continue;
+	if (vb->n == SYS_IOV_MAX)
+	    luaL_argerror(L, idx, "too many buffers");
+	sys_iov_set(&vb->iov[vb->n], mb->data + mb->offset, len);
+	vb->mb[vb->n++] = mb;
+	vb->size += len;
+    }
+    return vb->n;
+}
+
+/*
+ * Fill the buffers with n bytes read.
+ */
+void
+sys_buffer_writev_done (struct sys_vbuffer *vb, size_t n)
+{
+    int i;
+
+    for (i = 0; n && i < vb->n; ++i) {
+	size_t len = sys_iov_len(&vb->iov[i]);
+
+	if (len > n) len = n;
+	vb->mb[i]->offset += len;
+	n -= len;
+    }
+}
+
+
 /*
  * Arguments: [num_bytes (number)]
  * Returns: membuf_udata
@@ -701,7 +855,9 @@ mem_tostring (lua_State *L)
 }
 
 
+#include "lz.c"
 #include "membuf.c"
+#include "pool.c"
 
 
 static luaL_reg mem_meth[] = {
@@ -747,6 +903,7 @@ static luaL_reg mem_meth[] = {
 
 static luaL_reg mem_lib[] = {
     {"pointer",		mem_new},
+    {"pool",		mempool_create},
     {NULL, NULL}
 };
 
@@ -0,0 +1,915 @@
+/* Lua System: Networking: Asynchronous DNS resolver */
+
+/*
+ * Stub resolver: the queries are sent over one connected UDP socket
+ * to the recursive name server, the replies are read by the event
+ * queue callback.  Answers are cached for their TTL, failures for
+ * the SOA minimum (RFC 2308).  Requests of the same name are coalesced
+ * while in flight.
+ */
+
+#define DNS_TYPENAME	"sys.sock.resolver"
+
+#define DNS_PORT	53
+#define DNS_HDR_SIZE	12
+#define DNS_MSG_SIZE	512	/* without EDNS0 */
+#define DNS_RECV_SIZE	4096
+#define DNS_NAME_MAX	253	/* text form */
+#define DNS_LABEL_MAX	63
+#define DNS_JUMPS_MAX	64	/* compression pointers per name */
+#define DNS_RECV_BATCH	64	/* replies per read event */
+
+#define DNS_TIMEOUT	2000	/* milliseconds per try */
+#define DNS_RETRIES	2
+#define DNS_TTL_MAX	86400	/* seconds */
+#define DNS_NEG_TTL	5	/* seconds, without SOA record */
+
+#define DNS_T_A		1
+#define DNS_T_SOA	6
+#define DNS_T_AAAA	28
+#define DNS_C_IN	1
+
+#define DNS_F_QR	0x8000
+#define DNS_F_TC	0x0200
+#define DNS_F_RD	0x0100
+
+#define DNS_RCODE_NXDOMAIN	3
+
+/* Results of reply */
+#define DNS_OK		0
+#define DNS_NEGATIVE	1
+#define DNS_FAILURE	2
+#define DNS_IGNORE	3
+
+/* Environ. table reserved indexes */
+#define DNS_EVQ		1  /* evq_udata */
+#define DNS_SD		2  /* sd_udata */
+#define DNS_CACHE	3  /* {key: cache_entry} */
+#define DNS_QUERIES	4  /* {id: query, key: query} */
+#define DNS_EV_READ	5  /* ev_ludata */
+#define DNS_EV_TIMER	6  /* ev_ludata */
+
+/* Cache entry (table) */
+#define DNS_E_EXPIRES	1  /* milliseconds */
+#define DNS_E_ADDRS	2  /* binary addresses (table) | false */
+#define DNS_E_MESSAGE	3
+
+/* Query (table) */
+#define DNS_Q_NAME	1
+#define DNS_Q_KEY	2
+#define DNS_Q_TYPE	3
+#define DNS_Q_ID	4
+#define DNS_Q_PACKET	5
+#define DNS_Q_TRIES	6
+#define DNS_Q_DEADLINE	7
+#define DNS_Q_CALLBACKS	8  /* callbacks are from here */
+
+struct resolver {
+    sd_t sd;
+    msec_t timeout;  /* per try */
+    int retries;
+    int npending;
+    unsigned int next_id;
+    unsigned int closed:	1;
+};
+
+#define dns_get16(p)	(((p)[0] << 8) | (p)[1])
+#define dns_get32(p) \
+    (((unsigned int) (p)[0] << 24) | ((p)[1] << 16) | ((p)[2] << 8) | (p)[3])
+
+/* Time stamp is reached? */
+#define dns_elapsed(now, t) \
+    ((int) ((unsigned int) (now) - (unsigned int) (t)) >= 0)
+
+
+static int
+dns_pton (int af, const char *src, struct sock_addr *sap)
+{
+    memset(sap, 0, sizeof(struct sock_addr));
+#ifndef _WIN32
+    return inet_pton(af, src, sock_addr_get_inp(sap, af)) == 1;
+#else
+    sap->addrlen = sizeof(struct sock_addr);
+    return !WSAStringToAddress((char *) src, af, NULL,
+     &sap->u.addr, &sap->addrlen);
+#endif
+}
+
+/*
+ * Get the first "nameserver" of /etc/resolv.conf.
+ */
+static void
+dns_sysserver (struct sock_addr *sap)
+{
+#ifndef _WIN32
+    FILE *fp = fopen("/etc/resolv.conf", "r");
+
+    if (fp) {
+	char line[256], host[64];
+	int found = 0;
+
+	while (!found && fgets(line, sizeof(line), fp)) {
+	    if (sscanf(line, " nameserver %63s", host) != 1)
+		continue;
+	    if (dns_pton(AF_INET, host, sap)) {
+		sap->u.in.sin_family = AF_INET;
+		sap->u.in.sin_port = htons(DNS_PORT);
+		sap->addrlen = sizeof(struct sockaddr_in);
+		found = 1;
+	    }
+	    else if (dns_pton(AF_INET6, host, sap)) {
+		sap->u.in6.sin6_family = AF_INET6;
+		sap->u.in6.sin6_port = htons(DNS_PORT);
+		sap->addrlen = sizeof(struct sockaddr_in6);
+		found = 1;
+	    }
+	}
+	fclose(fp);
+	if (found) return;
+    }
+#endif
+    memset(sap, 0, sizeof(struct sock_addr));
+    sap->u.in.sin_family = AF_INET;
+    sap->u.in.sin_port = htons(DNS_PORT);
+    sap->u.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sap->addrlen = sizeof(struct sockaddr_in);
+}
+
+/*
+ * Returns: nil, string
+ */
+static int
+dns_seterror (lua_State *L, const char *msg)
+{
+    lua_pushnil(L);
+    lua_pushstring(L, msg);
+    lua_pushvalue(L, -1);
+    lua_setglobal(L, SYS_ERROR_MESSAGE);
+    return 2;
+}
+
+/*
+ * Lower case the host name and strip the trailing dot.
+ * Returns: -1, when invalid
+ */
+static int
+dns_normalize (const char *s, size_t len, char *name)
+{
+    size_t i;
+
+    if (len && s[len - 1] == '.') --len;
+    if (!len || len > DNS_NAME_MAX)
+	return -1;
+
+    for (i = 0; i < len; ++i) {
+	const int c = (unsigned char) s[i];
+	name[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+    name[len] = '\0';
+    return 0;
+}
+
+/*
+ * Returns: length of query packet | -1, when invalid name
+ */
+static int
+dns_mkquery (unsigned char *buf, unsigned int id, const char *name,
+             int qtype)
+{
+    unsigned char *p = buf + DNS_HDR_SIZE;
+
+    memset(buf, 0, DNS_HDR_SIZE);
+    buf[0] = (unsigned char) (id >> 8);
+    buf[1] = (unsigned char) id;
+    buf[2] = DNS_F_RD >> 8;
+    buf[5] = 1;  /* QDCOUNT */
+
+    for (; ; ) {
+	const char *dot = strchr(name, '.');
+	const size_t n = dot ? (size_t) (dot - name) : strlen(name);
+
+	if (!n || n > DNS_LABEL_MAX)
+	    return -1;
+	*p++ = (unsigned char) n;
+	memcpy(p, name, n);
+	p += n;
+	if (!dot) break;
+	name = dot + 1;
+    }
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = (unsigned char) qtype;
+    *p++ = 0;
+    *p++ = DNS_C_IN;
+    return p - buf;
+}
+
+/*
+ * Expand the (compressed) domain name to lower cased text form,
+ * or skip it when name is NULL.
+ * Returns: offset after the name | -1, when malformed
+ */
+static int
+dns_getname (const unsigned char *msg, const int len, int off, char *name)
+{
+    int end = -1, n = 0, jumps = 0;
+
+    for (; ; ) {
+	int c;
+
+	if (off >= len) return -1;
+	c = msg[off];
+	if (!c) {
+	    ++off;
+	    break;
+	}
+	if ((c & 0xC0) == 0xC0) {
+	    if (off + 1 >= len || ++jumps > DNS_JUMPS_MAX)
+		return -1;
+	    if (end < 0) end = off + 2;
+	    off = ((c & 0x3F) << 8) | msg[off + 1];
+	    continue;
+	}
+	if ((c & 0xC0) || off + 1 + c > len)
+	    return -1;
+	if (name) {
+	    const unsigned char *lp = msg + off + 1;
+	    int i;
+
+	    if (n + c + 1 > DNS_NAME_MAX + 1)
+		return -1;
+	    if (n) name[n++] = '.';
+	    for (i = 0; i < c; ++i) {
+		const int ch = lp[i];
+		name[n++] = (ch >= 'A' && ch <= 'Z') ? ch + ('a' - 'A') : ch;
+	    }
+	}
+	off += 1 + c;
+    }
+    if (name) name[n] = '\0';
+    return (end < 0) ? off : end;
+}
+
+/*
+ * Arguments: ..., binary_addresses (table)
+ * Returns: DNS_OK | DNS_NEGATIVE | DNS_FAILURE | DNS_IGNORE
+ */
+static int
+dns_parse (lua_State *L, const unsigned char *msg, const int len,
+           const char *qname, const int qtype,
+           unsigned int *ttlp, const char **errp)
+{
+    const int flags = dns_get16(msg + 2);
+    const int rcode = flags & 0x0F;
+    const int ancount = dns_get16(msg + 6);
+    const int nscount = dns_get16(msg + 8);
+    unsigned int ttl = DNS_TTL_MAX;
+    char name[DNS_NAME_MAX + 2];
+    int off, i, naddr = 0;
+
+    /* the question must be ours */
+    if (!(flags & DNS_F_QR) || dns_get16(msg + 4) != 1)
+	return DNS_IGNORE;
+    off = dns_getname(msg, len, DNS_HDR_SIZE, name);
+    if (off < 0 || off + 4 > len || strcmp(name, qname)
+     || dns_get16(msg + off) != qtype
+     || dns_get16(msg + off + 2) != DNS_C_IN)
+	return DNS_IGNORE;
+    off += 4;
+
+    if (rcode && rcode != DNS_RCODE_NXDOMAIN) {
+	static const char *const rcode_msgs[] = {
+	    "format error", "server failure", NULL,
+	    "not implemented", "query refused"
+	};
+
+	*errp = (rcode <= 5) ? rcode_msgs[rcode - 1] : "server error";
+	return DNS_FAILURE;
+    }
+
+    /* answers; the CNAME chain is followed by the server */
+    for (i = 0; i < ancount; ++i) {
+	unsigned int rttl;
+	int type, rdlen;
+
+	off = dns_getname(msg, len, off, NULL);
+	if (off < 0 || off + 10 > len) goto malformed;
+	type = dns_get16(msg + off);
+	rttl = dns_get32(msg + off + 4);
+	rdlen = dns_get16(msg + off + 8);
+	off += 10;
+	if (off + rdlen > len) goto malformed;
+
+	if (type == qtype && dns_get16(msg + off - 8) == DNS_C_IN
+	 && rdlen == ((qtype == DNS_T_A) ? 4 : 16)) {
+	    lua_pushlstring(L, (const char *) msg + off, rdlen);
+	    lua_rawseti(L, -2, ++naddr);
+	    if (rttl & 0x80000000) rttl = 0;
+	    if (ttl > rttl) ttl = rttl;
+	}
+	off += rdlen;
+    }
+    if (naddr) {
+	*ttlp = ttl;
+	return DNS_OK;
+    }
+    if (!rcode && (flags & DNS_F_TC)) {
+	*errp = "truncated reply";
+	return DNS_FAILURE;
+    }
+
+    /* negative answer: TTL from SOA */
+    ttl = DNS_NEG_TTL;
+    for (i = 0; i < nscount; ++i) {
+	unsigned int rttl;
+	int type, rdlen, p;
+
+	off = dns_getname(msg, len, off, NULL);
+	if (off < 0 || off + 10 > len) break;
+	type = dns_get16(msg + off);
+	rttl = dns_get32(msg + off + 4);
+	rdlen = dns_get16(msg + off + 8);
+	off += 10;
+	if (off + rdlen > len) break;
+
+	if (type == DNS_T_SOA) {
+	    p = dns_getname(msg, len, off, NULL);  /* MNAME */
+	    if (p >= 0) p = dns_getname(msg, len, p, NULL);  /* RNAME */
+	    if (p >= 0 && p + 20 <= off + rdlen) {
+		const unsigned int minimum = dns_get32(msg + p + 16);
+
+		ttl = (rttl < minimum) ? rttl : minimum;
+		if (ttl & 0x80000000) ttl = 0;
+	    }
+	    break;
+	}
+	off += rdlen;
+    }
+    *ttlp = ttl;
+    *errp = rcode ? "host not found" : "no address";
+    return DNS_NEGATIVE;
+ malformed:
+    *errp = "malformed reply";
+    return DNS_FAILURE;
+}
+
+/*
+ * Arguments: ..., binary_addresses (table)
+ * Returns: ..., binary_addresses (table), binary_addresses_copy (table)
+ */
+static void
+dns_copy (lua_State *L, int idx)
+{
+    const int n = lua_objlen(L, idx);
+    int i;
+
+    lua_createtable(L, n, 0);
+    for (i = 1; i <= n; ++i) {
+	lua_rawgeti(L, idx, i);
+	lua_rawseti(L, -2, i);
+    }
+}
+
+/*
+ * Delete the event of environ. slot from event queue.
+ */
+static void
+dns_evq_del (lua_State *L, int env, int slot)
+{
+    lua_rawgeti(L, env, slot);
+    if (!lua_isnil(L, -1)) {
+	lua_rawgeti(L, env, DNS_EVQ);
+	lua_getfield(L, -1, "del");
+	lua_insert(L, -3);
+	lua_insert(L, -2);
+	lua_call(L, 2, 0);  /* evq:del(ev) */
+
+	lua_pushnil(L);
+	lua_rawseti(L, env, slot);
+    } else
+	lua_pop(L, 1);
+}
+
+/*
+ * Arguments: ..., query (table), binary_addresses (table) | nil
+ */
+static void
+dns_finish (lua_State *L, struct resolver *res, int env,
+            const int status, unsigned int ttl, const char *err)
+{
+    const int addrs = lua_gettop(L);
+    const int q = addrs - 1;
+    int i, n;
+
+    /* forget the query */
+    lua_rawgeti(L, env, DNS_QUERIES);
+    lua_rawgeti(L, q, DNS_Q_ID);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_rawgeti(L, q, DNS_Q_KEY);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    --res->npending;
+
+    /* zero TTL means "do not cache" */
+    if (status != DNS_FAILURE && ttl) {
+	if (ttl > DNS_TTL_MAX) ttl = DNS_TTL_MAX;
+
+	lua_rawgeti(L, env, DNS_CACHE);
+	lua_rawgeti(L, q, DNS_Q_KEY);
+	lua_createtable(L, 3, 0);
+	lua_pushinteger(L, (msec_t) ((unsigned int) get_milliseconds()
+	 + ttl * 1000));
+	lua_rawseti(L, -2, DNS_E_EXPIRES);
+	if (status == DNS_OK)
+	    dns_copy(L, addrs);
+	else
+	    lua_pushboolean(L, 0);
+	lua_rawseti(L, -2, DNS_E_ADDRS);
+	if (err) {
+	    lua_pushstring(L, err);
+	    lua_rawseti(L, -2, DNS_E_MESSAGE);
+	}
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+    }
+
+    n = lua_objlen(L, q);
+    for (i = DNS_Q_CALLBACKS; i <= n && !res->closed; ++i) {
+	lua_rawgeti(L, q, i);
+	lua_rawgeti(L, q, DNS_Q_NAME);
+	if (status == DNS_OK) {
+	    dns_copy(L, addrs);
+	    lua_pushnil(L);
+	} else {
+	    lua_pushnil(L);
+	    lua_pushstring(L, err);
+	}
+	lua_call(L, 3, 0);  /* callback(name, addrs, err) */
+    }
+}
+
+/*
+ * Event queue callback of the socket.
+ */
+static int
+dns_on_read (lua_State *L)
+{
+    struct resolver *res = lua_touserdata(L, lua_upvalueindex(1));
+    unsigned char msg[DNS_RECV_SIZE];
+    int i;
+
+    lua_settop(L, 0);
+    lua_getfenv(L, lua_upvalueindex(1));  /* 1: env */
+    lua_rawgeti(L, 1, DNS_QUERIES);  /* 2: queries */
+
+    for (i = 0; i < DNS_RECV_BATCH && !res->closed; ++i) {
+	const char *err = NULL;
+	unsigned int ttl = 0;
+	int len, status;
+
+	len = recv(res->sd, (char *) msg, sizeof(msg), 0);
+	if (len == -1) {
+	    if (SYS_EAGAIN(SYS_ERRNO)) break;
+	    continue;  /* EINTR or ICMP error of connected socket */
+	}
+	if (len < DNS_HDR_SIZE) continue;
+
+	lua_rawgeti(L, 2, dns_get16(msg));  /* 3: query */
+	if (lua_istable(L, 3)) {
+	    lua_rawgeti(L, 3, DNS_Q_NAME);  /* 4 */
+	    lua_rawgeti(L, 3, DNS_Q_TYPE);  /* 5 */
+	    lua_pushvalue(L, 3);
+	    lua_newtable(L);  /* binary_addresses */
+
+	    status = dns_parse(L, msg, len, lua_tostring(L, 4),
+	     lua_tointeger(L, 5), &ttl, &err);
+	    if (status != DNS_IGNORE)
+		dns_finish(L, res, 1, status, ttl, err);
+	}
+	lua_settop(L, 2);
+    }
+    return 0;
+}
+
+/*
+ * Event queue callback of the timer: retries and time outs.
+ */
+static int
+dns_on_timer (lua_State *L)
+{
+    struct resolver *res = lua_touserdata(L, lua_upvalueindex(1));
+    const msec_t now = get_milliseconds();
+    int i, n = 0;
+
+    lua_settop(L, 0);
+    lua_getfenv(L, lua_upvalueindex(1));  /* 1: env */
+    lua_rawgeti(L, 1, DNS_QUERIES);  /* 2: queries */
+    lua_newtable(L);  /* 3: timed out queries */
+
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+	if (lua_type(L, -2) == LUA_TNUMBER) {
+	    int tries;
+
+	    lua_rawgeti(L, -1, DNS_Q_DEADLINE);
+	    lua_rawgeti(L, -2, DNS_Q_TRIES);
+	    tries = lua_tointeger(L, -1);
+	    if (!dns_elapsed(now, lua_tointeger(L, -2)))
+		;
+	    else if (tries > res->retries) {
+		lua_pushvalue(L, -3);
+		lua_rawseti(L, 3, ++n);
+	    } else {
+		size_t len;
+		const char *packet;
+
+		lua_rawgeti(L, -3, DNS_Q_PACKET);
+		packet = lua_tolstring(L, -1, &len);
+		send(res->sd, packet, len, 0);  /* lost one will be retried */
+		lua_pop(L, 1);
+
+		lua_pushinteger(L, tries + 1);
+		lua_rawseti(L, -4, DNS_Q_TRIES);
+		lua_pushinteger(L, (msec_t) ((unsigned int) now + res->timeout));
+		lua_rawseti(L, -4, DNS_Q_DEADLINE);
+	    }
+	    lua_pop(L, 2);
+	}
+	lua_pop(L, 1);
+    }
+
+    for (i = 1; i <= n && !res->closed; ++i) {
+	lua_rawgeti(L, 3, i);
+	lua_pushnil(L);
+	dns_finish(L, res, 1, DNS_FAILURE, 0, "timed out");
+	lua_settop(L, 3);
+    }
+
+    if (!res->npending && !res->closed)
+	dns_evq_del(L, 1, DNS_EV_TIMER);
+    return 0;
+}
+
+
+/*
+ * Arguments: evq_udata, [server (sock_addr_udata),
+ *	timeout (milliseconds), retries (number)]
+ * Returns: [resolver_udata]
+ */
+static int
+sock_resolver (lua_State *L)
+{
+    struct sock_addr server;
+    struct resolver *res;
+    const msec_t timeout = (msec_t) luaL_optinteger(L, 3, DNS_TIMEOUT);
+    const int retries = (int) luaL_optinteger(L, 4, DNS_RETRIES);
+    sd_t sd;
+
+    luaL_checktype(L, 1, LUA_TUSERDATA);
+    if (lua_isnoneornil(L, 2))
+	dns_sysserver(&server);
+    else
+	memcpy(&server, checkudata(L, 2, SA_TYPENAME), sizeof(struct sock_addr));
+    luaL_argcheck(L, timeout > 0, 3, "invalid timeout");
+    lua_settop(L, 1);
+
+    res = lua_newuserdata(L, sizeof(struct resolver));  /* 2 */
+    memset(res, 0, sizeof(struct resolver));
+    res->sd = (sd_t) -1;
+    res->timeout = timeout;
+    res->retries = (retries < 0) ? 0 : retries;
+    /* the source port is randomized by the system */
+    res->next_id = (unsigned int) get_milliseconds()
+     ^ (unsigned int) ((size_t) res >> 4);
+    luaL_getmetatable(L, DNS_TYPENAME);
+    lua_setmetatable(L, 2);
+
+    lua_createtable(L, DNS_EV_TIMER, 0);  /* 3: env */
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, 3, DNS_EVQ);
+    lua_newtable(L);
+    lua_rawseti(L, 3, DNS_CACHE);
+    lua_newtable(L);
+    lua_rawseti(L, 3, DNS_QUERIES);
+    lua_pushvalue(L, 3);
+    lua_setfenv(L, 2);
+
+#ifndef _WIN32
+    sd = socket(server.u.addr.sa_family, SOCK_DGRAM, 0);
+#else
+    sd = WSASocket(server.u.addr.sa_family, SOCK_DGRAM, 0, NULL, 0,
+     IS_OVERLAPPED);
+#endif
+    if (sd == (sd_t) -1)
+	return sys_seterror(L, 0);
+
+    /* the socket is closed by GC of sd_udata */
+    lua_boxinteger(L, sd);
+    luaL_getmetatable(L, SD_TYPENAME);
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, 3, DNS_SD);
+    res->sd = sd;
+
+    {
+	unsigned long opt = 1;
+
+	if (ioctlsocket(sd, FIONBIO, &opt)
+	 || connect(sd, &server.u.addr, server.addrlen) == -1)
+	    return sys_seterror(L, 0);
+    }
+
+    /* evq:add_socket(sd, "r", on_read) */
+    lua_getfield(L, 1, "add_socket");
+    lua_pushvalue(L, 1);
+    lua_rawgeti(L, 3, DNS_SD);
+    lua_pushliteral(L, "r");
+    lua_pushvalue(L, 2);
+    lua_pushcclosure(L, dns_on_read, 1);
+    lua_call(L, 4, 2);
+    if (lua_isnil(L, -2))
+	return 2;
+    lua_pop(L, 1);
+    lua_rawseti(L, 3, DNS_EV_READ);
+
+    lua_settop(L, 2);
+    return 1;
+}
+
+/*
+ * Arguments: resolver_udata, host_name (string), callback (function),
+ *	[family (string: "inet", "inet6")]
+ * Returns: binary_addresses (table) | true (pending) | nil, string
+ *
+ * Callback is called as callback(host_name, binary_addresses | nil, [string]).
+ */
+static int
+dns_resolve (lua_State *L)
+{
+    static const char *const af_names[] = {"inet", "inet6", NULL};
+
+    struct resolver *res = checkudata(L, 1, DNS_TYPENAME);
+    size_t len;
+    const char *s = luaL_checklstring(L, 2, &len);
+    const int qtype = luaL_checkoption(L, 4, "inet", af_names)
+     ? DNS_T_AAAA : DNS_T_A;
+    const msec_t now = get_milliseconds();
+    unsigned char packet[DNS_MSG_SIZE];
+    char name[DNS_NAME_MAX + 2];
+    struct sock_addr sa;
+    unsigned int id;
+    int plen;
+
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    lua_settop(L, 3);
+
+    if (res->closed)
+	return dns_seterror(L, "resolver closed");
+
+    /* numeric address */
+    if (dns_pton(AF_INET, s, &sa) || dns_pton(AF_INET6, s, &sa)) {
+	const int af = strchr(s, ':') ? AF_INET6 : AF_INET;
+
+	lua_createtable(L, 1, 0);
+	lua_pushlstring(L, sock_addr_get_inp(&sa, af),
+	 sock_addr_get_inlen(af));
+	lua_rawseti(L, -2, 1);
+	return 1;
+    }
+
+    if (dns_normalize(s, len, name))
+	return dns_seterror(L, "invalid host name");
+
+    lua_pushfstring(L, "%s/%d", name, qtype);  /* 4: key */
+    lua_getfenv(L, 1);  /* 5: env */
+
+    /* cached? */
+    lua_rawgeti(L, 5, DNS_CACHE);  /* 6 */
+    lua_pushvalue(L, 4);
+    lua_rawget(L, 6);
+    if (lua_istable(L, -1)) {
+	const int ent = lua_gettop(L);
+	msec_t left;
+
+	lua_rawgeti(L, ent, DNS_E_EXPIRES);
+	left = (msec_t) ((unsigned int) lua_tointeger(L, -1)
+	 - (unsigned int) now);
+	/* the range check is against wrapped clock too */
+	if (left > 0 && left <= DNS_TTL_MAX * 1000) {
+	    lua_rawgeti(L, ent, DNS_E_ADDRS);
+	    if (lua_toboolean(L, -1)) {
+		dns_copy(L, ent + 2);
+		return 1;
+	    }
+	    lua_rawgeti(L, ent, DNS_E_MESSAGE);
+	    return dns_seterror(L, lua_tostring(L, -1));
+	}
+	lua_pushvalue(L, 4);
+	lua_pushnil(L);
+	lua_rawset(L, 6);
+    }
+    lua_settop(L, 5);
+
+    /* in flight? */
+    lua_rawgeti(L, 5, DNS_QUERIES);  /* 6 */
+    lua_pushvalue(L, 4);
+    lua_rawget(L, 6);
+    if (lua_istable(L, -1)) {
+	lua_pushvalue(L, 3);
+	lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+	lua_pushboolean(L, 1);
+	return 1;
+    }
+    lua_pop(L, 1);
+
+    /* new query */
+    do {
+	res->next_id = res->next_id * 1103515245 + 12345;
+	id = (res->next_id >> 16) & 0xFFFF;
+	lua_rawgeti(L, 6, id);
+	plen = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+    } while (plen);
+
+    plen = dns_mkquery(packet, id, name, qtype);
+    if (plen == -1)
+	return dns_seterror(L, "invalid host name");
+
+    if (send(res->sd, (char *) packet, plen, 0) == -1
+     && !SYS_EAGAIN(SYS_ERRNO))
+	return sys_seterror(L, 0);
+
+    lua_createtable(L, DNS_Q_CALLBACKS, 0);
+    lua_pushstring(L, name);
+    lua_rawseti(L, -2, DNS_Q_NAME);
+    lua_pushvalue(L, 4);
+    lua_rawseti(L, -2, DNS_Q_KEY);
+    lua_pushinteger(L, qtype);
+    lua_rawseti(L, -2, DNS_Q_TYPE);
+    lua_pushinteger(L, id);
+    lua_rawseti(L, -2, DNS_Q_ID);
+    lua_pushlstring(L, (char *) packet, plen);
+    lua_rawseti(L, -2, DNS_Q_PACKET);
+    lua_pushinteger(L, 1);
+    lua_rawseti(L, -2, DNS_Q_TRIES);
+    lua_pushinteger(L, (msec_t) ((unsigned int) now + res->timeout));
+    lua_rawseti(L, -2, DNS_Q_DEADLINE);
+    lua_pushvalue(L, 3);
+    lua_rawseti(L, -2, DNS_Q_CALLBACKS);
+
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, 6, id);
+    lua_pushvalue(L, 4);
+    lua_insert(L, -2);
+    lua_rawset(L, 6);
+    ++res->npending;
+
+    /* evq:add_timer(on_timer, tick) */
+    lua_rawgeti(L, 5, DNS_EV_TIMER);
+    if (lua_isnil(L, -1)) {
+	const msec_t tick = res->timeout / 4;
+
+	lua_rawgeti(L, 5, DNS_EVQ);
+	lua_getfield(L, -1, "add_timer");
+	lua_insert(L, -2);
+	lua_pushvalue(L, 1);
+	lua_pushcclosure(L, dns_on_timer, 1);
+	lua_pushinteger(L, (tick < 10) ? 10 : tick);
+	lua_call(L, 3, 2);
+	if (lua_isnil(L, -2))
+	    return 2;
+	lua_pop(L, 1);
+	lua_rawseti(L, 5, DNS_EV_TIMER);
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: resolver_udata, [expired_only (boolean)]
+ * Returns: resolver_udata
+ */
+static int
+dns_flush (lua_State *L)
+{
+    checkudata(L, 1, DNS_TYPENAME);
+    lua_settop(L, 2);
+    lua_getfenv(L, 1);  /* 3 */
+
+    if (!lua_toboolean(L, 2)) {
+	lua_newtable(L);
+	lua_rawseti(L, 3, DNS_CACHE);
+    } else {
+	const msec_t now = get_milliseconds();
+
+	lua_rawgeti(L, 3, DNS_CACHE);  /* 4 */
+	lua_pushnil(L);
+	while (lua_next(L, 4)) {
+	    msec_t left;
+
+	    lua_rawgeti(L, -1, DNS_E_EXPIRES);
+	    left = (msec_t) ((unsigned int) lua_tointeger(L, -1)
+	     - (unsigned int) now);
+	    lua_pop(L, 2);
+	    if (left <= 0 || left > DNS_TTL_MAX * 1000) {
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, 4);  /* clearing of field is allowed in traversal */
+	    }
+	}
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: resolver_udata
+ * Returns: number_of_pending_queries, number_of_cached_names
+ */
+static int
+dns_stats (lua_State *L)
+{
+    struct resolver *res = checkudata(L, 1, DNS_TYPENAME);
+    int n = 0;
+
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, DNS_CACHE);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+	++n;
+	lua_pop(L, 1);
+    }
+    lua_pushinteger(L, res->npending);
+    lua_pushinteger(L, n);
+    return 2;
+}
+
+/*
+ * Arguments: resolver_udata
+ * Returns: [resolver_udata]
+ *
+ * The callbacks of pending queries are not called.
+ */
+static int
+dns_close (lua_State *L)
+{
+    struct resolver *res = checkudata(L, 1, DNS_TYPENAME);
+
+    if (res->closed) return 0;
+    res->closed = 1;
+
+    lua_settop(L, 1);
+    lua_getfenv(L, 1);  /* 2 */
+    dns_evq_del(L, 2, DNS_EV_READ);
+    dns_evq_del(L, 2, DNS_EV_TIMER);
+
+    lua_newtable(L);
+    lua_rawseti(L, 2, DNS_QUERIES);
+    res->npending = 0;
+
+    lua_rawgeti(L, 2, DNS_SD);
+    if (lua_isuserdata(L, -1)) {
+	sd_t *sdp = lua_touserdata(L, -1);
+
+	if (*sdp != (sd_t) -1) {
+#ifndef _WIN32
+	    close(*sdp);
+#else
+	    closesocket(*sdp);
+#endif
+	    *sdp = (sd_t) -1;
+	}
+    }
+    res->sd = (sd_t) -1;
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+/*
+ * Arguments: resolver_udata
+ * Returns: string
+ */
+static int
+dns_tostring (lua_State *L)
+{
+    struct resolver *res = checkudata(L, 1, DNS_TYPENAME);
+
+    lua_pushfstring(L, DNS_TYPENAME " (%p)", res);
+    return 1;
+}
+
+
+#define DNS_METHODS \
+    {"resolver",	sock_resolver}
+
+static luaL_reg dns_meth[] = {
+    {"resolve",		dns_resolve},
+    {"flush",		dns_flush},
+    {"stats",		dns_stats},
+    {"close",		dns_close},
+    {"__tostring",	dns_tostring},
+    {NULL, NULL}
+};
@@ -17,6 +17,8 @@ typedef int		socklen_t;
 #define EINTR		WSAEINTR
 #define EINPROGRESS	WSAEINPROGRESS
 #define EALREADY	WSAEALREADY
+#undef EOPNOTSUPP
+#define EOPNOTSUPP	WSAEOPNOTSUPP
 
 #else
 
@@ -43,10 +45,15 @@ typedef int		socklen_t;
 
 #endif /* !WIN32 */
 
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT	-1  /* listeners can't be sharded */
+#endif
+
 
 #define SD_TYPENAME	"sys.sock.handle"
 
 #include "sock_addr.c"
+#include "sock_dns.c"
 
 
 /*
@@ -221,15 +228,17 @@ sock_sockopt (lua_State *L)
 	SO_REUSEADDR, SO_TYPE, SO_ERROR, SO_DONTROUTE,
 	SO_SNDBUF, SO_RCVBUF, SO_SNDLOWAT, SO_RCVLOWAT,
 	SO_BROADCAST, SO_KEEPALIVE, SO_OOBINLINE, SO_LINGER,
-#define OPTNAMES_TCP	12
+	SO_REUSEPORT,
+#define OPTNAMES_TCP	13
 	TCP_NODELAY,
-#define OPTNAMES_IP	13
+#define OPTNAMES_IP	14
 	IP_MULTICAST_TTL, IP_MULTICAST_IF, IP_MULTICAST_LOOP
     };
     static const char *const opt_names[] = {
 	"reuseaddr", "type", "error", "dontroute",
 	"sndbuf", "rcvbuf", "sndlowat", "rcvlowat",
 	"broadcast", "keepalive", "oobinline", "linger",
+	"reuseport",
 	"tcp_nodelay",
 	"multicast_ttl", "multicast_if", "multicast_loop", NULL
     };
@@ -244,6 +253,9 @@ sock_sockopt (lua_State *L)
     socklen_t optlen = sizeof(int);
     const int nargs = lua_gettop(L);
 
+    if (optflag == -1)
+	return sys_seterror(L, EOPNOTSUPP);
+
     if (nargs > OPT_START) {
 	optval[0] = lua_tointeger(L, OPT_START + 1);
 	if (nargs > OPT_START + 1) {
@@ -372,6 +384,7 @@ sock_accept (lua_State *L)
     if (from) {
 	sap = &from->u.addr;
 	slp = &from->addrlen;
+	*slp = sizeof(from->u);
     }
 #ifndef _WIN32
     do sd = accept(sd, sap, slp);
@@ -420,7 +433,83 @@ sock_connect (lua_State *L)
 }
 
 /*
- * Arguments: sd_udata, {string | membuf_udata},
+ * Arguments: sd_udata, list (table: {string | membuf_udata
+ *	| part (table: {membuf_udata, count (number)})} ...),
+ *	[to (sock_addr_udata)], flags (number)
+ * Returns: [success/partial (boolean), count (number)]
+ *
+ * Note: longer list is sent by SYS_IOV_MAX buffers, i.e. a datagram
+ *	takes up to SYS_IOV_MAX buffers.
+ */
+static int
+sock_sendv (lua_State *L, int flags)
+{
+    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    struct sock_addr *to = !lua_isuserdata(L, 3) ? NULL
+     : checkudata(L, 3, SA_TYPENAME);
+    const int top = lua_gettop(L);
+    const int n = lua_rawlen(L, 2);
+    ssize_t nsent = 0;  /* number of chars actually send */
+    int i, done = 1;
+#ifndef _WIN32
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    if (to) {
+	msg.msg_name = &to->u.addr;
+	msg.msg_namelen = to->addrlen;
+    }
+#endif
+
+    luaL_checkstack(L, SYS_IOV_MAX, NULL);
+
+    /* gather the list by SYS_IOV_MAX */
+    for (i = 1; i <= n; ) {
+	struct sys_vbuffer vb;
+	ssize_t nw;
+	int last = i + SYS_IOV_MAX - 1;
+
+	if (last > n) last = n;
+	lua_settop(L, top);
+	for (; i <= last; ++i)
+	    lua_rawgeti(L, 2, i);
+	sys_buffer_readv_init(L, top + 1, lua_gettop(L), &vb);
+	if (!vb.n) continue;
+
+	sys_vm_leave();
+#ifndef _WIN32
+	msg.msg_iov = vb.iov;
+	msg.msg_iovlen = vb.n;
+	do nw = sendmsg(sd, &msg, flags);
+	while (nw == -1 && SYS_ERRNO == EINTR);
+#else
+	{
+	    DWORD l;
+	    nw = !WSASendTo(sd, vb.iov, vb.n, &l, flags,
+	     to ? &to->u.addr : NULL, to ? to->addrlen : 0, NULL, NULL)
+	     ? l : -1;
+	}
+#endif
+	sys_vm_enter();
+	if (nw == -1) {
+	    done = 0;
+	    if (nsent > 0 || SYS_EAGAIN(SYS_ERRNO)) break;
+	    return sys_seterror(L, 0);
+	}
+	nsent += nw;
+	sys_buffer_readv_next(&vb, nw);
+	if ((size_t) nw < vb.size) {
+	    done = 0;
+	    break;
+	}
+    }
+    lua_pushboolean(L, done);
+    lua_pushinteger(L, nsent);
+    return 2;
+}
+
+/*
+ * Arguments: sd_udata, {string | membuf_udata | list (table)},
  *	[to (sock_addr_udata), options (string) ...]
  * Returns: [success/partial (boolean), count (number)]
  */
@@ -440,11 +529,13 @@ sock_send (lua_State *L)
     int nw;  /* number of chars actually send */
     unsigned int i, flags = 0;
 
-    if (!sys_buffer_read_init(L, 2, &sb))
-	luaL_argerror(L, 2, "buffer expected");
     for (i = lua_gettop(L); i > 3; --i) {
 	flags |= o_flags[luaL_checkoption(L, i, NULL, o_names)];
     }
+    if (lua_istable(L, 2))
+	return sock_sendv(L, flags);
+    if (!sys_buffer_read_init(L, 2, &sb))
+	luaL_argerror(L, 2, "buffer expected");
     sys_vm_leave();
     do nw = !to ? send(sd, sb.ptr.r, sb.size, flags)
      : sendto(sd, sb.ptr.r, sb.size, flags, &to->u.addr, to->addrlen);
@@ -463,9 +554,75 @@ sock_send (lua_State *L)
 }
 
 /*
- * Arguments: sd_udata, [count (number) | membuf_udata,
- *	from (sock_addr_udata), options (string) ...]
- * Returns: [string | count (number) | false (EAGAIN)]
+ * Arguments: sd_udata, list (table: {membuf_udata, [count (number)]} ...),
+ *	[from (sock_addr_udata)], flags (number)
+ * Returns: [count (number) | false (EAGAIN)]
+ */
+static int
+sock_recvv (lua_State *L, int flags)
+{
+    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    struct sock_addr *from = !lua_isuserdata(L, 3) ? NULL
+     : checkudata(L, 3, SA_TYPENAME);
+    const int top = lua_gettop(L);
+    const int n = lua_rawlen(L, 2);
+    struct sys_vbuffer vb;
+    ssize_t nr;
+    int i, nbuf;
+#ifndef _WIN32
+    struct msghdr msg;
+#endif
+
+    luaL_checkstack(L, n, NULL);
+    for (i = 1; i <= n; ++i)
+	lua_rawgeti(L, 2, i);
+    nbuf = sys_buffer_writev_init(L, top + 1, top + n, &vb);
+    if (nbuf <= 0) {
+	if (nbuf) return sys_seterror(L, SYS_ENOMEM);
+	lua_pushinteger(L, 0);
+	return 1;
+    }
+
+    sys_vm_leave();
+#ifndef _WIN32
+    memset(&msg, 0, sizeof(struct msghdr));
+    if (from) {
+	msg.msg_name = &from->u.addr;
+	msg.msg_namelen = sizeof(from->u);
+    }
+    msg.msg_iov = vb.iov;
+    msg.msg_iovlen = vb.n;
+    do nr = recvmsg(sd, &msg, flags);
+    while (nr == -1 && SYS_ERRNO == EINTR);
+    if (from && nr != -1)
+	from->addrlen = msg.msg_namelen;
+#else
+    {
+	DWORD l, wflags = flags;
+
+	if (from) from->addrlen = sizeof(from->u);
+	nr = !WSARecvFrom(sd, vb.iov, vb.n, &l, &wflags,
+	 from ? &from->u.addr : NULL, from ? &from->addrlen : NULL,
+	 NULL, NULL) ? l : -1;
+    }
+#endif
+    sys_vm_enter();
+    if (nr <= 0) {
+	if (!nr || !SYS_EAGAIN(SYS_ERRNO)) goto err;
+	lua_pushboolean(L, 0);
+    } else {
+	sys_buffer_writev_done(&vb, nr);
+	lua_pushinteger(L, nr);
+    }
+    return 1;
+ err:
+    return sys_seterror(L, 0);
+}
+
+/*
+ * Arguments: sd_udata, [count (number) | membuf_udata | pool_udata
+ *	| list (table), from (sock_addr_udata), options (string) ...]
+ * Returns: [string | count (number) | membuf_udata | false (EAGAIN)]
  */
 static int
 sock_recv (lua_State *L)
@@ -496,15 +653,25 @@ sock_recv (lua_State *L)
     struct sys_buffer sb;
     char buf[SYS_BUFSIZE];
     unsigned int i, flags = 0;
-
-    sys_buffer_write_init(L, 2, &sb, buf, sizeof(buf));
+    int buf_idx = 2;
 
     for (i = lua_gettop(L); i > 3; --i) {
 	flags |= o_flags[luaL_checkoption(L, i, NULL, o_names)];
     }
+    if (lua_istable(L, 2))
+	return sock_recvv(L, flags);
+
+    if (lua_isuserdata(L, 2)) {
+	const int res = sys_buffer_pool_get(L, 2);
+
+	if (res < 0) return sys_seterror(L, SYS_ENOMEM);
+	if (res) buf_idx = lua_gettop(L);
+    }
+    sys_buffer_write_init(L, buf_idx, &sb, buf, sizeof(buf));
     if (from) {
 	sap = &from->u.addr;
 	slp = &from->addrlen;
+	*slp = sizeof(from->u);
     }
     do {
 	rlen = (n <= sb.size) ? n : sb.size;
@@ -522,16 +689,259 @@ sock_recv (lua_State *L)
      && sys_buffer_write_next(L, &sb, buf, 0));
     if (nr <= 0 && len == n) {
 	if (!nr || !SYS_EAGAIN(SYS_ERRNO)) goto err;
+	if (buf_idx != 2) sys_buffer_pool_put(L, 2, buf_idx);
 	lua_pushboolean(L, 0);
     } else {
-	if (!sys_buffer_write_done(L, &sb, buf, nr))
-	    lua_pushinteger(L, len - n);
+	if (!sys_buffer_write_done(L, &sb, buf, nr > 0 ? nr : 0)) {
+	    if (buf_idx != 2)
+		lua_pushvalue(L, buf_idx);  /* buffer from the pool */
+	    else
+		lua_pushinteger(L, len - n);
+	}
     }
     return 1;
  err:
-    return sys_seterror(L, 0);
+    nr = sys_seterror(L, 0);
+    if (buf_idx != 2) sys_buffer_pool_put(L, 2, buf_idx);
+    return nr;
+}
+
+
+
+/* Batched datagrams */
+
+#define SOCK_MMSG_MAX	64  /* datagrams per call */
+#define SOCK_MMSG_SIZE	2048  /* default size of datagram slot */
+
+/*
+ * Arguments: ..., addresses (table)
+ * Fill the list with at least n addresses.
+ */
+static void
+sock_mmsg_addrs (lua_State *L, int idx, int n, struct sock_addr **addrs)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+	struct sock_addr *sa;
+
+	lua_rawgeti(L, idx, i + 1);
+	sa = lua_touserdata(L, -1);
+	if (!sa) {
+	    sock_addr_new(L);
+	    sa = lua_touserdata(L, -1);
+	    lua_rawseti(L, idx, i + 1);
+	}
+	lua_pop(L, 1);
+	addrs[i] = sa;
+    }
 }
 
+/*
+ * Arguments: sd_udata, slab (membuf_udata), lengths (table),
+ *	[packet_size (number), addresses (table)]
+ * Returns: [count (number) | false (EAGAIN)]
+ *
+ * Note: the datagram i is placed at (i - 1) * packet_size of the slab's
+ *	free space, the slab offset is advanced by count * packet_size.
+ */
+static int
+sock_recvmmsg (lua_State *L)
+{
+    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    const size_t size = luaL_optinteger(L, 4, SOCK_MMSG_SIZE);
+    struct sock_addr *addrs[SOCK_MMSG_MAX];
+    struct sys_buffer sb;
+    int i, n, nr;
+#if defined(__linux__)
+    struct mmsghdr msgs[SOCK_MMSG_MAX];
+    struct iovec iov[SOCK_MMSG_MAX];
+#else
+    int len[SOCK_MMSG_MAX];
+#endif
+
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_argcheck(L, (int) size > 0, 4, "invalid size");
+
+    sys_buffer_write_init(L, 2, &sb, NULL, 0);
+    n = (int) (sb.size / size);
+    if (n > SOCK_MMSG_MAX) n = SOCK_MMSG_MAX;
+    luaL_argcheck(L, n, 2, "no space for datagram");
+
+    if (lua_istable(L, 5))
+	sock_mmsg_addrs(L, 5, n, addrs);
+    else
+	memset(addrs, 0, n * sizeof(struct sock_addr *));
+
+#if defined(__linux__)
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < n; ++i) {
+	struct msghdr *msg = &msgs[i].msg_hdr;
+
+	iov[i].iov_base = sb.ptr.w + i * size;
+	iov[i].iov_len = size;
+	msg->msg_iov = &iov[i];
+	msg->msg_iovlen = 1;
+	if (addrs[i]) {
+	    msg->msg_name = &addrs[i]->u.addr;
+	    msg->msg_namelen = sizeof(addrs[i]->u);
+	}
+    }
+
+    sys_vm_leave();
+    /* block only for the first datagram */
+    do nr = recvmmsg(sd, msgs, n, MSG_WAITFORONE, NULL);
+    while (nr == -1 && SYS_ERRNO == EINTR);
+    sys_vm_enter();
+#else
+    sys_vm_leave();
+    for (nr = 0; nr < n; ++nr) {
+	struct sockaddr *sap = NULL;
+	socklen_t *slp = NULL;
+	int res;
+
+	if (addrs[nr]) {
+	    sap = &addrs[nr]->u.addr;
+	    slp = &addrs[nr]->addrlen;
+	    *slp = sizeof(addrs[nr]->u);
+	}
+#ifdef MSG_DONTWAIT
+	do res = recvfrom(sd, sb.ptr.w + nr * size, size,
+	 nr ? MSG_DONTWAIT : 0, sap, slp);
+#else
+	do res = recvfrom(sd, sb.ptr.w + nr * size, size, 0, sap, slp);
+#endif
+	while (res == -1 && SYS_ERRNO == EINTR);
+	if (res == -1) {
+	    if (!nr) nr = -1;
+	    break;
+	}
+	len[nr] = res;
+#ifndef MSG_DONTWAIT
+	++nr;
+	break;
+#endif
+    }
+    sys_vm_enter();
+#endif
+
+    if (nr == -1) {
+	if (!SYS_EAGAIN(SYS_ERRNO))
+	    return sys_seterror(L, 0);
+	lua_pushboolean(L, 0);
+	return 1;
+    }
+    for (i = 0; i < nr; ++i) {
+#if defined(__linux__)
+	lua_pushinteger(L, msgs[i].msg_len);
+	if (addrs[i])
+	    addrs[i]->addrlen = msgs[i].msg_hdr.msg_namelen;
+#else
+	lua_pushinteger(L, len[i]);
+#endif
+	lua_rawseti(L, 3, i + 1);
+    }
+    sys_buffer_write_done(L, &sb, NULL, nr * size);
+    lua_pushinteger(L, nr);
+    return 1;
+}
+
+/*
+ * Arguments: sd_udata, packets (table: {string | membuf_udata} ...),
+ *	[to (sock_addr_udata) | addresses (table)]
+ * Returns: [count (number) | false (EAGAIN)]
+ *
+ * Note: the sent membuf packets are consumed.
+ */
+static int
+sock_sendmmsg (lua_State *L)
+{
+    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    struct sock_addr *to = !lua_isuserdata(L, 3) ? NULL
+     : checkudata(L, 3, SA_TYPENAME);
+    const int is_addrs = lua_istable(L, 3);
+    struct sock_addr *addrs[SOCK_MMSG_MAX];
+    struct sys_buffer sb[SOCK_MMSG_MAX];
+    int i, n, nw;
+#if defined(__linux__)
+    struct mmsghdr msgs[SOCK_MMSG_MAX];
+    struct iovec iov[SOCK_MMSG_MAX];
+#endif
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = lua_rawlen(L, 2);
+    if (n > SOCK_MMSG_MAX) n = SOCK_MMSG_MAX;
+
+    luaL_checkstack(L, 2 * n, NULL);
+    for (i = 0; i < n; ++i) {
+	lua_rawgeti(L, 2, i + 1);
+	if (!sys_buffer_read_init(L, -1, &sb[i]))
+	    luaL_argerror(L, 2, "buffer expected");
+	if (sb[i].mb) {
+	    int j;
+	    for (j = 0; j < i; ++j) {
+		if (sb[j].mb == sb[i].mb)
+		    luaL_argerror(L, 2, "buffer listed twice");
+	    }
+	}
+	addrs[i] = to;
+	if (is_addrs) {
+	    lua_rawgeti(L, 3, i + 1);
+	    addrs[i] = checkudata(L, -1, SA_TYPENAME);
+	}
+    }
+    if (!n) {
+	lua_pushinteger(L, 0);
+	return 1;
+    }
+
+#if defined(__linux__)
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < n; ++i) {
+	struct msghdr *msg = &msgs[i].msg_hdr;
+
+	sys_iov_set(&iov[i], sb[i].ptr.r, sb[i].size);
+	msg->msg_iov = &iov[i];
+	msg->msg_iovlen = 1;
+	if (addrs[i]) {
+	    msg->msg_name = &addrs[i]->u.addr;
+	    msg->msg_namelen = addrs[i]->addrlen;
+	}
+    }
+
+    sys_vm_leave();
+    do nw = sendmmsg(sd, msgs, n, 0);
+    while (nw == -1 && SYS_ERRNO == EINTR);
+    sys_vm_enter();
+#else
+    sys_vm_leave();
+    for (nw = 0; nw < n; ++nw) {
+	int res;
+
+	do res = !addrs[nw]
+	 ? send(sd, sb[nw].ptr.r, sb[nw].size, 0)
+	 : sendto(sd, sb[nw].ptr.r, sb[nw].size, 0,
+	 &addrs[nw]->u.addr, addrs[nw]->addrlen);
+	while (res == -1 && SYS_ERRNO == EINTR);
+	if (res == -1) {
+	    if (!nw) nw = -1;
+	    break;
+	}
+    }
+    sys_vm_enter();
+#endif
+
+    if (nw == -1) {
+	if (!SYS_EAGAIN(SYS_ERRNO))
+	    return sys_seterror(L, 0);
+	lua_pushboolean(L, 0);
+	return 1;
+    }
+    for (i = 0; i < nw; ++i)
+	sys_buffer_read_next(&sb[i], sb[i].size);
+    lua_pushinteger(L, nw);
+    return 1;
+}
 
 #ifdef _WIN32
 
@@ -635,50 +1045,58 @@ sock_sendfile (lua_State *L)
 }
 
 /*
- * Arguments: sd_udata, {string | membuf_udata} ...
+ * Arguments: sd_udata, {string | membuf_udata
+ *	| part (table: {membuf_udata, count (number)})} ...
  * Returns: [success/partial (boolean), count (number)]
+ *
+ * Note: part writes the count bytes of buffer, the next listing
+ *	of the same buffer continues after them.
  */
 static int
 sock_write (lua_State *L)
 {
     sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
     ssize_t n = 0;  /* number of chars actually write */
-    int i, nargs = lua_gettop(L);
+    int i, nargs = lua_gettop(L), done = 1;
 
-    for (i = 2; i <= nargs; ++i) {
-	struct sys_buffer sb;
-	int nw;
+    /* gather the arguments by SYS_IOV_MAX */
+    for (i = 2; i <= nargs; ) {
+	struct sys_vbuffer vb;
+	ssize_t nw;
 
-	if (!sys_buffer_read_init(L, i, &sb))
-	    continue;
+	i = sys_buffer_readv_init(L, i, nargs, &vb);
+	if (!vb.n) break;
 	sys_vm_leave();
 #ifndef _WIN32
-	do nw = write(sd, sb.ptr.r, sb.size);
+	do nw = writev(sd, vb.iov, vb.n);
 	while (nw == -1 && SYS_ERRNO == EINTR);
 #else
 	{
-	    WSABUF buf = {sb.size, sb.ptr.w};
 	    DWORD l;
-	    nw = !WSASend(sd, &buf, 1, &l, 0, NULL, NULL) ? l : -1;
+	    nw = !WSASend(sd, vb.iov, vb.n, &l, 0, NULL, NULL) ? l : -1;
 	}
 #endif
 	sys_vm_enter();
 	if (nw == -1) {
+	    done = 0;
 	    if (n > 0 || SYS_EAGAIN(SYS_ERRNO)) break;
 	    return sys_seterror(L, 0);
 	}
 	n += nw;
-	sys_buffer_read_next(&sb, nw);
-	if ((size_t) nw < sb.size) break;
+	sys_buffer_readv_next(&vb, nw);
+	if ((size_t) nw < vb.size) {
+	    done = 0;
+	    break;
+	}
     }
-    lua_pushboolean(L, (i > nargs));
+    lua_pushboolean(L, done);
     lua_pushinteger(L, n);
     return 2;
 }
 
 /*
- * Arguments: sd_udata, [membuf_udata, count (number)]
- * Returns: [string | false (EAGAIN)]
+ * Arguments: sd_udata, [membuf_udata | pool_udata, count (number)]
+ * Returns: [string | count (number) | membuf_udata | false (EAGAIN)]
  */
 static int
 sock_read (lua_State *L)
@@ -691,8 +1109,15 @@ sock_read (lua_State *L)
     int nr;  /* number of bytes actually read */
     struct sys_buffer sb;
     char buf[SYS_BUFSIZE];
+    int buf_idx = 2;
+
+    if (lua_isuserdata(L, 2)) {
+	const int res = sys_buffer_pool_get(L, 2);
 
-    sys_buffer_write_init(L, 2, &sb, buf, sizeof(buf));
+	if (res < 0) return sys_seterror(L, SYS_ENOMEM);
+	if (res) buf_idx = lua_gettop(L);
+    }
+    sys_buffer_write_init(L, buf_idx, &sb, buf, sizeof(buf));
     do {
 	rlen = (n <= sb.size) ? n : sb.size;
 	sys_vm_leave();
@@ -713,10 +1138,57 @@ sock_read (lua_State *L)
      && sys_buffer_write_next(L, &sb, buf, 0));
     if (nr <= 0 && len == n) {
 	if (!nr || !SYS_EAGAIN(SYS_ERRNO)) goto err;
+	if (buf_idx != 2) sys_buffer_pool_put(L, 2, buf_idx);
 	lua_pushboolean(L, 0);
     } else {
-	if (!sys_buffer_write_done(L, &sb, buf, nr))
-	    lua_pushinteger(L, len - n);
+	if (!sys_buffer_write_done(L, &sb, buf, nr > 0 ? nr : 0)) {
+	    if (buf_idx != 2)
+		lua_pushvalue(L, buf_idx);  /* buffer from the pool */
+	    else
+		lua_pushinteger(L, len - n);
+	}
+    }
+    return 1;
+ err:
+    nr = sys_seterror(L, 0);
+    if (buf_idx != 2) sys_buffer_pool_put(L, 2, buf_idx);
+    return nr;
+}
+
+/*
+ * Arguments: sd_udata, {membuf_udata, [count (number)]} ...
+ * Returns: [count (number) | false (EAGAIN)]
+ */
+static int
+sock_readv (lua_State *L)
+{
+    sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+    struct sys_vbuffer vb;
+    ssize_t nr;
+    const int nbuf = sys_buffer_writev_init(L, 2, lua_gettop(L), &vb);
+
+    if (nbuf <= 0) {
+	if (nbuf) return sys_seterror(L, SYS_ENOMEM);
+	lua_pushinteger(L, 0);
+	return 1;
+    }
+    sys_vm_leave();
+#ifndef _WIN32
+    do nr = readv(sd, vb.iov, vb.n);
+    while (nr == -1 && SYS_ERRNO == EINTR);
+#else
+    {
+	DWORD l, flags = 0;
+	nr = !WSARecv(sd, vb.iov, vb.n, &l, &flags, NULL, NULL) ? l : -1;
+    }
+#endif
+    sys_vm_enter();
+    if (nr <= 0) {
+	if (!nr || !SYS_EAGAIN(SYS_ERRNO)) goto err;
+	lua_pushboolean(L, 0);
+    } else {
+	sys_buffer_writev_done(&vb, nr);
+	lua_pushinteger(L, nr);
     }
     return 1;
  err:
@@ -768,10 +1240,13 @@ static luaL_reg sock_meth[] = {
     {"connect",		sock_connect},
     {"send",		sock_send},
     {"recv",		sock_recv},
+    {"sendmmsg",	sock_sendmmsg},
+    {"recvmmsg",	sock_recvmmsg},
     {"receive",		sock_recv},
     {"sendfile",	sock_sendfile},
     {"write",		sock_write},
     {"read",		sock_read},
+    {"readv",		sock_readv},
     {"setfd",		sock_setfd},
     {"getfd",		sock_getfd},
     {"__tostring",	sock_tostring},
@@ -783,6 +1258,7 @@ static luaL_reg sock_meth[] = {
 static luaL_reg sock_lib[] = {
     {"handle",		sock_new},
     ADDR_METHODS,
+    DNS_METHODS,
     {NULL, NULL}
 };
 
@@ -839,6 +1315,11 @@ luaopen_sys_sock (lua_State *L)
     lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
     luaL_register(L, NULL, addr_meth);
 
+    luaL_newmetatable(L, DNS_TYPENAME);
+    lua_pushvalue(L, -1);  /* push metatable */
+    lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+    luaL_register(L, NULL, dns_meth);
+
     luaL_register(L, LUA_SOCKLIBNAME, sock_lib);
 
 #ifdef _WIN32
@@ -7,16 +7,24 @@
 
 
 /*
+ * Arguments: [dispatch_mode (string: "default", "compact")]
  * Returns: [evq_udata]
+ *
+ * Note: compact callbacks are called with arguments
+ *	(evq_udata, ev_ludata, obj_udata, results (number)),
+ *	results: 1 = read, 2 = write, 4 = timeout, eof_status * 16
  */
 static int
 levq_new (lua_State *L)
 {
+    static const char *const modes[] = {"default", "compact", NULL};
+    const int compact = luaL_checkoption(L, 1, "default", modes);
     struct event_queue *evq = lua_newuserdata(L, sizeof(struct event_queue));
 
     memset(evq, 0, sizeof(struct event_queue));
     evq->vmtd = sys_get_vmthread(sys_get_thread());
     evq->buf_index = EVQ_BUF_IDX;
+    evq->compact = compact;
 
     if (!evq_init(evq)) {
 	luaL_getmetatable(L, EVQ_TYPENAME);
@@ -361,17 +369,61 @@ levq_ignore_signal (lua_State *L)
     return sys_seterror(L, 0);
 }
 
+/*
+ * Arguments: ..., modes (string: "edge", "rearm", "exclusive")
+ *
+ * Note: modes are separated by spaces or commas.
+ */
+static unsigned int
+levq_tomodes (lua_State *L, int idx)
+{
+    static const unsigned int mode_flags[] = {
+	EVENT_EDGE, EVENT_REARM, EVENT_EXCLUSIVE
+    };
+    static const char *const mode_names[] = {
+	"edge", "rearm", "exclusive", NULL
+    };
+    const char *s = lua_tostring(L, idx);
+    unsigned int flags = 0;
+
+    while (s) {
+	size_t len;
+	int i;
+
+	s += strspn(s, " ,");
+	len = strcspn(s, " ,");
+	if (!len) break;
+
+	for (i = 0; mode_names[i]; ++i) {
+	    if (!strncmp(s, mode_names[i], len) && !mode_names[i][len])
+		break;
+	}
+	if (!mode_names[i]) {
+	    lua_pushlstring(L, s, len);
+	    luaL_argerror(L, idx, lua_pushfstring(L, "invalid mode '%s'",
+	     lua_tostring(L, -1)));
+	}
+	flags |= mode_flags[i];
+	s += len;
+    }
+    /* epoll refuses one-shot exclusive wakeups */
+    if ((flags & EVENT_EXCLUSIVE) && (flags & EVENT_REARM))
+	luaL_argerror(L, idx, "exclusive can't be rearmed");
+    return flags;
+}
+
 /*
  * Arguments: evq_udata, sd_udata,
  *	events (string: "r", "w", "rw", "accept", "connect"),
- *	callback (function), [timeout (milliseconds), one_shot (boolean)]
+ *	callback (function), [timeout (milliseconds), one_shot (boolean),
+ *	modes (string: "edge", "rearm", "exclusive")]
  * Returns: [ev_ludata]
  */
 static int
 levq_add_socket (lua_State *L)
 {
     const char *evstr = lua_tostring(L, 3);
-    unsigned int flags = EVENT_SOCKET;
+    unsigned int flags = EVENT_SOCKET | levq_tomodes(L, 7);
 
     if (evstr) {
 	switch (*evstr) {
@@ -383,13 +435,17 @@ levq_add_socket (lua_State *L)
 	    break;
 	}
     }
+    if ((flags & EVENT_EXCLUSIVE)
+     && ((flags & EVENT_ONESHOT) || lua_toboolean(L, 6)))
+	luaL_argerror(L, 7, "exclusive can't be one-shot");
     lua_settop(L, 6);
     lua_pushinteger(L, flags);  /* event_flags */
     return levq_add(L);
 }
 
 /*
- * Arguments: evq_udata, ev_ludata, events (string: [-+] "r", "w", "rw")
+ * Arguments: evq_udata, ev_ludata, events (string: [-+] "r", "w", "rw"),
+ *	[modes (string: "edge", "rearm")]
  * Returns: [evq_udata]
  */
 static int
@@ -397,11 +453,22 @@ levq_mod_socket (lua_State *L)
 {
     struct event *ev = levq_toevent(L, 2);
     const char *evstr = luaL_checkstring(L, 3);
+    unsigned int modes;
     int change, flags;
 
     if (!ev || event_deleted(ev) || !(ev->flags & EVENT_SOCKET))
 	return 0;
 
+    modes = ev->flags & (EVENT_EDGE | EVENT_REARM);
+    if (!lua_isnoneornil(L, 4)) {
+	const unsigned int new_modes = levq_tomodes(L, 4);
+
+	if ((ev->flags & EVENT_EXCLUSIVE) && (new_modes & EVENT_REARM))
+	    luaL_argerror(L, 4, "exclusive can't be rearmed");
+	ev->flags &= ~(EVENT_EDGE | EVENT_REARM);
+	ev->flags |= new_modes & (EVENT_EDGE | EVENT_REARM);
+    }
+
     change = 0;
     flags = ev->flags & (EVENT_READ | EVENT_WRITE);
     for (; *evstr; ++evstr) {
@@ -427,10 +494,248 @@ levq_mod_socket (lua_State *L)
 	lua_settop(L, 1);
 	return 1;
     }
+    ev->flags &= ~(EVENT_EDGE | EVENT_REARM);
+    ev->flags |= modes;
     return sys_seterror(L, 0);
 }
 
 
+#ifdef EVQ_RELAY
+
+#define RELAY_TYPENAME	"sys.relay"
+
+/*
+ * Arguments: ..., EVQ_ENVIRON (table), EVQ_OBJ_UDATA (table), EVQ_CALLBACK (table)
+ */
+static void
+levq_relay_del (lua_State *L, int idx, struct event_queue *evq, struct relay *rl)
+{
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+	struct event *ev = rl->ev[i];
+
+	if (!ev) continue;
+	rl->ev[i] = NULL;
+
+	if (!event_deleted(ev))
+	    evq_del(ev, 1);
+	if (!(ev->flags & (EVENT_ACTIVE | EVENT_DELETE)))
+	    levq_del_event(L, idx, evq, ev);
+	ev->flags |= EVENT_DELETE;
+    }
+}
+
+/*
+ * Arguments: evq_udata, sd_udata, sd_udata | fd_udata,
+ *	callback (function), [budget (number)]
+ * Returns: [relay_udata]
+ *
+ * Note: the descriptors are switched to non-blocking mode;
+ *	callback is called on end of relay (both directions are shut down
+ *	or error) and when the budget of bytes is exhausted with arguments
+ *	(evq_udata, relay_udata, "eof" | "error" | "budget", [message (string)])
+ */
+static int
+levq_add_relay (lua_State *L)
+{
+    struct event_queue *evq = checkudata(L, 1, EVQ_TYPENAME);
+    fd_t *fdp[2];
+    const lua_Number num = lua_isnoneornil(L, 5) ? -1 : lua_tonumber(L, 5);
+    const int64_t budget = (int64_t) num;
+    struct relay *rl;
+    int i, err;
+
+    fdp[0] = lua_touserdata(L, 2);
+    fdp[1] = lua_touserdata(L, 3);
+    luaL_argcheck(L, fdp[0], 2, "descriptor expected");
+    luaL_argcheck(L, fdp[1], 3, "descriptor expected");
+    luaL_checktype(L, 4, LUA_TFUNCTION);
+
+#undef ARG_LAST
+#define ARG_LAST	5
+
+    lua_settop(L, ARG_LAST);
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, ARG_LAST+1, EVQ_OBJ_UDATA);
+    lua_rawgeti(L, ARG_LAST+1, EVQ_CALLBACK);
+
+    rl = lua_newuserdata(L, sizeof(struct relay));
+    if (relay_init(rl, *fdp[0], *fdp[1], budget < 0 ? -1 : budget)) {
+	err = SYS_ERRNO;
+	relay_done(rl);
+	return sys_seterror(L, err);
+    }
+    luaL_getmetatable(L, RELAY_TYPENAME);
+    lua_setmetatable(L, -2);
+
+    /* keep the descriptors */
+    lua_createtable(L, 2, 0);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, 1);
+    lua_pushvalue(L, 3);
+    lua_rawseti(L, -2, 2);
+    lua_setfenv(L, -2);
+
+    for (i = 0; i < 2; ++i) {
+	struct event *ev = levq_new_event(L, ARG_LAST+1, evq);
+	const unsigned int flags = rl->budget ? EVENT_READ : 0;
+
+	ev->fd = rl->fd[i];
+	ev->flags = flags | EVENT_REARM | EVENT_RELAY | EVENT_CALLBACK;
+
+	/* place for timeout_queue */
+	if (!evq->ev_free)
+	    evq->ev_free = levq_new_event(L, ARG_LAST+1, evq);
+
+	if (evq_add(evq, ev)) {
+	    err = SYS_ERRNO;
+	    levq_del_event(L, ARG_LAST+1, evq, ev);
+	    levq_relay_del(L, ARG_LAST+1, evq, rl);
+	    relay_done(rl);
+	    return sys_seterror(L, err);
+	}
+	rl->ev[i] = ev;
+	rl->armed[i] = flags;
+
+	/* cb_fun */
+	lua_pushvalue(L, 4);
+	lua_rawseti(L, ARG_LAST+3, ev->ev_id);
+	/* obj_udata */
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, ARG_LAST+2, ev->ev_id);
+    }
+    return 1;
+}
+
+/*
+ * Arguments: evq_udata, relay_udata
+ * Returns: [evq_udata]
+ */
+static int
+levq_del_relay (lua_State *L)
+{
+    struct event_queue *evq = checkudata(L, 1, EVQ_TYPENAME);
+    struct relay *rl = checkudata(L, 2, RELAY_TYPENAME);
+
+#undef ARG_LAST
+#define ARG_LAST	2
+
+    lua_settop(L, ARG_LAST);
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, ARG_LAST+1, EVQ_OBJ_UDATA);
+    lua_rawgeti(L, ARG_LAST+1, EVQ_CALLBACK);
+
+    levq_relay_del(L, ARG_LAST+1, evq, rl);
+    lua_settop(L, 1);
+    return 1;
+}
+
+/*
+ * Pump the triggered relay event, call the callback on the end.
+ * Arguments: evq_udata, ..., EVQ_ENVIRON (table), EVQ_OBJ_UDATA (table),
+ *	EVQ_CALLBACK (table)
+ */
+static void
+levq_relay (lua_State *L, int idx, struct event_queue *evq,
+            struct event *ev, unsigned int ev_flags)
+{
+    static const char *const reasons[] = {NULL, "eof", "budget", "error"};
+    struct relay *rl;
+    int res, nargs = 3;
+
+    lua_rawgeti(L, idx + 1, ev->ev_id);  /* relay_udata */
+    rl = lua_touserdata(L, -1);
+
+    res = relay_process(rl, ev, ev_flags);
+    if (res == RELAY_PUMP) {
+	lua_pop(L, 1);
+	return;
+    }
+
+    lua_rawgeti(L, idx + 2, ev->ev_id);  /* callback function */
+    lua_insert(L, -2);
+    lua_pushvalue(L, 1);  /* evq_udata */
+    lua_insert(L, -2);
+    lua_pushstring(L, reasons[res]);
+
+    if (res != RELAY_BUDGET) {
+	levq_relay_del(L, idx, evq, rl);
+	relay_done(rl);
+    }
+    if (res == RELAY_ERROR) {
+	sys_seterror(L, rl->err);
+	lua_remove(L, -2);  /* nil */
+	nargs++;
+    }
+    lua_call(L, nargs, 0);
+}
+
+/*
+ * Arguments: relay_udata, [budget (number)]
+ * Returns: relay_udata | budget (number)
+ */
+static int
+relay_budget (lua_State *L)
+{
+    struct relay *rl = checkudata(L, 1, RELAY_TYPENAME);
+
+    if (lua_isnoneornil(L, 2)) {
+	lua_pushnumber(L, (lua_Number) rl->budget);
+	return 1;
+    }
+    {
+	const lua_Number num = lua_tonumber(L, 2);
+	const int64_t budget = (int64_t) num;
+
+	rl->budget = (budget < 0) ? -1 : budget;
+	rl->paused = 0;
+	if (relay_arm(rl))
+	    return sys_seterror(L, 0);
+	lua_settop(L, 1);
+	return 1;
+    }
+}
+
+/*
+ * Arguments: relay_udata
+ * Returns: a_to_b (number), b_to_a (number)
+ */
+static int
+relay_stats (lua_State *L)
+{
+    struct relay *rl = checkudata(L, 1, RELAY_TYPENAME);
+
+    lua_pushnumber(L, (lua_Number) rl->nbytes[0]);
+    lua_pushnumber(L, (lua_Number) rl->nbytes[1]);
+    return 2;
+}
+
+/*
+ * Arguments: relay_udata
+ */
+static int
+relay_gc (lua_State *L)
+{
+    relay_done(checkudata(L, 1, RELAY_TYPENAME));
+    return 0;
+}
+
+/*
+ * Arguments: relay_udata
+ * Returns: string
+ */
+static int
+relay_tostring (lua_State *L)
+{
+    struct relay *rl = checkudata(L, 1, RELAY_TYPENAME);
+
+    lua_pushfstring(L, RELAY_TYPENAME " (%p)", rl);
+    return 1;
+}
+
+#endif /* EVQ_RELAY */
+
 /*
  * Arguments: evq_udata, ev_ludata, [reuse_fd (boolean)]
  * Returns: [evq_udata]
@@ -444,7 +749,13 @@ levq_del (lua_State *L)
     unsigned int ev_flags;
     int res = 0;
 
-    if (!ev) return 0;
+    if (!ev) {
+#ifdef EVQ_RELAY
+	if (lua_isuserdata(L, 2))
+	    return levq_del_relay(L);
+#endif
+	return 0;
+    }
 
 #undef ARG_LAST
 #define ARG_LAST	1
@@ -581,6 +892,28 @@ levq_on_interrupt (lua_State *L)
     return 0;
 }
 
+/*
+ * Arguments: evq_udata, [buffer_size (number), slab_buffers (number)]
+ * Returns: pool_udata
+ */
+static int
+levq_pool (lua_State *L)
+{
+    lua_settop(L, 3);
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, EVQ_POOL);
+    if (lua_isnil(L, -1)) {
+	lua_pop(L, 1);
+	lua_pushcfunction(L, mempool_create);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 3);
+	lua_call(L, 2, 1);
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, -3, EVQ_POOL);
+    }
+    return 1;
+}
+
 /*
  * Arguments: evq_udata, [timeout (milliseconds), once (boolean)]
  * Returns: [evq_udata]
@@ -592,6 +925,7 @@ levq_loop (lua_State *L)
     const msec_t timeout = (lua_type(L, 2) != LUA_TNUMBER)
      ? TIMEOUT_INFINITE : (msec_t) lua_tointeger(L, 2);
     const int is_once = lua_isboolean(L, -1) && lua_toboolean(L, -1);
+    msec_t left = timeout;
 
 #undef ARG_LAST
 #define ARG_LAST	1
@@ -602,7 +936,7 @@ levq_loop (lua_State *L)
     lua_rawgeti(L, ARG_LAST+1, EVQ_CALLBACK);
 
     while (!evq_is_empty(evq)) {
-	struct event *ev, *ev_next;
+	struct event *ev;
 
 	if (evq->stop) {
 	    evq->stop = 0;
@@ -610,12 +944,27 @@ levq_loop (lua_State *L)
 	}
 
 	if (!evq->ev_ready) {
-	    const int res = evq_wait(evq, timeout);
+	    const msec_t since = (timeout == TIMEOUT_INFINITE)
+	     ? 0 : get_milliseconds();
+	    const int res = evq_wait(evq, left);
 
 	    if (res == EVQ_TIMEOUT)
 		break;
 	    if (res == EVQ_FAILED)
 		return sys_seterror(L, 0);
+
+	    if (timeout != TIMEOUT_INFINITE) {
+		if (evq->ev_ready)
+		    left = timeout;
+		else {
+		    /* woken before the timeout: wait only the rest of it */
+		    const msec_t elapsed = evq->now - since;
+
+		    if (elapsed >= left)
+			break;
+		    left -= elapsed;
+		}
+	    }
 	}
 
 	if (evq->intr) {
@@ -631,14 +980,23 @@ levq_loop (lua_State *L)
 	    evq->stop = 1;
 	}
 
-	for (ev = evq->ev_ready; ev; ev = ev_next) {
+	/* other vm-threads may prepend the triggered events while calling */
+	for (ev = evq->ev_ready; ev; ev = evq->ev_ready) {
 	    const unsigned int ev_flags = ev->flags;
 
-	    evq->ev_ready = ev_next = ev->next_ready;
+	    evq->ev_ready = ev->next_ready;
 
 	    if (!(ev_flags & EVENT_DELETE)) {
+		ev->flags = (ev_flags & EVENT_MASK) | EVENT_ACTIVE;
+
+#ifdef EVQ_RELAY
+		if (ev_flags & EVENT_RELAY)
+		    levq_relay(L, ARG_LAST+1, evq, ev, ev_flags);
+		else
+#endif
 		if (ev_flags & EVENT_CALLBACK) {
 		    const int ev_id = ev->ev_id;
+		    int nargs;
 
 		    /* callback function */
 		    lua_rawgeti(L, ARG_LAST+3, ev_id);
@@ -646,34 +1004,43 @@ levq_loop (lua_State *L)
 		    lua_pushvalue(L, 1);  /* evq_udata */
 		    lua_pushlightuserdata(L, ev);  /* ev_ludata */
 		    lua_rawgeti(L, ARG_LAST+2, ev_id);  /* obj_udata */
-		    lua_pushboolean(L, ev_flags & EVENT_READ_RES);
-		    lua_pushboolean(L, ev_flags & EVENT_WRITE_RES);
-		    if (ev_flags & EVENT_TIMEOUT_RES)
-			lua_pushnumber(L, ev->tq->msec);
-		    else
-			lua_pushnil(L);
-		    if (ev_flags & EVENT_EOF_MASK_RES)
-			lua_pushinteger(L, (int) ev_flags >> EVENT_EOF_SHIFT_RES);
-		    else
-			lua_pushnil(L);
+		    if (evq->compact) {
+			lua_pushinteger(L, (lua_Integer)
+			 (ev_flags >> EVENT_PACKED_SHIFT_RES));
+			nargs = 4;
+		    }
+		    else {
+			lua_pushboolean(L, ev_flags & EVENT_READ_RES);
+			lua_pushboolean(L, ev_flags & EVENT_WRITE_RES);
+			if (ev_flags & EVENT_TIMEOUT_RES)
+			    lua_pushnumber(L, event_get_timeout(ev));
+			else
+			    lua_pushnil(L);
+			if (ev_flags & EVENT_EOF_MASK_RES)
+			    lua_pushinteger(L, (int) ev_flags >> EVENT_EOF_SHIFT_RES);
+			else
+			    lua_pushnil(L);
+			nargs = 7;
+		    }
 
 		    if (!(ev_flags & EVENT_CALLBACK_THREAD)) {
-			lua_call(L, 7, 0);
+			lua_call(L, nargs, 0);
                     }
 		    else {
 			lua_State *co = lua_tothread(L, ARG_LAST+4);
 			int status;
 
-			lua_xmove(L, co, 7);
+			lua_xmove(L, co, nargs);
 			lua_pop(L, 1);  /* pop coroutine */
-			status = lua_resume(co, 7);
+			status = lua_resume(co, nargs);
 			if (status == LUA_YIELD) {
 			    lua_settop(co, 0);
                         }
                         else if (status == 0) {
 			    lua_settop(co, 0);
                             ev->flags |= EVENT_DELETE;
-	                    evq_del(ev, 0);
+			    if (!event_deleted(ev))
+				evq_del(ev, 0);
                         }
 			else {
 			    lua_xmove(co, L, 1);  /* error message */
@@ -681,6 +1048,13 @@ levq_loop (lua_State *L)
 			}
 		    }
 		}
+		/* triggered again while called? */
+		if ((ev->flags & ~(EVENT_MASK | EVENT_ACTIVE))
+		 && !(ev->flags & EVENT_DELETE)) {
+		    ev->next_ready = evq->ev_ready;
+		    evq->ev_ready = ev;
+		    continue;
+		}
 		ev->flags &= EVENT_MASK;  /* clear EVENT_ACTIVE and EVENT_*_RES flags */
 	    }
 	    /* delete if called {evq_del | EVENT_ONESHOT} */
@@ -745,6 +1119,7 @@ sys_trigger_notify (sys_trigger_t *trigger, int flags)
     struct event_queue *evq = event_get_evq(ev);
     struct event *ev_ready;
     const int deleted = (flags & SYS_EVDEL) ? EVENT_DELETE : 0;
+    int intr;
 
     if (deleted) *trigger = NULL;
 
@@ -766,38 +1141,42 @@ sys_trigger_notify (sys_trigger_t *trigger, int flags)
 	    struct event_queue *cur_evq = event_get_evq(ev);
 
 	    ev->flags |= (res ? res : deleted);
-	    if (ev_flags & EVENT_ACTIVE)
-		continue;
-
-	    ev->flags |= EVENT_ACTIVE;
-	    if (deleted || (ev_flags & EVENT_ONESHOT))
-		evq_del(ev, 0);
-	    else if (ev->tq) {
-		evq_set_timeout(ev, ev->tq->msec);  /* timeout_reset */
+	    if (ev_flags & EVENT_ACTIVE) {
+		/* event_queue will call it again with new results */
+		if (deleted && cur_evq)
+		    evq_del(ev, 0);
 	    }
+	    else {
+		ev->flags |= EVENT_ACTIVE;
+		if (deleted || (ev_flags & EVENT_ONESHOT))
+		    evq_del(ev, 0);
+		else if (ev->tq) {
+		    evq_set_timeout(ev, event_get_timeout(ev));  /* timeout_reset */
+		}
 
-	    /* Is the event from the same event_queue? */
-	    if (evq != cur_evq) {
-		evq->ev_ready = ev_ready;
-		if (vmtd != evq->vmtd) sys_vm2_leave(evq->vmtd);
+		/* Is the event from the same event_queue? */
+		if (evq != cur_evq) {
+		    evq->ev_ready = ev_ready;
+		    evq_interrupt(evq);
+		    if (vmtd != evq->vmtd) sys_vm2_leave(evq->vmtd);
 
-		evq_interrupt(evq);
+		    evq = cur_evq;
+		    if (vmtd != evq->vmtd) sys_vm2_enter(evq->vmtd);
+		    ev_ready = evq->ev_ready;
+		}
 
-		evq = cur_evq;
-		if (vmtd != evq->vmtd) sys_vm2_enter(evq->vmtd);
-		ev_ready = evq->ev_ready;
+		ev->next_ready = ev_ready;
+		ev_ready = ev;
 	    }
-
-	    ev->next_ready = ev_ready;
-	    ev_ready = ev;
 	}
 	ev = ev->next_object;
     } while (ev);
 
     evq->ev_ready = ev_ready;
+    intr = evq_interrupt(evq);  /* event_queue may be closed after leave */
     if (vmtd != evq->vmtd) sys_vm2_leave(evq->vmtd);
 
-    return evq_interrupt(evq);
+    return intr;
 }
 
 /*
@@ -822,7 +1201,7 @@ levq_notify (lua_State *L)
 	if (ev->flags & EVENT_ONESHOT)
 	    evq_del(ev, 0);
 	else
-	    evq_set_timeout(ev, ev->tq->msec);  /* timeout_reset */
+	    evq_set_timeout(ev, event_get_timeout(ev));  /* timeout_reset */
     }
 
     ev->next_ready = evq->ev_ready;
@@ -848,6 +1227,47 @@ levq_tostring (lua_State *L)
     return 1;
 }
 
+#ifdef USE_EPOLL
+/*
+ * Arguments: evq_udata, [max_batches (number)]
+ * Returns: evq_udata | max_batches (number)
+ */
+static int
+levq_batches (lua_State *L)
+{
+    struct event_queue *evq = checkudata(L, 1, EVQ_TYPENAME);
+
+    if (lua_isnoneornil(L, 2)) {
+	lua_pushinteger(L, evq->max_batches);
+	return 1;
+    }
+    {
+	const int n = lua_tointeger(L, 2);
+
+	evq->max_batches = (n > 0) ? n : 1;
+	lua_settop(L, 1);
+	return 1;
+    }
+}
+
+/*
+ * Arguments: evq_udata, [reset (boolean)]
+ * Returns: max_events (number), saturated (number), waits (number)
+ */
+static int
+levq_stats (lua_State *L)
+{
+    struct event_queue *evq = checkudata(L, 1, EVQ_TYPENAME);
+
+    lua_pushinteger(L, evq->max_events);
+    lua_pushinteger(L, evq->nsaturated);
+    lua_pushinteger(L, evq->nwaits);
+    if (lua_toboolean(L, 2))
+	evq->nsaturated = evq->nwaits = 0;
+    return 3;
+}
+#endif
+
 static int
 levq_size (lua_State *L)
 {
@@ -871,17 +1291,35 @@ static luaL_reg evq_meth[] = {
     {"ignore_signal",	levq_ignore_signal},
     {"add_socket",	levq_add_socket},
     {"mod_socket",	levq_mod_socket},
+#ifdef EVQ_RELAY
+    {"add_relay",	levq_add_relay},
+#endif
     {"del",		levq_del},
     {"timeout",		levq_timeout},
     {"callback",	levq_callback},
     {"on_interrupt",	levq_on_interrupt},
+    {"pool",		levq_pool},
     {"loop",		levq_loop},
     {"interrupt",	levq_interrupt},
     {"stop",		levq_stop},
     {"now",		levq_now},
     {"notify",		levq_notify},
+#ifdef USE_EPOLL
+    {"batches",		levq_batches},
+    {"stats",		levq_stats},
+#endif
     {"__gc",		levq_done},
     {"__tostring",	levq_tostring},
     {"__len",           levq_size},
     {NULL, NULL}
 };
+
+#ifdef EVQ_RELAY
+static luaL_reg relay_meth[] = {
+    {"budget",		relay_budget},
+    {"stats",		relay_stats},
+    {"__gc",		relay_gc},
+    {"__tostring",	relay_tostring},
+    {NULL, NULL}
+};
+#endif
@@ -556,8 +556,12 @@ sys_lock (lua_State *L)
 }
 
 /*
- * Arguments: fd_udata, {string | membuf_udata} ...
+ * Arguments: fd_udata, {string | membuf_udata
+ *	| part (table: {membuf_udata, count (number)})} ...
  * Returns: [success/partial (boolean), count (number)]
+ *
+ * Note: part writes the count bytes of buffer, the next listing
+ *	of the same buffer continues after them.
  */
 static int
 sys_write (lua_State *L)
@@ -566,32 +570,56 @@ sys_write (lua_State *L)
     ssize_t n = 0;  /* number of chars actually write */
     int i, nargs = lua_gettop(L);
 
-    for (i = 2; i <= nargs; ++i) {
-	struct sys_buffer sb;
-	int nw;
+#ifndef _WIN32
+    int done = 1;
 
-	if (!sys_buffer_read_init(L, i, &sb))
-	    continue;
+    /* gather the arguments by SYS_IOV_MAX */
+    for (i = 2; i <= nargs; ) {
+	struct sys_vbuffer vb;
+	ssize_t nw;
+
+	i = sys_buffer_readv_init(L, i, nargs, &vb);
+	if (!vb.n) break;
 	sys_vm_leave();
-#ifndef _WIN32
-	do nw = write(fd, sb.ptr.r, sb.size);
+	do nw = writev(fd, vb.iov, vb.n);
 	while (nw == -1 && SYS_ERRNO == EINTR);
+	sys_vm_enter();
+	if (nw == -1) {
+	    done = 0;
+	    if (n > 0 || SYS_EAGAIN(SYS_ERRNO)) break;
+	    return sys_seterror(L, 0);
+	}
+	n += nw;
+	sys_buffer_readv_next(&vb, nw);
+	if ((size_t) nw < vb.size) {
+	    done = 0;
+	    break;
+	}
+    }
+    lua_pushboolean(L, done);
 #else
+    for (i = 2; i <= nargs; ++i) {
+	struct sys_vbuffer vb;
+	int nw;
+
+	sys_buffer_readv_init(L, i, i, &vb);
+	if (!vb.n) continue;
+	sys_vm_leave();
 	{
 	    DWORD l;
-	    nw = WriteFile(fd, sb.ptr.r, sb.size, &l, NULL) ? l : -1;
+	    nw = WriteFile(fd, vb.iov[0].buf, vb.iov[0].len, &l, NULL) ? l : -1;
 	}
-#endif
 	sys_vm_enter();
 	if (nw == -1) {
 	    if (n > 0 || SYS_EAGAIN(SYS_ERRNO)) break;
 	    return sys_seterror(L, 0);
 	}
 	n += nw;
-	sys_buffer_read_next(&sb, nw);
-	if ((size_t) nw < sb.size) break;
+	sys_buffer_readv_next(&vb, nw);
+	if ((size_t) nw < vb.size) break;
     }
     lua_pushboolean(L, (i > nargs));
+#endif
     lua_pushinteger(L, n);
     return 2;
 }
@@ -634,7 +662,7 @@ sys_read (lua_State *L)
 	if (!nr || SYS_EAGAIN(SYS_ERRNO)) goto err;
 	lua_pushboolean(L, 0);
     } else {
-	if (!sys_buffer_write_done(L, &sb, buf, nr))
+	if (!sys_buffer_write_done(L, &sb, buf, nr > 0 ? nr : 0))
 	    lua_pushinteger(L, len - n);
     }
     return 1;
@@ -642,6 +670,57 @@ sys_read (lua_State *L)
     return sys_seterror(L, 0);
 }
 
+/*
+ * Arguments: fd_udata, {membuf_udata, [count (number)]} ...
+ * Returns: [count (number) | false (EAGAIN)]
+ */
+static int
+sys_readv (lua_State *L)
+{
+    fd_t fd = (fd_t) lua_unboxinteger(L, 1, FD_TYPENAME);
+    struct sys_vbuffer vb;
+    ssize_t nr;
+    const int nbuf = sys_buffer_writev_init(L, 2, lua_gettop(L), &vb);
+
+    if (nbuf <= 0) {
+	if (nbuf) return sys_seterror(L, SYS_ENOMEM);
+	lua_pushinteger(L, 0);
+	return 1;
+    }
+    sys_vm_leave();
+#ifndef _WIN32
+    do nr = readv(fd, vb.iov, vb.n);
+    while (nr == -1 && SYS_ERRNO == EINTR);
+#else
+    {
+	int i;
+
+	/* till the short read */
+	for (i = 0, nr = 0; i < vb.n; ++i) {
+	    DWORD l;
+
+	    if (!ReadFile(fd, vb.iov[i].buf, vb.iov[i].len, &l, NULL)) {
+		if (!nr) nr = -1;
+		break;
+	    }
+	    nr += l;
+	    if (l < vb.iov[i].len) break;
+	}
+    }
+#endif
+    sys_vm_enter();
+    if (nr <= 0) {
+	if (!nr || !SYS_EAGAIN(SYS_ERRNO)) goto err;
+	lua_pushboolean(L, 0);
+    } else {
+	sys_buffer_writev_done(&vb, nr);
+	lua_pushinteger(L, nr);
+    }
+    return 1;
+ err:
+    return sys_seterror(L, 0);
+}
+
 /*
  * Arguments: fd_udata, [data_only (boolean)]
  * Returns: [fd_udata]
@@ -798,6 +877,7 @@ static luaL_reg fd_meth[] = {
     {"lock",		sys_lock},
     {"write",		sys_write},
     {"read",		sys_read},
+    {"readv",		sys_readv},
     {"flush",		sys_flush},
     {"nonblocking",	sys_nonblocking},
     {"utime",		sys_utime},
@@ -16,6 +16,7 @@ typedef DWORD 			thread_key_t;
 #else
 
 #include <pthread.h>
+#include <dlfcn.h>
 
 #define thread_getid		pthread_self
 
@@ -47,6 +48,7 @@ struct sys_thread {
     struct sys_vmthread *vmtd;  /* vm-thread */
     thread_id_t tid;
     int volatile interrupted;  /* thread interrupted? */
+    int vm_left;  /* VM-mutex released by sys_vm_leave()? */
     sys_trigger_t trigger;  /* notify event_queue about termination or vm-i/o */
 };
 
@@ -78,8 +80,17 @@ struct sys_vmthread {
 /* Global Thread Local Storage Index */
 static thread_key_t g_TLSIndex = INVALID_TLS_INDEX;
 
+/*
+ * Are other threads started? Until then the only thread owns its VM
+ * and sys_vm_enter/sys_vm_leave don't touch TLS and VM-mutex.
+ * The flag is per process, so sys_vm_enter locks only the VM-mutex,
+ * released by the thread's sys_vm_leave.
+ */
+static int volatile g_Threaded = 0;
+
 
 static void luaopen_sys_thread (lua_State *L);
+static void thread_msg_clear (struct sys_vmthread *vmtd);
 
 
 void
@@ -147,13 +158,18 @@ sys_vm_enter (void)
 {
     struct sys_thread *td;
 
-    if (g_TLSIndex == INVALID_TLS_INDEX)
+    if (!g_Threaded)
 	return;
 
     td = sys_get_thread();
-    sys_vm2_enter(td);
+    if (!td) return;
 
-    if (td && td->interrupted) {
+    if (td->vm_left) {
+	td->vm_left = 0;
+	sys_vm2_enter(td);
+    }
+
+    if (td->interrupted) {
 	lua_pushlightuserdata(td->L, &g_TLSIndex);
 	lua_error(td->L);
     }
@@ -162,10 +178,16 @@ sys_vm_enter (void)
 void
 sys_vm_leave (void)
 {
-    if (g_TLSIndex == INVALID_TLS_INDEX)
+    struct sys_thread *td;
+
+    if (!g_Threaded)
 	return;
 
-    sys_vm2_leave(sys_get_thread());
+    td = sys_get_thread();
+    if (td) {
+	td->vm_left = 1;
+	sys_vm2_leave(td);
+    }
 }
 
 
@@ -200,6 +222,8 @@ sys_new_thread (struct sys_thread *td)
     NL = lua_newthread(L);
     if (!NL) return NULL;
 
+    g_Threaded = 1;
+
     ntd = lua_newuserdata(L, sizeof(struct sys_thread));
     memset(ntd, 0, sizeof(struct sys_thread));
     ntd->mutex = td->mutex;
@@ -288,6 +312,7 @@ vmthread_del (lua_State *L)
 #ifdef _WIN32
 	thread_critsect_del(&vmtd->bufcs);
 #endif
+	thread_msg_clear(vmtd);
 	free(vmtd->buffer.ptr);
 
 #ifndef _WIN32
@@ -397,6 +422,9 @@ thread_run (lua_State *L)
     td->L = NL;
     td->vmtd = vmtd->vmtd;
 
+    /* the VM becomes shared: current thread holds VM-mutex already */
+    g_Threaded = 1;
+
 #ifndef _WIN32
     if ((res = pthread_attr_init(&attr))
      || (res = pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE)))
@@ -488,14 +516,42 @@ thread_openlibs (lua_State *L)
 }
 
 /*
- * Arguments: filename (string) | function_dump (string),
+ * The vm-thread returns to this library after closing own VM,
+ * so the last lua_close() must not unload it.
+ */
+static void
+thread_pinlib (void)
+{
+    static int pinned;
+
+    if (pinned) return;
+    pinned = 1;
+#ifndef _WIN32
+    {
+	Dl_info info;
+
+	if (dladdr(&g_TLSIndex, &info) && info.dli_fname)
+	    dlopen(info.dli_fname, RTLD_NOW);  /* never closed */
+    }
+#else
+    {
+	HMODULE hmod;
+
+	GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS
+	 | GET_MODULE_HANDLE_EX_FLAG_PIN, (LPCTSTR) &g_TLSIndex, &hmod);
+    }
+#endif
+}
+
+/*
+ * Arguments: ..., filename (string) | function_dump (string),
  *	[arguments (string | number | boolean | lightuserdata) ...]
- * Returns: [thread_ludata]
+ * Returns: vmthread | NULL
  */
-static int
-thread_runvm (lua_State *L)
+static struct sys_vmthread *
+thread_newvm (lua_State *L, int idx, int top, int shard)
 {
-    const char *path = luaL_checkstring(L, 1);
+    const char *path = luaL_checkstring(L, idx);
     lua_State *NL = NULL;
     struct sys_vmthread *vmtd = (struct sys_vmthread *) sys_get_thread();
 #ifndef _WIN32
@@ -513,7 +569,7 @@ thread_runvm (lua_State *L)
     thread_openlibs(NL);
 
     if (path[0] == LUA_SIGNATURE[0]
-     ? luaL_loadbuffer(NL, path, lua_rawlen(L, 1), "thread")
+     ? luaL_loadbuffer(NL, path, lua_rawlen(L, idx), "thread")
      : luaL_loadfile(NL, path)) {
 	lua_pushstring(L, lua_tostring(NL, -1));  /* error message */
 	lua_close(NL);
@@ -522,10 +578,12 @@ thread_runvm (lua_State *L)
 
     /* Arguments */
     lua_pushlightuserdata(NL, vmtd);  /* master */
+    if (shard)
+	lua_pushinteger(NL, shard);  /* shard_index */
     {
-	int i, top = lua_gettop(L);
+	int i;
 
-	for (i = 2; i <= top; ++i) {
+	for (i = idx + 1; i <= top; ++i) {
 	    switch (lua_type(L, i)) {
 	    case LUA_TSTRING:
 		lua_pushstring(NL, lua_tostring(L, i));
@@ -549,6 +607,11 @@ thread_runvm (lua_State *L)
     if (vmthread_new(NL, &vmtd))
 	goto err_clean;
 
+    /* the vm-threads notify each other under the VM-mutexes */
+    g_Threaded = 1;
+
+    thread_pinlib();
+
 #ifndef _WIN32
     res = pthread_attr_init(&attr);
     if (res) goto err_clean;
@@ -564,27 +627,88 @@ thread_runvm (lua_State *L)
     if (hThr) {
 	CloseHandle(hThr);
 #endif
-	lua_pushlightuserdata(L, vmtd);
-	return 1;
+	return vmtd;
     }
  err_clean:
     lua_close(NL);
  err:
-    return sys_seterror(L, res);
+    if (res) errno = res;
+    return NULL;
 }
 
 /*
- * Arguments: thread_ludata
+ * Arguments: filename (string) | function_dump (string),
+ *	[arguments (string | number | boolean | lightuserdata) ...]
+ * Returns: [thread_ludata]
  */
 static int
-thread_interrupt (lua_State *L)
+thread_runvm (lua_State *L)
 {
-    struct sys_thread *td = lua_touserdata(L, 1);
+    struct sys_vmthread *vmtd = thread_newvm(L, 1, lua_gettop(L), 0);
+
+    if (!vmtd) return sys_seterror(L, 0);
 
+    lua_pushlightuserdata(L, vmtd);
+    return 1;
+}
+
+static void
+thread_setinterrupt (struct sys_thread *td)
+{
+    g_Threaded = 1;  /* check interruption in sys_vm_enter() */
     td->interrupted = 1;
 #ifndef _WIN32
     pthread_kill(td->tid, SYS_SIGINTR);
 #endif
+}
+
+/*
+ * Arguments: count (number), filename (string) | function_dump (string),
+ *	[arguments (string | number | boolean | lightuserdata) ...]
+ * Returns: [thread_ludata ...]
+ *
+ * Note: Starts the sharded vm-threads, each is called with arguments
+ *	(master (thread_ludata), shard_index (number), arguments ...).
+ *	Usually every shard runs own event_queue and listens the same
+ *	port with "reuseport" socket option or receives the accepted
+ *	sockets from master by thread.msg_send().
+ */
+static int
+thread_runvms (lua_State *L)
+{
+    const int count = luaL_checkinteger(L, 1);
+    const int nargs = lua_gettop(L);
+    int i;
+
+    luaL_argcheck(L, count > 0, 1, "positive number expected");
+    luaL_checkstack(L, count, NULL);
+
+    for (i = 1; i <= count; ++i) {
+	struct sys_vmthread *vmtd = thread_newvm(L, 2, nargs, i);
+
+	if (!vmtd) {
+	    const int top = lua_gettop(L);
+	    int j;
+
+	    /* stop the started shards */
+	    for (j = top - i + 2; j <= top; ++j) {
+		vmtd = lua_touserdata(L, j);
+		thread_setinterrupt(&vmtd->td);
+	    }
+	    return sys_seterror(L, 0);
+	}
+	lua_pushlightuserdata(L, vmtd);
+    }
+    return count;
+}
+
+/*
+ * Arguments: thread_ludata
+ */
+static int
+thread_interrupt (lua_State *L)
+{
+    thread_setinterrupt(lua_touserdata(L, 1));
     return 0;
 }
 
@@ -664,6 +788,7 @@ thread_get_trigger (lua_State *L, struct sys_vmthread **vmtdp)
 
 #include "thread_dpool.c"
 #include "thread_channel.c"
+#include "thread_ring.c"
 #include "thread_msg.c"
 
 
@@ -671,12 +796,14 @@ static luaL_reg thread_lib[] = {
     {"init",		thread_init},
     {"run",		thread_run},
     {"runvm",		thread_runvm},
+    {"runvms",		thread_runvms},
     {"interrupt",	thread_interrupt},
     {"yield",		thread_yield},
     {"sleep",		thread_sleep},
     {"self",		thread_self},
     {"data_pool",	thread_data_pool},
     {"channel",	        thread_channel},
+    {"ring",		thread_ring},
     {"msg_send",	thread_msg_send},
     {"msg_recv",	thread_msg_recv},
     {"msg_count",	thread_msg_count},
@@ -691,7 +818,8 @@ luaopen_sys_thread (lua_State *L)
     lua_pushvalue(L, -1);  /* push metatable */
     lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
     luaL_register(L, NULL, dpool_meth);
-    lua_pushcfunction(L, (lua_CFunction) dpool_get_trigger);
+    lua_pushcfunction(L,
+     (lua_CFunction) (void (*) (void)) dpool_get_trigger);
     lua_setfield(L, -2, SYS_TRIGGER_TAG);
     lua_pop(L, 1);
 
@@ -701,16 +829,31 @@ luaopen_sys_thread (lua_State *L)
     luaL_register(L, NULL, channel_meth);
     lua_pop(L, 1);
 
-    /* create table of threads */
+    luaL_newmetatable(L, THRING_TYPENAME);
+    lua_pushvalue(L, -1);  /* push metatable */
+    lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+    luaL_register(L, NULL, thring_meth);
+    lua_pushcfunction(L,
+     (lua_CFunction) (void (*) (void)) thring_get_trigger);
+    lua_setfield(L, -2, SYS_TRIGGER_TAG);
+    lua_pop(L, 1);
+
+    /* create table of threads, vm-thread has it before require"sys" */
     lua_pushlightuserdata(L, &g_TLSIndex);
-    lua_newtable(L);
-    lua_pushliteral(L, "__gc");  /* mutex destructor */
-    lua_pushcfunction(L, vmthread_del);
-    lua_rawset(L, -3);
-    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1)) {
+	lua_pushlightuserdata(L, &g_TLSIndex);
+	lua_newtable(L);
+	lua_pushliteral(L, "__gc");  /* mutex destructor */
+	lua_pushcfunction(L, vmthread_del);
+	lua_rawset(L, -3);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    lua_pop(L, 1);
 
     luaL_register(L, "sys.thread", thread_lib);
-    lua_pushcfunction(L, (lua_CFunction) thread_get_trigger);
+    lua_pushcfunction(L,
+     (lua_CFunction) (void (*) (void)) thread_get_trigger);
     lua_setfield(L, -2, SYS_TRIGGER_TAG);
     lua_pop(L, 1);
 }
@@ -4,14 +4,25 @@
 
 #define MSG_BUFF_INITIALSIZE	8 * MSG_MAXSIZE
 
+#define MSG_STRINLINE		128  /* longer strings are passed in heap */
+
+/* Message item types, in addition to lua types */
+#define MSG_TBIGSTRING		(LUA_TTHREAD + 1)  /* string in heap */
+#define MSG_TMEMBUF		(LUA_TTHREAD + 2)  /* moved memory buffer */
+
 struct message_item {
-    int type: 8;  /* lua type */
+    int type: 8;  /* lua or message type */
     int len: 16;  /* length of value in bytes */
     union {
 	lua_Number num;
 	char bool;
 	void *ptr;
 	char str[1];
+	struct {
+	    char *data;
+	    int len, offset;
+	    unsigned int flags;
+	} mem;
     } v;
 };
 
@@ -22,33 +33,161 @@ struct message {
 };
 
 
+#define msg_item_next(item) \
+    ((struct message_item *) ((char *) (item) \
+     + sizeof(struct message_item) - sizeof((item)->v) + (item)->len))
+
+/* Memory buffers to be moved by message */
+struct message_moved {
+    int n;
+    struct membuf *mb[MSG_MAXSIZE / sizeof(struct message_item)];
+    struct membuf saved[MSG_MAXSIZE / sizeof(struct message_item)];
+};
+
+/*
+ * Free the heap buffers of message items.
+ * The moved memory buffers are released by undelivered message only.
+ */
+static void
+thread_msg_free (struct message *msg, int moved)
+{
+    struct message_item *item = (struct message_item *) msg->items;
+    char *endp = (char *) msg + msg->size;
+
+    for (; (char *) item < endp; item = msg_item_next(item)) {
+	if (item->type == MSG_TBIGSTRING)
+	    free(item->v.mem.data);
+	else if (item->type == MSG_TMEMBUF) {
+	    const unsigned int flags = item->v.mem.flags;
+
+	    if (flags & SYSMEM_UDATA)  /* copy */
+		free(item->v.mem.data);
+	    else if (!moved) continue;
+	    else if (flags & SYSMEM_ALLOC)
+		free(item->v.mem.data);
+#ifdef SYSMEM_HAVE_MMAP
+	    else if (flags & SYSMEM_MAP) {
+#ifndef _WIN32
+		munmap(item->v.mem.data, item->v.mem.len);
+#else
+		UnmapViewOfFile(item->v.mem.data);
+#endif
+	    }
+#endif
+	}
+    }
+}
+
+/*
+ * Release undelivered messages of the vm-thread.
+ */
+static void
+thread_msg_clear (struct sys_vmthread *vmtd)
+{
+    const struct thread_msg_buf buf = vmtd->buffer;
+    int idx;
+
+    for (idx = buf.idx; idx < buf.top; ) {
+	struct message *msg = (struct message *) (buf.ptr + idx);
+
+	thread_msg_free(msg, 1);
+	idx += msg->size;
+    }
+}
+
+/*
+ * Move the memory buffer ownership to message or copy the userdata buffer.
+ * Returns: 0 | -1 (no memory) | 1 (already moved by the message)
+ */
+static int
+thread_msg_membuf (struct message_item *item, struct membuf *mb,
+                   struct message_moved *moved)
+{
+    unsigned int flags = mb->flags & SYSMEM_TYPE_MASK;
+    char *data = mb->data;
+
+    if (data && (mb->flags & SYSMEM_UDATA)) {
+	data = malloc(mb->len);
+	if (!data) return -1;
+	memcpy(data, mb->data, mb->len);
+	flags |= SYSMEM_ALLOC | SYSMEM_UDATA;  /* copy */
+    }
+    else if (data && (mb->flags & (SYSMEM_ALLOC | SYSMEM_MAP))) {
+	int i;
+
+	for (i = 0; i < moved->n; ++i) {
+	    if (moved->mb[i] == mb) return 1;
+	}
+	flags |= mb->flags & (SYSMEM_ALLOC | SYSMEM_MAP);
+	moved->mb[moved->n++] = mb;
+    }
+
+    item->v.mem.data = data;
+    item->v.mem.len = mb->len;
+    item->v.mem.offset = mb->offset;
+    item->v.mem.flags = flags;
+    return 0;
+}
+
 /*
  * Arguments: thread_ludata, message_items (any) ...
  */
 static void
-thread_msg_build (lua_State *L, struct message *msg)
+thread_msg_build (lua_State *L, struct message *msg,
+                  struct message_moved *moved)
 {
     char *cp = msg->items;
     char *endp = cp + MSG_MAXSIZE;
     int i, top = lua_gettop(L);
 
+    msg->size = cp - (char *) msg;
+    moved->n = 0;
+
     for (i = 2; i <= top; ++i) {
 	struct message_item *item = (struct message_item *) cp;
-	const int type = lua_type(L, i);
+	int type = lua_type(L, i);
 	const char *s = NULL;
+	struct membuf *mb = NULL;
 	size_t len = sizeof(item->v);
 
 	cp += sizeof(struct message_item) - sizeof(item->v);
-	if (type == LUA_TSTRING)
+	if (type == LUA_TSTRING) {
 	    s = lua_tolstring(L, i, &len);
+	    if (len > MSG_STRINLINE) {
+		type = MSG_TBIGSTRING;
+		len = sizeof(item->v.mem);
+	    }
+	}
+	else if (type == LUA_TUSERDATA && (mb = mem_tobuffer(L, i))) {
+	    type = MSG_TMEMBUF;
+	    len = sizeof(item->v.mem);
+	}
 
-	if (cp + len >= endp)
+	if (cp + len >= endp) {
+	    thread_msg_free(msg, 0);
 	    luaL_argerror(L, i, "message is too big");
+	}
 
 	switch (type) {
 	case LUA_TSTRING:
 	    memcpy(&item->v, s, len);
 	    break;
+	case MSG_TBIGSTRING:
+	    item->v.mem.len = lua_rawlen(L, i);
+	    item->v.mem.data = malloc(item->v.mem.len);
+	    if (!item->v.mem.data) goto err_mem;
+	    memcpy(item->v.mem.data, s, item->v.mem.len);
+	    break;
+	case MSG_TMEMBUF: {
+		const int res = thread_msg_membuf(item, mb, moved);
+
+		if (res == -1) goto err_mem;
+		if (res) {
+		    thread_msg_free(msg, 0);
+		    luaL_argerror(L, i, "memory buffer is repeated");
+		}
+	    }
+	    break;
 	case LUA_TNUMBER:
 	    item->v.num = lua_tonumber(L, i);
 	    len = sizeof(item->v.num);
@@ -66,13 +205,49 @@ thread_msg_build (lua_State *L, struct message *msg)
 	    len = sizeof(item->v.ptr);
 	    break;
 	default:
+	    thread_msg_free(msg, 0);
 	    luaL_argerror(L, i, "primitive type expected");
 	}
 	item->type = type;
 	item->len = len;
 	cp += len;
+	msg->size = cp - (char *) msg;
+    }
+    return;
+ err_mem:
+    thread_msg_free(msg, 0);
+    luaL_error(L, "not enough memory");
+}
+
+/*
+ * Detach the memory buffers, which are owned by the message now.
+ * Called inside the VM, before other threads can use the buffers.
+ */
+static void
+thread_msg_moved (struct message_moved *moved)
+{
+    int i;
+
+    for (i = 0; i < moved->n; ++i) {
+	struct membuf *mb = moved->mb[i];
+
+	moved->saved[i] = *mb;
+	mb->data = NULL;
+	mb->len = mb->offset = 0;
+	mb->flags &= SYSMEM_TYPE_MASK;
     }
-    msg->size = (sizeof(struct message) - MSG_MAXSIZE) + cp - msg->items;
+}
+
+/*
+ * Attach back the memory buffers of undelivered message.
+ */
+static void
+thread_msg_restore (struct message_moved *moved)
+{
+    int i;
+
+    for (i = 0; i < moved->n; ++i)
+	*moved->mb[i] = moved->saved[i];
 }
 
 /*
@@ -95,6 +270,22 @@ thread_msg_parse (lua_State *L, struct message *msg)
 	case LUA_TSTRING:
 	    lua_pushlstring(L, (char *) &item->v, len);
 	    break;
+	case MSG_TBIGSTRING:
+	    lua_pushlstring(L, item->v.mem.data, item->v.mem.len);
+	    free(item->v.mem.data);
+	    break;
+	case MSG_TMEMBUF: {
+		struct membuf *mb = lua_newuserdata(L, sizeof(struct membuf));
+
+		memset(mb, 0, sizeof(struct membuf));
+		mb->data = item->v.mem.data;
+		mb->len = item->v.mem.len;
+		mb->offset = item->v.mem.offset;
+		mb->flags = item->v.mem.flags & ~SYSMEM_UDATA;
+		luaL_getmetatable(L, MEM_TYPENAME);
+		lua_setmetatable(L, -2);
+	    }
+	    break;
 	case LUA_TNUMBER:
 	    lua_pushnumber(L, item->v.num);
 	    break;
@@ -107,7 +298,7 @@ thread_msg_parse (lua_State *L, struct message *msg)
 	default:
 	    lua_pushlightuserdata(L, item->v.ptr);
 	}
-	cp += sizeof(struct message_item) - sizeof(item->v) + len;
+	cp = (char *) msg_item_next(item);
     }
     return i;
 }
@@ -122,7 +313,9 @@ thread_msg_send (lua_State *L)
 {
     struct sys_vmthread *vmtd = lua_touserdata(L, 1);
     struct message msg;
+    struct message_moved moved;
     thread_critsect_t *csp;
+    int is_other;
 
     if (!vmtd) luaL_argerror(L, 1, "thread id. expected");
 
@@ -130,9 +323,11 @@ thread_msg_send (lua_State *L)
     if (!msg.src_td) luaL_argerror(L, 0, "Threading not initialized");
 
     /* construct the message */
-    thread_msg_build(L, &msg);
+    thread_msg_build(L, &msg, &moved);
+    thread_msg_moved(&moved);
 
     vmtd = vmtd->td.vmtd;
+    is_other = (vmtd != msg.src_td->vmtd);
 
 #ifndef _WIN32
     csp = &vmtd->bufev.cs;
@@ -140,6 +335,9 @@ thread_msg_send (lua_State *L)
     csp = &vmtd->bufcs;
 #endif
 
+    /* the receiver's event_queue locks its vm-thread to be notified */
+    if (is_other) sys_vm_leave();
+
     /* copy the message */
     thread_critsect_enter(csp);
     {
@@ -157,6 +355,9 @@ thread_msg_send (lua_State *L)
 
 		if (!p) {
 		    thread_critsect_leave(csp);
+		    thread_msg_free(&msg, 0);
+		    if (is_other) sys_vm_enter();
+		    thread_msg_restore(&moved);
 		    return 0;
 		}
 		buf.ptr = p;
@@ -177,6 +378,8 @@ thread_msg_send (lua_State *L)
     }
     thread_critsect_leave(csp);
 
+    if (is_other) sys_vm_enter();
+
     lua_settop(L, 1);
     return 1;
 }
@@ -204,11 +407,25 @@ thread_msg_recv (lua_State *L)
     csp = &vmtd->bufcs;
 #endif
 
-    for (; ; ) {
+    {
 	struct message msg;
 	int res = 0;
 
+	/* don't hold the vm-thread: sender locks it to notify event_queue */
+	sys_vm_leave();
 	thread_critsect_enter(csp);
+	while (!vmtd->buffer.nmsg) {
+	    /* wait signal */
+#ifndef _WIN32
+	    res = thread_cond_wait(&vmtd->bufev.cond, csp, timeout);
+#else
+	    thread_critsect_leave(csp);
+	    res = WaitForSingleObject(vmtd->bufev.h, timeout);
+	    res = (res == WAIT_OBJECT_0) ? 0 : (res == WAIT_TIMEOUT) ? 1 : -1;
+	    thread_critsect_enter(csp);
+#endif
+	    if (res) break;
+	}
 	if (vmtd->buffer.nmsg) {
 	    struct thread_msg_buf buf = vmtd->buffer;
 	    struct message *mp = (struct message *) (buf.ptr + buf.idx);
@@ -219,21 +436,18 @@ thread_msg_recv (lua_State *L)
 		buf.idx = buf.top = 0;
 	    buf.nmsg--;
 	    vmtd->buffer = buf;
-	    res = 1;
+	    res = 0;
 	}
 	thread_critsect_leave(csp);
+	sys_vm_enter();
 
-	if (res) return thread_msg_parse(L, &msg);
+	if (!res) return thread_msg_parse(L, &msg);
 
-	/* wait signal */
-	res = thread_event_wait(&vmtd->bufev, timeout);
-	if (res) {
-	    if (res == 1) {
-		lua_pushboolean(L, 0);
-		return 1;  /* timed out */
-	    }
-	    return sys_seterror(L, 0);
+	if (res == 1) {
+	    lua_pushboolean(L, 0);
+	    return 1;  /* timed out */
 	}
+	return sys_seterror(L, 0);
     }
 }
 
@@ -258,9 +472,11 @@ thread_msg_count (lua_State *L)
     csp = &vmtd->bufcs;
 #endif
 
+    sys_vm_leave();
     thread_critsect_enter(csp);
     nmsg = vmtd->buffer.nmsg;
     thread_critsect_leave(csp);
+    sys_vm_enter();
 
     lua_pushinteger(L, nmsg);
     return 1;
@@ -0,0 +1,595 @@
+/* Lua Threading: Lock-free Ring Buffer */
+
+#define THRING_TYPENAME	"sys.thread.ring"
+
+#define THRING_CAPACITY	1024  /* default number of slots */
+#define THRING_SLOTSIZE	56  /* default size of slot's data */
+#define THRING_SLOTMAX	1024  /* maximum size of slot's data */
+
+#define THRING_SPINS	128  /* number of tries before waiting */
+
+#define THRING_CACHELINE	64
+
+#include <limits.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(_WIN32) && !defined(__GNUC__)
+#define thring_peek(p)		(*(p))
+#define thring_load(p)		InterlockedCompareExchange((LONG volatile *) (p), 0, 0)
+#define thring_store(p, v)	InterlockedExchange((LONG volatile *) (p), (v))
+#define thring_cas(p, o, n)						\
+    (InterlockedCompareExchange((LONG volatile *) (p), (n), (o)) == (LONG) (o))
+#define thring_add(p, v)		InterlockedExchangeAdd((LONG volatile *) (p), (v))
+#define thring_xchg(p, v)		InterlockedExchange((LONG volatile *) (p), (v))
+#define thring_fence()		MemoryBarrier()
+#define thring_relax()		YieldProcessor()
+#else
+#define thring_peek(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#define thring_load(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define thring_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define thring_cas(p, o, n)						\
+    __atomic_compare_exchange_n((p), &(o), (n), 0,			\
+     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define thring_add(p, v)		__atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define thring_xchg(p, v)		__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define thring_fence()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#if defined(__i386__) || defined(__x86_64__)
+#define thring_relax()		__asm__ __volatile__ ("pause")
+#else
+#define thring_relax()		((void) 0)
+#endif
+#endif
+
+/* Wait for sequence change: futex or event */
+struct thring_event {
+    unsigned int volatile seq;
+    int volatile waiting;  /* are threads blocked? */
+#ifndef __linux__
+    thread_event_t tev;
+#endif
+};
+
+/* Slot of data */
+struct thring_slot {
+    unsigned int volatile seq;  /* position of slot's turn */
+    unsigned int len;  /* size of data */
+    char data[1];
+};
+
+#define THRING_SLOT(r, pos) \
+    ((struct thring_slot *) ((r)->slots + ((pos) & (r)->mask) * (r)->stride))
+
+struct thring {
+    unsigned int volatile head;  /* position to get */
+    char pad_head[THRING_CACHELINE - sizeof(unsigned int)];
+    unsigned int volatile tail;  /* position to put */
+    char pad_tail[THRING_CACHELINE - sizeof(unsigned int)];
+
+    struct thring_event ev_put;  /* readers wait for new data */
+    struct thring_event ev_get;  /* writers wait for free slots */
+
+    unsigned int mask;  /* capacity - 1 */
+    unsigned int slot_size, stride;
+
+    int volatile nrefs;  /* number of userdata to share between VMs */
+
+    sys_trigger_t trigger;  /* notify event_queue */
+
+    char *slots;
+};
+
+
+static int
+thring_event_new (struct thring_event *rev)
+{
+    rev->seq = 0;
+    rev->waiting = 0;
+#ifndef __linux__
+    return thread_event_new(&rev->tev);
+#else
+    return 0;
+#endif
+}
+
+static void
+thring_event_del (struct thring_event *rev)
+{
+#ifndef __linux__
+    thread_event_del(&rev->tev);
+#else
+    (void) rev;
+#endif
+}
+
+/*
+ * Returns: 0 (signalled), 1 (timedout), -1 (error)
+ */
+static int
+thring_event_wait (struct thring_event *rev, unsigned int seq, msec_t timeout)
+{
+#if defined(__linux__)
+    struct timespec ts, *tsp = NULL;
+
+    if (timeout != TIMEOUT_INFINITE) {
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+	tsp = &ts;
+    }
+    if (!syscall(SYS_futex, &rev->seq, FUTEX_WAIT_PRIVATE, seq, tsp, NULL, 0))
+	return 0;
+    return (SYS_ERRNO == ETIMEDOUT) ? 1
+     : (SYS_ERRNO == EAGAIN || SYS_ERRNO == EINTR) ? 0 : -1;
+#elif !defined(_WIN32)
+    int res = 0;
+
+    pthread_mutex_lock(&rev->tev.cs);
+    if (rev->seq == seq)
+	res = thread_cond_wait(&rev->tev.cond, &rev->tev.cs, timeout);
+    pthread_mutex_unlock(&rev->tev.cs);
+    return res;
+#else
+    const DWORD res = (rev->seq == seq)
+     ? WaitForSingleObject(rev->tev.h, timeout) : WAIT_OBJECT_0;
+
+    /* auto-reset event: wake up the next waiter */
+    if (res == WAIT_OBJECT_0 && rev->seq != seq)
+	SetEvent(rev->tev.h);
+
+    return (res == WAIT_OBJECT_0) ? 0
+     : (res == WAIT_TIMEOUT) ? 1 : -1;
+#endif
+}
+
+/*
+ * Only the first writer after waiting is charged with the wake up.
+ */
+static void
+thring_event_wake (struct thring_event *rev)
+{
+    thring_fence();
+    if (!thring_peek(&rev->waiting) || !thring_xchg(&rev->waiting, 0))
+	return;
+
+    thring_add(&rev->seq, 1);
+#if defined(__linux__)
+    syscall(SYS_futex, &rev->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#elif !defined(_WIN32)
+    pthread_mutex_lock(&rev->tev.cs);
+    pthread_cond_broadcast(&rev->tev.cond);
+    pthread_mutex_unlock(&rev->tev.cs);
+#else
+    SetEvent(rev->tev.h);  /* stays signalled until the wait */
+#endif
+}
+
+
+/*
+ * Returns: claimed slot | NULL (full)
+ */
+static struct thring_slot *
+thring_claim_put (struct thring *r, unsigned int *posp)
+{
+    unsigned int pos = thring_peek(&r->tail);
+
+    for (; ; ) {
+	struct thring_slot *slot = THRING_SLOT(r, pos);
+	const int dif = (int) (thring_load(&slot->seq) - pos);
+
+	if (dif == 0) {
+	    if (thring_cas(&r->tail, pos, pos + 1)) {
+		*posp = pos;
+		return slot;
+	    }
+	} else if (dif < 0)
+	    return NULL;
+	else
+	    pos = thring_peek(&r->tail);
+    }
+}
+
+/*
+ * Returns: claimed slot | NULL (empty)
+ */
+static struct thring_slot *
+thring_claim_get (struct thring *r, unsigned int *posp)
+{
+    unsigned int pos = thring_peek(&r->head);
+
+    for (; ; ) {
+	struct thring_slot *slot = THRING_SLOT(r, pos);
+	const int dif = (int) (thring_load(&slot->seq) - (pos + 1));
+
+	if (dif == 0) {
+	    if (thring_cas(&r->head, pos, pos + 1)) {
+		*posp = pos;
+		return slot;
+	    }
+	} else if (dif < 0)
+	    return NULL;
+	else
+	    pos = thring_peek(&r->head);
+    }
+}
+
+static void
+thring_write (struct thring *r, struct thring_slot *slot, unsigned int pos,
+              const char *buf, unsigned int len)
+{
+    memcpy(slot->data, buf, len);
+    slot->len = len;
+    thring_store(&slot->seq, pos + 1);
+
+    thring_event_wake(&r->ev_put);
+}
+
+static unsigned int
+thring_read (struct thring *r, struct thring_slot *slot, unsigned int pos,
+             char *buf)
+{
+    const unsigned int len = slot->len;
+
+    memcpy(buf, slot->data, len);
+    thring_store(&slot->seq, pos + r->mask + 1);
+
+    thring_event_wake(&r->ev_get);
+    return len;
+}
+
+/*
+ * Spin, then wait on the event with VM released.
+ * The data is transferred before VM entering, which can be interrupted.
+ * Returns: 0 (transferred), 1 (timedout), -1 (error)
+ */
+static int
+thring_wait (struct thring *r, char *buf, unsigned int *lenp, msec_t timeout,
+             int is_put, unsigned int *posp)
+{
+    struct thring_event *rev = is_put ? &r->ev_get : &r->ev_put;
+    struct thring_slot *slot = NULL;
+    int res = 0;
+    int i;
+
+    sys_vm_leave();
+    for (i = 0; i < THRING_SPINS; ++i) {
+	thring_relax();
+	slot = is_put ? thring_claim_put(r, posp) : thring_claim_get(r, posp);
+	if (slot) break;
+    }
+    while (!slot) {
+	const unsigned int seq = thring_load(&rev->seq);
+
+	thring_xchg(&rev->waiting, 1);
+	slot = is_put ? thring_claim_put(r, posp) : thring_claim_get(r, posp);
+	if (!slot)
+	    res = thring_event_wait(rev, seq, timeout);
+
+	if (res) break;
+	if (!slot)
+	    slot = is_put ? thring_claim_put(r, posp) : thring_claim_get(r, posp);
+    }
+    if (slot) {
+	if (is_put)
+	    thring_write(r, slot, *posp, buf, *lenp);
+	else
+	    *lenp = thring_read(r, slot, *posp, buf);
+    }
+    sys_vm_enter();
+    return res;
+}
+
+
+static struct thring *
+checkring (lua_State *L, int idx)
+{
+    struct thring **rp = checkudata(L, idx, THRING_TYPENAME);
+
+    if (!*rp) luaL_argerror(L, idx, "closed ring");
+    return *rp;
+}
+
+/*
+ * Arguments: [capacity (number) | ring_ludata (lightuserdata)],
+ *	[slot_size (number)]
+ * Returns: [ring_udata]
+ *
+ * Note: ring_ludata is got from ring:share() of another VM,
+ *	its reference is adopted.
+ */
+static int
+thread_ring (lua_State *L)
+{
+    struct thring **rp;
+    struct thring *r;
+
+    lua_settop(L, 2);
+    rp = lua_newuserdata(L, sizeof(struct thring *));
+    *rp = NULL;
+    luaL_getmetatable(L, THRING_TYPENAME);
+    lua_setmetatable(L, -2);
+
+    if (lua_islightuserdata(L, 1)) {
+	/* share the ring of another VM */
+	r = lua_touserdata(L, 1);
+    } else {
+	const unsigned int capacity = (unsigned int) luaL_optinteger(L, 1,
+	 THRING_CAPACITY);
+	const unsigned int slot_size = (unsigned int) luaL_optinteger(L, 2,
+	 THRING_SLOTSIZE);
+	unsigned int n, stride;
+
+	luaL_argcheck(L, capacity > 1 && capacity <= (1U << 24), 1,
+	 "invalid capacity");
+	luaL_argcheck(L, slot_size > 0 && slot_size <= THRING_SLOTMAX, 2,
+	 "invalid slot size");
+
+	for (n = 2; n < capacity; n <<= 1)
+	    continue;
+	stride = (offsetof(struct thring_slot, data) + slot_size + 7) & ~7;
+
+	r = malloc(sizeof(struct thring) + n * stride + THRING_CACHELINE);
+	if (!r) goto err;
+	memset(r, 0, sizeof(struct thring));
+
+	if (thring_event_new(&r->ev_put)) {
+	    free(r);
+	    goto err;
+	}
+	if (thring_event_new(&r->ev_get)) {
+	    thring_event_del(&r->ev_put);
+	    free(r);
+	    goto err;
+	}
+
+	r->mask = n - 1;
+	r->slot_size = slot_size;
+	r->stride = stride;
+	r->nrefs = 1;
+	r->slots = (char *) (((size_t) (r + 1) + THRING_CACHELINE - 1)
+	 & ~(size_t) (THRING_CACHELINE - 1));
+
+	for (n = 0; n <= r->mask; ++n)
+	    THRING_SLOT(r, n)->seq = n;
+    }
+    *rp = r;
+    return 1;
+ err:
+    return sys_seterror(L, 0);
+}
+
+/*
+ * Arguments: ring_udata
+ */
+static int
+thring_done (lua_State *L)
+{
+    struct thring **rp = checkudata(L, 1, THRING_TYPENAME);
+    struct thring *r = *rp;
+
+    if (r && thring_add(&r->nrefs, -1) == 1) {
+	thring_event_del(&r->ev_put);
+	thring_event_del(&r->ev_get);
+	free(r);
+    }
+    *rp = NULL;
+    return 0;
+}
+
+/*
+ * Arguments: ring_udata
+ * Returns: ring_ludata (lightuserdata)
+ *
+ * Note: The returned reference must be passed to thread.ring() once.
+ */
+static int
+thring_share (lua_State *L)
+{
+    struct thring *r = checkring(L, 1);
+
+    thring_add(&r->nrefs, 1);
+    lua_pushlightuserdata(L, r);
+    return 1;
+}
+
+/*
+ * Arguments: ring_udata, data_items (nil | boolean | number | string |
+ *	lightuserdata | userdata) ...
+ */
+static int
+thring_put (lua_State *L)
+{
+    struct thring *r = checkring(L, 1);
+    const int nput = lua_gettop(L) - 1;
+    char buf[THRING_SLOTMAX];
+    struct thring_slot *slot;
+    unsigned int pos, len;
+    int i;
+
+    if (!nput) luaL_argerror(L, 2, "data expected");
+    if (nput > UCHAR_MAX) luaL_argerror(L, 2, "too many items");
+
+    /* serialize the items */
+    buf[0] = (char) nput;
+    len = 1;
+    for (i = 2; i <= nput + 1; ++i) {
+	const int type = lua_type(L, i);
+	unsigned int n = 1;
+
+	switch (type) {
+	case LUA_TNIL: break;
+	case LUA_TBOOLEAN: n += 1; break;
+	case LUA_TNUMBER: n += sizeof(lua_Number); break;
+	case LUA_TLIGHTUSERDATA:
+	case LUA_TUSERDATA: n += sizeof(void *); break;
+	case LUA_TSTRING: n += sizeof(unsigned short) + lua_rawlen(L, i); break;
+	default:
+	    luaL_argerror(L, i, "primitive type expected");
+	}
+	if (len + n > r->slot_size)
+	    luaL_argerror(L, i, "data too large for slot");
+
+	buf[len++] = (char) type;
+	switch (type) {
+	case LUA_TBOOLEAN:
+	    buf[len] = (char) lua_toboolean(L, i);
+	    break;
+	case LUA_TNUMBER: {
+		const lua_Number num = lua_tonumber(L, i);
+		memcpy(buf + len, &num, sizeof(lua_Number));
+	    }
+	    break;
+	case LUA_TLIGHTUSERDATA:
+	case LUA_TUSERDATA: {
+		void *p = lua_touserdata(L, i);
+		memcpy(buf + len, &p, sizeof(void *));
+	    }
+	    break;
+	case LUA_TSTRING: {
+		size_t sl;
+		const char *s = lua_tolstring(L, i, &sl);
+		const unsigned short slen = (unsigned short) sl;
+
+		memcpy(buf + len, &slen, sizeof(unsigned short));
+		memcpy(buf + len + sizeof(unsigned short), s, sl);
+	    }
+	    break;
+	}
+	len += n - 1;
+    }
+
+    slot = thring_claim_put(r, &pos);
+    if (slot)
+	thring_write(r, slot, pos, buf, len);
+    else if (thring_wait(r, buf, &len, TIMEOUT_INFINITE, 1, &pos))
+	return sys_seterror(L, 0);
+
+    /* notify event_queue, when the ring was empty */
+    if (r->trigger && thring_load(&r->head) == pos)
+	sys_trigger_notify(&r->trigger, SYS_EVREAD);
+    return 0;
+}
+
+/*
+ * Arguments: ring_udata, [timeout (milliseconds)]
+ * Returns: data_items ... | false (timedout)
+ */
+static int
+thring_get (lua_State *L)
+{
+    struct thring *r = checkring(L, 1);
+    const msec_t timeout = lua_isnoneornil(L, 2)
+     ? TIMEOUT_INFINITE : (msec_t) lua_tointeger(L, 2);
+    char buf[THRING_SLOTMAX];
+    struct thring_slot *slot;
+    unsigned int pos, len;
+    int nput, i;
+
+    slot = thring_claim_get(r, &pos);
+    if (slot)
+	len = thring_read(r, slot, pos, buf);
+    else {
+	const int res = (timeout == 0) ? 1
+	 : thring_wait(r, buf, &len, timeout, 0, &pos);
+
+	if (res) {
+	    if (res == 1) {
+		lua_pushboolean(L, 0);
+		return 1;  /* timed out */
+	    }
+	    return sys_seterror(L, 0);
+	}
+    }
+
+    /* deserialize the items */
+    nput = (unsigned char) buf[0];
+    luaL_checkstack(L, nput, NULL);
+
+    for (i = 0, len = 1; i < nput; ++i) {
+	switch (buf[len++]) {
+	case LUA_TNIL:
+	    lua_pushnil(L);
+	    break;
+	case LUA_TBOOLEAN:
+	    lua_pushboolean(L, buf[len++]);
+	    break;
+	case LUA_TNUMBER: {
+		lua_Number num;
+
+		memcpy(&num, buf + len, sizeof(lua_Number));
+		lua_pushnumber(L, num);
+		len += sizeof(lua_Number);
+	    }
+	    break;
+	case LUA_TLIGHTUSERDATA:
+	case LUA_TUSERDATA: {
+		void *p;
+
+		memcpy(&p, buf + len, sizeof(void *));
+		lua_pushlightuserdata(L, p);
+		len += sizeof(void *);
+	    }
+	    break;
+	case LUA_TSTRING: {
+		unsigned short slen;
+
+		memcpy(&slen, buf + len, sizeof(unsigned short));
+		len += sizeof(unsigned short);
+		lua_pushlstring(L, buf + len, slen);
+		len += slen;
+	    }
+	    break;
+	}
+    }
+    return nput;
+}
+
+/*
+ * Arguments: ring_udata
+ * Returns: number
+ */
+static int
+thring_count (lua_State *L)
+{
+    struct thring *r = checkring(L, 1);
+
+    lua_pushinteger(L, (int) (thring_peek(&r->tail) - thring_peek(&r->head)));
+    return 1;
+}
+
+/*
+ * Arguments: ring_udata
+ * Returns: string
+ */
+static int
+thring_tostring (lua_State *L)
+{
+    struct thring **rp = checkudata(L, 1, THRING_TYPENAME);
+    lua_pushfstring(L, THRING_TYPENAME " (%p)", *rp);
+    return 1;
+}
+
+/*
+ * Arguments: ..., ring_udata
+ */
+static sys_trigger_t *
+thring_get_trigger (lua_State *L, struct sys_thread **tdp)
+{
+    struct thring *r = checkring(L, -1);
+
+    *tdp = NULL;
+    return &r->trigger;
+}
+
+
+static luaL_reg thring_meth[] = {
+    {"put",		thring_put},
+    {"get",		thring_get},
+    {"share",		thring_share},
+    {"__len",		thring_count},
+    {"__tostring",	thring_tostring},
+    {"__gc",		thring_done},
+    {NULL, NULL}
+};
@@ -1,6 +1,8 @@
 #!/usr/bin/env lua
 
 -- libevent/test/bench.c
+-- Run with "timers [distinct_timeouts]" to measure the timeouts backend.
+-- Run with "dispatch [num_sockets]" to measure the callbacks conventions.
 
 
 local sys = require"sys"
@@ -74,7 +76,7 @@ local function run_once(evq)
     return res
 end
 
-local function main(npipes, nactives, nwrites)
+local function main(npipes, nactives, nwrites, nbatches)
     num_pipes = tonumber(npipes) or 100
     num_active = tonumber(nactives) or 1
     num_writes = tonumber(nwrites) or 100
@@ -98,9 +100,113 @@ local function main(npipes, nactives, nwrites)
 
     local evq = assert(sys.event_queue())
 
+    if evq.batches then
+	evq:batches(tonumber(nbatches) or 1)
+    end
+
     for i = 1, 25 do
 	print(run_once(evq))
     end
+
+    if evq.stats then
+	print("max_events, saturated, waits:", evq:stats())
+    end
+end
+
+
+-- Timers: add, reset and delete with many distinct timeouts
+
+local function timer_cb() end
+
+local function run_timers(evq, ntimers, nvalues)
+    local timers = {}
+    local res = {}
+
+    period:start()
+    for i = 1, ntimers do
+	timers[i] = evq:add_timer(timer_cb, 60000 + (i % nvalues) * 10)
+    end
+    res[#res + 1] = period:get()
+
+    period:start()
+    for i = 1, ntimers do
+	evq:timeout(timers[i], 60000 + ((i * 7) % nvalues) * 10)
+    end
+    res[#res + 1] = period:get()
+
+    period:start()
+    for i = 1, 1000 do
+	evq:loop(0, true)
+    end
+    res[#res + 1] = period:get()
+
+    period:start()
+    for i = 1, ntimers do
+	evq:del(timers[i])
+    end
+    res[#res + 1] = period:get()
+
+    return res
+end
+
+local function main_timers(nvalues)
+    nvalues = tonumber(nvalues) or 1000
+
+    local evq = assert(sys.event_queue())
+
+    print("timers", "add", "reset", "1000 polls", "del", "(usec, "
+	.. nvalues .. " distinct timeouts)")
+    for _, ntimers in ipairs{10000, 100000, 1000000} do
+	print(ntimers, unpack(run_timers(evq, ntimers, nvalues)))
+    end
+end
+
+-- Dispatch: callbacks of always ready sockets
+
+local ncalls
+
+local function dispatch_cb()
+    ncalls = ncalls + 1
+end
+
+local function run_dispatch(mode, nsockets)
+    local evq = assert(sys.event_queue(mode))
+
+    for i = 1, nsockets do
+	local fdi = pipes[i][1]
+	assert(evq:add_socket(fdi, "r", dispatch_cb))
+    end
+
+    ncalls = 0
+    period:start()
+    repeat
+	evq:loop(0, true)
+    until ncalls >= 1000000
+    return ncalls / period:get() * 1000000
 end
 
-main(...)
+local function main_dispatch(nsockets)
+    nsockets = tonumber(nsockets) or 1000
+
+    assert(sys.limit_nfiles(nsockets * 2 + 50))
+
+    for i = 1, nsockets do
+	local fdi, fdo = sock.handle(), sock.handle()
+	assert(fdi:socket(fdo))
+	assert(fdo:write("e"))
+	pipes[i] = {fdi, fdo}
+    end
+
+    print("mode", "events/s (" .. nsockets .. " sockets)")
+    for _, mode in ipairs{"default", "compact", "default", "compact"} do
+	print(mode, math.floor(run_dispatch(mode, nsockets)))
+    end
+end
+
+if ... == "timers" then
+    main_timers(select(2, ...))
+elseif ... == "dispatch" then
+    main_dispatch(select(2, ...))
+else
+    main(...)
+end
@@ -0,0 +1,111 @@
+#!/usr/bin/env lua
+
+-- Splice relay: client1 <-> (in1 | relay | in2) <-> client2,
+-- both directions are pumped without calling Lua.
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local function pair()
+    local a, b = sock.handle(), sock.handle()
+    assert(a:socket("stream", "unix", b))
+    return a, b
+end
+
+local evq = assert(sys.event_queue())
+
+if not evq.add_relay then
+    print"Skipped: no splice relay"
+    return
+end
+
+local N = 40000
+local data1 = string.rep("0123456789", N / 10)
+local data2 = string.rep("abcdefghij", N / 10)
+
+-- both directions to the end
+do
+    local c1, in1 = pair()
+    local in2, c2 = pair()
+    local reason
+
+    assert(c1:write(data1)); assert(c1:shutdown())
+    assert(c2:write(data2)); assert(c2:shutdown())
+
+    local relay = assert(evq:add_relay(in1, in2, function(q, r, why, msg)
+	assert(q == evq)
+	reason = why
+    end))
+
+    assert(evq:loop(5000))
+    assert(reason == "eof", reason)
+
+    local ab, ba = relay:stats()
+    assert(ab == N and ba == N)
+    assert(c2:read() == data1)
+    assert(c1:read() == data2)
+
+    c1:close(); c2:close(); in1:close(); in2:close()
+end
+
+-- budget: stop after the limit, then resume
+do
+    local c1, in1 = pair()
+    local in2, c2 = pair()
+    local budgets, reason = 0
+
+    assert(c1:write(data1)); assert(c1:shutdown())
+    assert(c2:shutdown())
+
+    evq:add_relay(in1, in2, function(q, r, why)
+	reason = why
+	if why == "budget" then
+	    budgets = budgets + 1
+	    local ab, ba = r:stats()
+	    assert(ab == 1000 and ba == 0)
+	    r:budget(-1)
+	end
+    end, 1000)
+
+    assert(evq:loop(5000))
+    assert(budgets == 1 and reason == "eof")
+    assert(c2:read() == data1)
+
+    c1:close(); c2:close(); in1:close(); in2:close()
+end
+
+-- error: the peer is gone
+do
+    local c1, in1 = pair()
+    local in2, c2 = pair()
+    local reason, msg
+
+    c2:close()
+    assert(c1:write(data1))
+
+    evq:add_relay(in1, in2, function(q, r, why, m)
+	reason, msg = why, m
+    end)
+
+    assert(evq:loop(5000))
+    assert(reason == "error" and msg)
+
+    c1:close(); in1:close(); in2:close()
+end
+
+-- cancel
+do
+    local c1, in1 = pair()
+    local in2, c2 = pair()
+
+    local relay = evq:add_relay(in1, in2, function() error"called" end)
+    assert(#evq == 2)
+    assert(evq:del(relay))
+    assert(#evq == 0)
+    assert(evq:loop(100))
+
+    c1:close(); c2:close(); in1:close(); in2:close()
+end
+
+print"OK"
@@ -0,0 +1,79 @@
+#!/usr/bin/env lua
+
+-- Event loop stall while checkpointing a big table to file:
+-- blocking table.marshal() vs. steps of incremental table.encoder().
+-- Usage: snapshot.lua [table_size (MB)] [step_budget (bytes)] [filename]
+
+local sys = require"sys"
+require"marshal"
+
+
+local size = (tonumber(arg[1]) or 1024) * 1048576
+local budget = tonumber(arg[2]) or 65536
+local filename = arg[3] or "/dev/null"
+
+local period = sys.period()
+
+
+-- Table of about size bytes marshaled
+local state = {}
+do
+    local item = 1024
+    local payload = string.rep("x", item - 32)
+    for i = 1, size / item do
+	state[i] = {id = i, data = payload .. i}
+    end
+end
+print("table: " .. size / 1048576 .. " MB, "
+    .. math.floor(collectgarbage"count" / 1024) .. " MB in memory")
+
+local function open()
+    local fd = sys.handle()
+    assert(fd:open(filename, "w", 0x1A4, "creat", "trunc"))
+    return fd
+end
+
+-- Blocking
+do
+    local fd = open()
+    period:start()
+    local n = table.marshal(state, fd)
+    print("blocking: " .. n .. " bytes, stall "
+	.. math.floor(period:get() / 1000) .. " ms")
+    fd:close()
+end
+collectgarbage()
+
+-- Incremental, one step per loop iteration
+do
+    local evq = assert(sys.event_queue())
+    local fd = open()
+    local enc = table.encoder(state, fd)
+    local max_stall, last, ticks, steps = 0, nil, 0, 0
+
+    -- latency-sensitive work: 1 msec ticks
+    local clock = sys.period()
+    clock:start()
+    evq:add_timer(function()
+	local now = clock:get()
+	if last then
+	    max_stall = math.max(max_stall, now - last)
+	end
+	last = now
+	ticks = ticks + 1
+    end, 1)
+
+    evq:add_timer(function(evq)
+	steps = steps + 1
+	local n = enc:step(budget)
+	if n then
+	    print("incremental: " .. n .. " bytes, " .. steps .. " steps, "
+		.. ticks .. " ticks in " .. math.floor(clock:get() / 1000)
+		.. " ms, max stall " .. math.floor(max_stall / 1000) .. " ms")
+	    evq:stop()
+	end
+    end, 0)
+
+    evq:loop()
+    fd:close()
+end
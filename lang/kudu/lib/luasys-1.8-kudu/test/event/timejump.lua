@@ -0,0 +1,41 @@
+#!/usr/bin/env lua
+
+-- Timer must fire soon after the loop was stalled for nearly
+-- a full turn of the timing wheel's second level (32 * 32 msec).
+
+
+local sys = require"sys"
+
+
+local function wait_until(t)
+    while sys.msec() < t do end
+end
+
+-- start near the end of the lowest level slot, so the timer is kept
+-- at the second level and the stall ends at the same slot of it
+do
+    local t = sys.msec()
+    wait_until(t - t % 1024 + 1024 + 18)
+end
+
+local evq = assert(sys.event_queue())
+local start = sys.msec()
+local fired
+
+evq:add_timer(function(evq, evid)
+    evq:del(evid)
+    fired = sys.msec()
+end, 700)
+
+evq:add_timer(function(evq, evid)
+    evq:del(evid)
+    wait_until(start + 1008)  -- stall
+    evq:now(true)
+end, 0)
+
+evq:loop()
+
+assert(fired, "timer lost")
+assert(fired - start < 1100, "timer is late: " .. (fired - start))
+
+print"OK"
@@ -37,7 +37,7 @@ end
 local request_meta = {}
 do
     -- Request keys: CGI variables (in upper case),
-    --   "keep_conn", "stdin" (data),
+    --   "keep_conn", "stdin" (data or membuf), "on_stdin" (callback),
     --   "id" (request_id), "channel" (reference),
     --   "error" (message), "next_ready" (request_id),
     --   "state" (state of request processing: "headers", "out"),
@@ -240,8 +240,8 @@ do
 	    while request_id do
 		local req = chan[request_id]
 
+		chan[request_id] = nil
 		if req.error then
-		    chan[request_id] = nil
 		    log("req.error", req.error)
 		else
 		    status = process_request(req)
@@ -0,0 +1,215 @@
+#!/usr/bin/env lua
+
+-- FastCGI decoder: multiplexed requests, streamed stdin with backpressure;
+-- encoder: records listed for gathered write.
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+local mem = sys.mem
+local thread = sys.thread
+local fcgi_decode, fcgi_encode = sys.fcgi_decode, sys.fcgi_encode
+
+
+local BEGIN, ABORT, END, PARAMS, STDIN, STDOUT = 1, 2, 3, 4, 5, 6
+
+local function record(type, id, content)
+    content = content or ""
+    local len = #content
+    return string.char(1, type, math.floor(id / 256), id % 256,
+	math.floor(len / 256), len % 256, 0, 0) .. content
+end
+
+local function begin(id, keep_conn)
+    return record(BEGIN, id, "\0\1" .. (keep_conn and "\1" or "\0")
+	.. "\0\0\0\0\0")
+end
+
+local function params(id, t)
+    local s = ""
+    for k, v in pairs(t) do
+	s = s .. string.char(#k, #v) .. k .. v
+    end
+    return (s ~= "" and record(PARAMS, id, s) or "") .. record(PARAMS, id)
+end
+
+local function new_channel()
+    return {request_meta = {}}
+end
+
+-- collect the ready chain
+local function ready(chan, id)
+    local ids = {}
+    while id do
+	ids[#ids + 1] = id
+	id = chan[id].next_ready
+    end
+    table.sort(ids)
+    return table.concat(ids, ",")
+end
+
+
+-- stdin is joined at the end
+do
+    local chan = new_channel()
+    local input = begin(1, true) .. params(1, {SCRIPT = "/a.lua"})
+    for i = 1, 100 do
+	input = input .. record(STDIN, 1, string.rep(string.char(64 + i % 26), 100))
+    end
+    input = input .. record(STDIN, 1)
+
+    local buf = assert(mem.pointer():alloc())
+    buf:write(input:sub(1, 1000))
+    assert(fcgi_decode(buf, chan) == nil)
+    buf:write(input:sub(1001))
+    assert(fcgi_decode(buf, chan) == 1 and buf:seek() == 0)
+
+    local req = chan[1]
+    assert(req.keep_conn and req.SCRIPT == "/a.lua")
+    assert(#req.stdin == 100 * 100 and req.stdin_parts == nil)
+    assert(req.stdin:sub(101, 200) == string.rep("B", 100))
+end
+
+-- multiplexed requests, the id is reused
+do
+    local chan = new_channel()
+    local input = begin(1, true) .. begin(2, true)
+	.. params(2, {N = "2"}) .. params(1, {N = "1"})
+	.. record(STDIN, 1, "one") .. record(STDIN, 2, "two")
+	.. record(STDIN, 2) .. record(STDIN, 1)
+
+    local id = fcgi_decode(input, chan)
+    assert(ready(chan, id) == "1,2")
+    assert(chan[1].stdin == "one" and chan[2].stdin == "two")
+
+    -- records of the completed request are ignored
+    assert(fcgi_decode(record(STDIN, 1, "late"), chan) == nil)
+
+    local old = chan[1]
+    id = fcgi_decode(begin(1, false) .. params(1, {M = "x"})
+	.. record(STDIN, 1), chan)
+    assert(id == 1 and chan[1] ~= old)
+    assert(chan[1].N == nil and chan[1].M == "x" and not chan[1].keep_conn)
+
+    -- abort
+    id = fcgi_decode(begin(3) .. params(3, {}) .. record(ABORT, 3), chan)
+    assert(id == 3 and chan[3].error == "aborted")
+end
+
+-- stream to callback with pause
+do
+    local chan = new_channel()
+    local started, chunks, eof = 0, {}, false
+
+    chan.on_request = function(req)
+	started = started + 1
+	req.on_stdin = function(req, s)
+	    if not s then eof = true; return end
+	    chunks[#chunks + 1] = s
+	    return #chunks % 2 ~= 0  -- pause after each second chunk
+	end
+    end
+
+    local buf = assert(mem.pointer():alloc())
+    buf:write(begin(1) .. params(1, {}))
+    for i = 1, 5 do buf:write(record(STDIN, 1, "c" .. i)) end
+    buf:write(record(STDIN, 1))
+
+    local id, paused = fcgi_decode(buf, chan)
+    assert(id == nil and paused == true)
+    assert(started == 1 and #chunks == 2)
+
+    id, paused = fcgi_decode(buf, chan)
+    assert(id == nil and paused and #chunks == 4)
+
+    id, paused = fcgi_decode(buf, chan)
+    assert(id == 1 and not paused and eof)
+    assert(table.concat(chunks) == "c1c2c3c4c5" and buf:seek() == 0)
+    assert(chan[1].stdin == nil)
+end
+
+-- append to buffer, the full buffer pauses
+do
+    local chan = new_channel()
+    chan.on_request = function(req)
+	req.stdin = mem.pointer(10)  -- fixed size
+    end
+
+    local buf = assert(mem.pointer():alloc())
+    buf:write(begin(1) .. params(1, {}) .. record(STDIN, 1, "12345678")
+	.. record(STDIN, 1, "abcdefgh") .. record(STDIN, 1))
+
+    local id, paused = fcgi_decode(buf, chan)
+    assert(id == nil and paused)
+    local stdin = chan[1].stdin
+    assert(stdin:tostring() == "12345678")
+
+    stdin:seek(0)  -- consumed
+    id, paused = fcgi_decode(buf, chan)
+    assert(id == 1 and not paused)
+    assert(stdin:tostring() == "abcdefgh")
+end
+
+-- callback error
+do
+    local chan = new_channel()
+    chan.on_request = function(req) error"failed" end
+
+    local id = fcgi_decode(begin(1) .. params(1, {})
+	.. record(STDIN, 1, "x") .. record(STDIN, 1), chan)
+    assert(id == 1 and chan[1].error:find"failed")
+    assert(chan[1].next_ready == false)
+end
+
+-- encode to the list of records
+thread.init()
+
+for _, size in ipairs{70000, 3 * 1048576} do
+    local a, b = sock.handle(), sock.handle()
+    assert(a:socket("stream", "unix", b))
+
+    local body = assert(mem.pointer():alloc())
+    local data = string.rep("0123456789", size / 10)
+    body:write(data)
+
+    local out = {}
+    fcgi_encode(out, 7, "Content-type: text/plain\r\n\r\n", body)
+    fcgi_encode(out, 7)
+
+    -- send from sibling thread, the socket buffer is smaller
+    local sent
+    assert(thread.run(function()
+	sent = {a:send(out)}
+	a:close()
+    end))
+
+    -- parse the records
+    local input, s = {}
+    repeat
+	s = b:read()
+	input[#input + 1] = s
+    until not s
+    input = table.concat(input)
+    assert(sent[1] and sent[2] == #input and body:seek() == 0)
+
+    local off, stdout, ended = 1, {}
+    while off <= #input do
+	local type = input:byte(off + 1)
+	local id = input:byte(off + 2) * 256 + input:byte(off + 3)
+	local len = input:byte(off + 4) * 256 + input:byte(off + 5)
+	local pad = input:byte(off + 6)
+	assert(id == 7 and len <= 65535)
+	if type == STDOUT then
+	    stdout[#stdout + 1] = input:sub(off + 8, off + 7 + len)
+	else
+	    assert(type == END and len == 8)
+	    ended = true
+	end
+	off = off + 8 + len + pad
+    end
+    assert(ended)
+    assert(table.concat(stdout) == "Content-type: text/plain\r\n\r\n" .. data)
+    b:close()
+end
+
+print"OK"
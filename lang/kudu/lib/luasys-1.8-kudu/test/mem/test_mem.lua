@@ -106,3 +106,45 @@ do
 end
 
 
+
+
+print"-- Compressed Streams"
+do
+	local chunks = {}
+	local sink = {
+		write = function(self, data)
+			chunks[#chunks + 1] = data
+			return true
+		end
+	}
+	local buf = assert(mem.pointer(4096))
+	buf:output(sink, "lz")
+	local lines = {}
+	for i = 1, 2000 do
+		lines[i] = "line " .. i .. " of the compressed stream"
+		buf:write(lines[i], "\n")
+	end
+	buf:close()
+	local data = table.concat(chunks)
+	assert(#chunks > 1 and #data < #table.concat(lines, "\n") / 2)
+
+	local source = {
+		pos = 1;
+		read = function(self, n)  -- short reads
+			n = math.min(n, 1000)
+			local s = data:sub(self.pos, self.pos + n - 1)
+			self.pos = self.pos + #s
+			return s
+		end
+	}
+	buf = assert(mem.pointer():alloc())
+	buf:input(source, "lz")
+	for i = 1, 1000 do
+		assert(buf:read"*l" == lines[i])
+	end
+	assert(buf:read(5) == "line ")
+	assert(buf:read"*a" == table.concat(lines, "\n", 1001):sub(6) .. "\n")
+	assert(buf:read"*l" == nil)
+	buf:close()
+	print"OK"
+end
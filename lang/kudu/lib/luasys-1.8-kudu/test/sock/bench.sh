@@ -0,0 +1,16 @@
+#!/bin/sh
+# Compare event queue backends: build by "make linux" (epoll)
+# and by "make linux-uring" (io_uring), then run with each one.
+
+LUA=${LUA:-lua}
+
+$LUA echosrvr.lua > /dev/null &
+srv=$!
+sleep 1
+
+for i in 1 2 3; do
+    echo | $LUA manyclnt.lua
+done
+
+kill -INT $srv
+wait $srv
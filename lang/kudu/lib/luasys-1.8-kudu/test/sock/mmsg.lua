@@ -0,0 +1,72 @@
+#!/usr/bin/env lua
+
+-- Batched datagrams: sendmmsg() a list of packets, recvmmsg() them
+-- to the slots of one buffer with the lengths and source addresses.
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+local mem = sys.mem
+
+
+local host = sock.inet_pton("127.0.0.1")
+
+local rd = sock.handle()
+assert(rd:socket("dgram"))
+local raddr = sock.addr():inet(0, host)
+assert(rd:bind(raddr))
+assert(raddr:getsockname(rd))
+assert(rd:nonblocking(true))
+
+local wr = sock.handle()
+assert(wr:socket("dgram"))
+local waddr = sock.addr():inet(0, host)
+assert(wr:bind(waddr))
+assert(waddr:getsockname(wr))
+local wport = waddr:inet()
+
+-- nothing to receive
+local slab = assert(mem.pointer():alloc(64 * 1024))
+local lens, addrs = {}, {}
+assert(rd:recvmmsg(slab, lens, 256, addrs) == false)
+
+-- strings and buffers
+local packets = {}
+for i = 1, 10 do
+    packets[i] = string.rep(string.char(64 + i), i * 10)
+end
+local buf = assert(mem.pointer():alloc())
+buf:write"from buffer"
+packets[11] = buf
+
+assert(wr:sendmmsg(packets, raddr) == 11)
+assert(buf:seek() == 0)
+
+local n = assert(rd:recvmmsg(slab, lens, 256, addrs))
+assert(n == 11 and slab:seek() == n * 256)
+for i = 1, 10 do
+    assert(lens[i] == i * 10)
+    assert(slab:substr((i - 1) * 256, lens[i]) == packets[i])
+    assert(addrs[i]:inet() == wport)
+end
+assert(slab:substr(10 * 256, lens[11]) == "from buffer")
+
+-- the slab holds 4 slots: the rest stays queued
+slab:seek(0)
+local small = assert(mem.pointer(4 * 100))
+for i = 1, 6 do packets[i] = "p" .. i end
+for i = 7, 11 do packets[i] = nil end
+assert(wr:sendmmsg(packets, raddr) == 6)
+assert(rd:recvmmsg(small, lens, 100) == 4)
+assert(small:substr(300, lens[4]) == "p4")
+assert(not pcall(rd.recvmmsg, rd, small, lens, 100))
+small:seek(0)
+assert(rd:recvmmsg(small, lens, 100) == 2)
+assert(small:substr(100, lens[2]) == "p6")
+
+-- per packet addresses
+assert(wr:sendmmsg({"a", "b"}, {raddr, raddr}) == 2)
+assert(rd:recvmmsg(slab, lens) == 2)
+
+rd:close(); wr:close()
+print"OK"
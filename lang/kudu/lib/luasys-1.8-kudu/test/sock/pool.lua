@@ -0,0 +1,57 @@
+#!/usr/bin/env lua
+
+-- Receive buffer pool: recv() and read() fill pooled buffers in place,
+-- the buffers are returned to the pool when done.
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+local mem = sys.mem
+
+
+local a, b = sock.handle(), sock.handle()
+assert(a:socket("stream", "unix", b))
+assert(b:nonblocking(true))
+
+-- small buffers share slabs
+local pool = mem.pool(16, 4)
+assert(#pool == 0)
+
+assert(a:write"0123456789abcdefXYZ")
+local p1 = assert(b:read(pool))
+assert(p1:tostring() == "0123456789abcdef" and #p1 == 16)
+local p2 = assert(b:recv(pool))
+assert(p2:tostring() == "XYZ" and p1 ~= p2)
+
+local size, total, nfree = pool:stats()
+assert(size == 16 and total == 4 and nfree == 2)
+
+-- nothing to read: the buffer goes back
+assert(b:read(pool) == false and #pool == 2)
+
+-- reuse
+pool:put(p1, p2)
+assert(#pool == 4)
+assert(not pcall(pool.put, pool, p1))
+assert(not pcall(pool.put, pool, mem.pointer(16)))
+
+assert(a:write"again")
+local p3 = assert(b:read(pool))
+assert(p3 == p2 and p3:tostring() == "again")
+pool:put(p3)
+
+-- grow by slabs
+local bufs = {}
+for i = 1, 10 do bufs[i] = assert(pool:get()) end
+size, total, nfree = pool:stats()
+assert(total == 12 and nfree == 2)
+for i = 1, 10 do pool:put(bufs[i]) end
+assert(#pool == 12)
+
+-- the pool of event queue
+local evq = assert(sys.event_queue())
+local epool = evq:pool(32)
+assert(evq:pool() == epool and select(1, epool:stats()) == 32)
+
+a:close(); b:close()
+print"OK"
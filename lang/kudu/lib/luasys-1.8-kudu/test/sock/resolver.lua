@@ -0,0 +1,208 @@
+#!/usr/bin/env lua
+
+-- Asynchronous DNS resolver against the stand-in name server,
+-- running on the same event queue.
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local evq = assert(sys.event_queue())
+
+-- Name server
+
+local A, AAAA = 1, 28
+
+local zone = {
+    ["www.example.test"] = {A, {300, "\127\0\0\2"}, {60, "\127\0\0\3"}},
+    ["short.example.test"] = {A, {1, "\127\0\0\4"}},
+    ["v6.example.test"] = {AAAA, {300, string.rep("\0", 15) .. "\1"}},
+    ["drop.example.test"] = {A, {300, "\127\0\0\5"}},
+}
+local served, dropped = {}, {}
+
+local function u16(n)
+    return string.char(math.floor(n / 256) % 256, n % 256)
+end
+
+local function u32(n)
+    return u16(math.floor(n / 65536)) .. u16(n % 65536)
+end
+
+local function reply(query)
+    local off, labels = 13, {}
+    while true do
+	local n = query:byte(off)
+	if n == 0 then break end
+	labels[#labels + 1] = query:sub(off + 1, off + n)
+	off = off + n + 1
+    end
+    local name = table.concat(labels, "."):lower()
+    local qtype = query:byte(off + 1) * 256 + query:byte(off + 2)
+    local question = query:sub(13, off + 4)
+
+    served[name] = (served[name] or 0) + 1
+    if name == "silent.example.test" then return end
+    if name == "drop.example.test" and not dropped[name] then
+	dropped[name] = true
+	return
+    end
+
+    local rcode, answers, authority = 0, {}, {}
+    local rr = zone[name]
+    if name == "fail.example.test" then
+	rcode = 2  -- SERVFAIL
+    elseif not rr then
+	rcode = 3  -- NXDOMAIN
+    end
+    if rr and rr[1] == qtype then
+	for i = 2, #rr do
+	    local ttl, addr = rr[i][1], rr[i][2]
+	    answers[#answers + 1] = "\192\12" .. u16(qtype) .. u16(1)
+		.. u32(ttl) .. u16(#addr) .. addr
+	end
+    elseif rcode ~= 2 then
+	-- SOA: TTL 3600, minimum 1
+	local soa = "\2ns\4test\0\4host\4test\0"
+	    .. u32(1) .. u32(3600) .. u32(600) .. u32(86400) .. u32(1)
+	authority[1] = "\4test\0" .. u16(6) .. u16(1)
+	    .. u32(3600) .. u16(#soa) .. soa
+    end
+
+    return query:sub(1, 2) .. u16(0x8180 + rcode) .. u16(1)
+	.. u16(#answers) .. u16(#authority) .. u16(0)
+	.. question .. table.concat(answers) .. table.concat(authority)
+end
+
+local host = sock.inet_pton("127.0.0.1")
+local srv = sock.handle()
+assert(srv:socket("dgram"))
+local saddr = sock.addr():inet(0, host)
+assert(srv:bind(saddr))
+assert(saddr:getsockname(srv))
+assert(srv:nonblocking(true))
+
+local from = sock.addr()
+evq:add_socket(srv, "r", function()
+    while true do
+	local query = srv:recv(nil, from)
+	if not query then break end
+	local ans = reply(query)
+	if ans then assert(srv:send(ans, from)) end
+    end
+end)
+
+-- Resolver
+
+local res = assert(sock.resolver(evq, saddr, 100, 1))
+
+local results = {}
+local function on_result(name, addrs, err)
+    results[#results + 1] = {name, addrs, err}
+end
+
+local function wait(n)
+    while #results < n do
+	assert(evq:loop(1000, true))
+    end
+end
+
+local function sleep(ms)
+    local done
+    evq:add_timer(function(q, ev) done = true; q:del(ev) end, ms)
+    while not done do assert(evq:loop(ms * 2, true)) end
+end
+
+-- numeric address
+local addrs = res:resolve("127.0.0.9", on_result)
+assert(addrs[1] == "\127\0\0\9")
+
+-- answer with the minimum TTL, coalesced requests
+assert(res:resolve("WWW.Example.Test.", on_result) == true)
+assert(res:resolve("www.example.test", on_result) == true)
+wait(2)
+for i = 1, 2 do
+    local name, addrs = results[i][1], results[i][2]
+    assert(name == "www.example.test" and #addrs == 2)
+    assert(addrs[1] == "\127\0\0\2" and addrs[2] == "\127\0\0\3")
+end
+assert(served["www.example.test"] == 1)
+
+addrs = res:resolve("www.example.test", on_result)
+assert(type(addrs) == "table" and addrs[2] == "\127\0\0\3")
+assert(served["www.example.test"] == 1)
+
+-- AAAA
+results = {}
+assert(res:resolve("v6.example.test", on_result, "inet6") == true)
+wait(1)
+assert(#results[1][2][1] == 16)
+assert(sock.inet_ntop(results[1][2][1]) == "::1")
+
+-- negative answer, cached for the SOA minimum
+results = {}
+assert(res:resolve("missing.example.test", on_result) == true)
+wait(1)
+assert(results[1][2] == nil and results[1][3] == "host not found")
+local ok, err = res:resolve("missing.example.test", on_result)
+assert(ok == nil and err == "host not found")
+assert(served["missing.example.test"] == 1)
+
+-- no data of the type
+results = {}
+assert(res:resolve("www.example.test", on_result, "inet6") == true)
+wait(1)
+assert(results[1][3] == "no address")
+
+-- server failure is not cached
+results = {}
+assert(res:resolve("fail.example.test", on_result) == true)
+wait(1)
+assert(results[1][3] == "server failure")
+assert(res:resolve("fail.example.test", on_result) == true)
+wait(2)
+assert(served["fail.example.test"] == 2)
+
+-- retry of the lost query
+results = {}
+assert(res:resolve("drop.example.test", on_result) == true)
+wait(1)
+assert(results[1][2][1] == "\127\0\0\5")
+assert(served["drop.example.test"] == 2)
+
+-- time out after retries
+results = {}
+assert(res:resolve("silent.example.test", on_result) == true)
+wait(1)
+assert(results[1][2] == nil and results[1][3] == "timed out")
+assert(served["silent.example.test"] == 2)
+
+-- expiration of TTL
+results = {}
+assert(res:resolve("short.example.test", on_result) == true)
+wait(1)
+assert(type(res:resolve("short.example.test", on_result)) == "table")
+sleep(1100)
+assert(res:resolve("missing.example.test", on_result) == true)
+assert(res:resolve("short.example.test", on_result) == true)
+wait(3)
+assert(served["short.example.test"] == 2)
+assert(served["missing.example.test"] == 2)
+
+-- invalid names
+assert(not res:resolve("a..b", on_result))
+assert(not res:resolve(string.rep("a", 64) .. ".test", on_result))
+
+local npending, ncached = res:stats()
+assert(npending == 0 and ncached > 0)
+res:flush()
+npending, ncached = res:stats()
+assert(ncached == 0)
+
+-- close
+assert(res:resolve("silent.example.test", on_result) == true)
+res:close()
+assert(not res:resolve("www.example.test", on_result))
+
+srv:close()
+print"OK"
@@ -0,0 +1,74 @@
+#!/usr/bin/env lua
+
+-- Scatter/gather I/O: HTTP-like framing from a header string, a body
+-- buffer and a trailer in one call, read back to several buffers.
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+local mem = sys.mem
+
+
+local a, b = sock.handle(), sock.handle()
+assert(a:socket("stream", "unix", b))
+
+local body = assert(mem.pointer():alloc())
+body:write(string.rep("b", 1000))
+
+-- write(): gathered, the body buffer is consumed
+local header = "HTTP/1.1 200 OK\r\nContent-Length: 1000\r\n\r\n"
+local ok, n = a:write(header, body, "\r\n")
+assert(ok and n == #header + 1000 + 2 and body:seek() == 0)
+
+-- readv(): header to a fixed buffer, the rest to a growing one
+local hbuf = assert(mem.pointer(#header))
+local rest = assert(mem.pointer():alloc())
+n = assert(b:readv(hbuf, rest, 4096))
+assert(n == #header + 1002)
+assert(hbuf:tostring() == header and rest:seek() == 1002)
+assert(rest:tostring():sub(-2) == "\r\n")
+
+-- send()/recv() of lists: sendmsg()/recvmsg()
+local d1, d2 = sock.handle(), sock.handle()
+assert(d1:socket("dgram", "unix", d2))
+body:write("datagram body")
+ok, n = d1:send{ "head:", body, ":tail" }
+assert(ok and n == 23 and body:seek() == 0)
+local p1, p2 = assert(mem.pointer(5)), assert(mem.pointer():alloc())
+assert(d2:recv({ p1, p2, 64 }) == 23)
+assert(p1:tostring() == "head:" and p2:tostring() == "datagram body:tail")
+
+-- parts of a buffer: the count limits, the next listing continues
+body:write("0123456789")
+ok, n = a:write({body, 4}, "|", {body, 3}, "|", body)
+assert(ok and n == 12 and body:seek() == 0)
+assert(b:read(12) == "0123|456|789")
+
+body:write("0123456789")
+ok, n = a:send{ {body, 2}, {body, 2}, "|" }
+assert(ok and n == 5 and body:tostring() == "456789")
+assert(b:read(5) == "0123|")
+body:seek(0)
+
+-- a number is written as text
+body:write("buf")
+ok, n = a:write(body, 5)
+assert(ok and n == 4 and b:read(4) == "buf5")
+
+-- more arguments than one writev() takes
+local parts = {}
+for i = 1, 200 do parts[i] = tostring(i % 10) end
+ok, n = a:write(unpack(parts))
+assert(ok and n == 200)
+assert(b:read(200) == table.concat(parts))
+
+-- longer list than one sendmsg() takes
+body:write("buf")
+parts[100] = body
+ok, n = a:send(parts)
+assert(ok and n == 202 and body:seek() == 0)
+parts[100] = "buf"
+assert(b:read(202) == table.concat(parts))
+
+a:close(); b:close(); d1:close(); d2:close()
+print"OK"
@@ -31,6 +31,86 @@ do
 end
 
 
+print"-- Socket modes: edge-triggered and re-armed"
+do
+    local sock = require"sys.sock"
+
+    local evq = assert(sys.event_queue())
+    local fdi, fdo = sock.handle(), sock.handle()
+    assert(fdi:socket(fdo))
+    assert(fdi:nonblocking(true))
+
+    local nedge, nrearm = 0, 0
+
+    local function on_edge(evq, evid, fd)
+	nedge = nedge + 1
+	assert(fd:read(1) == "e")  -- leave the rest unread
+    end
+
+    local function on_rearm(evq, evid, fd)
+	nrearm = nrearm + 1
+	if nrearm == 1 then
+	    assert(evq:mod_socket(evid, "r"))  -- re-arm
+	end
+    end
+
+    local evid = assert(evq:add_socket(fdi, "r", on_edge, nil, nil, "edge"))
+    assert(fdo:write("ee"))
+    for i = 1, 3 do evq:loop(10, true) end
+    assert(nedge == 1)
+    assert(evq:del(evid, true))
+
+    evid = assert(evq:add_socket(fdi, "r", on_rearm, nil, nil, "rearm"))
+    for i = 1, 3 do evq:loop(10, true) end
+    assert(nrearm == 2)
+    assert(evq:del(evid, true))
+
+    -- modes are matched by words
+    assert(not pcall(evq.add_socket, evq, fdi, "r", on_edge, nil, nil,
+	"edeg"))
+    assert(not pcall(evq.add_socket, evq, fdi, "r", on_edge, nil, nil,
+	"edgerearm"))
+
+    -- exclusive wakeup can't be one-shot
+    assert(not pcall(evq.add_socket, evq, fdi, "r", on_rearm, nil, nil,
+	"exclusive rearm"))
+    assert(not pcall(evq.add_socket, evq, fdi, "r", on_rearm, nil, true,
+	"exclusive"))
+    evid = assert(evq:add_socket(fdi, "r", on_rearm, nil, nil, "exclusive"))
+    assert(not pcall(evq.mod_socket, evq, evid, "r", "rearm"))
+    assert(evq:mod_socket(evid, "rw", "edge"))
+    assert(evq:del(evid, true))
+    print"OK"
+end
+
+
+print"-- Compact dispatch: packed results"
+do
+    local sock = require"sys.sock"
+
+    local evq = assert(sys.event_queue"compact")
+    local fdi, fdo = sock.handle(), sock.handle()
+    assert(fdi:socket(fdo))
+
+    local results = {}
+
+    local function on_event(evq, evid, obj, res)
+	results[#results + 1] = res
+	assert(evq:del(evid, true))
+    end
+
+    assert(evq:add_socket(fdi, "r", on_event))
+    assert(evq:add_timer(on_event, 10))
+    assert(fdo:write("c"))
+    evq:loop(1000)
+    fdi:close()
+    fdo:close()
+    table.sort(results)
+    assert(results[1] == 1 and results[2] == 4)
+    print"OK"
+end
+
+
 print"-- Signal: wait SIGINT"
 do
     local function on_signal(evq, evid, _, _, _, timeout)
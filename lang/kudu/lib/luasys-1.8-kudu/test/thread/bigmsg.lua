@@ -0,0 +1,89 @@
+#!/usr/bin/env lua
+
+-- Large messages between VM-Threads: heap strings and moved memory buffers.
+-- Usage: bigmsg.lua [payload_size (bytes)] [num_messages]
+
+local sys = require"sys"
+
+local thread = sys.thread
+
+thread.init()
+
+
+local size = tonumber(arg[1]) or 65536
+local num_msgs = tonumber(arg[2]) or 2000
+
+local period = sys.period()
+
+
+-- Consumer VM-Thread
+local function consume(master, size)
+    local sys = require"sys"
+    local thread = sys.thread
+
+    while true do
+	local _, kind, data, tail = thread.msg_recv()
+	if kind == "quit" then break end
+
+	local len
+	if kind == "string" then
+	    len = #data
+	else
+	    len = data:seek()
+	    assert(data:substr(len - 1, 1) == "z", "moved data")
+	    data:free()
+	end
+	assert(len == size and tail == "end", "message items")
+	thread.msg_send(master, len)
+    end
+    thread.msg_send(master, "done")
+end
+
+local consumer = assert(thread.runvm(string.dump(consume), size))
+
+local function bench(name, make)
+    local total = 0
+
+    period:start()
+    for i = 1, num_msgs do
+	thread.msg_send(consumer, name, make(), "end")
+	local _, len = thread.msg_recv()
+	total = total + len
+    end
+    local elapsed = period:get() / 1000000
+
+    print(name .. ": " .. math.floor(num_msgs / elapsed) .. " messages/s, "
+	.. math.floor(total / elapsed / 1048576) .. " MB/s")
+end
+
+local payload = string.rep("x", size - 1) .. "z"
+
+bench("string", function()
+    return payload
+end)
+
+bench("membuf", function()
+    local buf = sys.mem.pointer():alloc(size)
+    buf:write(payload)
+    return buf
+end)
+
+-- Sender loses the moved buffer
+do
+    local buf = sys.mem.pointer():alloc(size)
+    buf:write(payload)
+    thread.msg_send(consumer, "membuf", buf, "end")
+    assert(thread.msg_recv())
+    assert(#buf == 0 and buf:seek() == 0, "buffer is not moved")
+
+    -- the buffer can be moved only once
+    buf:alloc(size)
+    buf:write(payload)
+    assert(not pcall(thread.msg_send, consumer, "membuf", buf, buf))
+    assert(#buf == size, "buffer is moved")
+    buf:free()
+end
+
+thread.msg_send(consumer, "quit")
+assert(select(2, thread.msg_recv()) == "done")
+thread.sleep(100)  -- let consumer close its VM
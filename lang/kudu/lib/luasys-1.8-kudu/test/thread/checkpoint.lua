@@ -0,0 +1,111 @@
+#!/usr/bin/env lua
+
+-- Parallel checkpoint: every shard marshals own partition of the state,
+-- the master joins them to segments and the shards restore them in place.
+-- Usage: checkpoint.lua [num_shards] [entries_per_shard]
+
+local sys = require"sys"
+require"marshal"
+
+local thread = sys.thread
+
+thread.init()
+
+
+local nshards = tonumber(arg[1]) or 4
+local nentries = tonumber(arg[2]) or 100000
+
+local period = sys.period()
+
+
+-- The partition of state: (shard_index, num_entries) -> table
+local partition_chunk = [[
+    local index, n = ...
+    local t = {}
+    for i = 1, n do
+	t["s" .. index .. "." .. i] = {id = i, name = "item" .. i, tags = {index}}
+    end
+    return t
+]]
+local partition = assert(loadstring(partition_chunk))
+
+-- Shard VM-Thread
+local function shard(master, index, n, partition_chunk)
+    local sys = require"sys"
+    require"table"
+    require"marshal"
+    local thread = sys.thread
+
+    local state = loadstring(partition_chunk)(index, n)
+    thread.msg_send(master, "ready")
+
+    -- checkpoint
+    thread.msg_recv()
+    thread.msg_send(master, index, table.marshal(state))
+
+    -- restore from the master's buffer
+    state = nil
+    local _, ptr, offset, length = thread.msg_recv()
+    state = table.unmarshal(ptr, offset, length)
+    assert(state["s" .. index .. "." .. n].tags[1] == index)
+    thread.msg_send(master, index)
+end
+
+-- Whole state on one core
+local whole = {}
+for i = 1, nshards do
+    for k, v in pairs(partition(i, nentries)) do whole[k] = v end
+end
+
+period:start()
+local s = table.marshal(whole)
+print("single marshal: " .. period:get() / 1000 .. " ms")
+
+period:start()
+table.unmarshal(s)
+print("single unmarshal: " .. period:get() / 1000 .. " ms")
+
+period:start()
+s = table.marshal_segments(whole, nshards)
+print("segments marshal: " .. period:get() / 1000 .. " ms")
+
+whole = nil
+collectgarbage()
+
+-- Sharded state
+local shards = {thread.runvms(nshards, string.dump(shard), nentries,
+    partition_chunk)}
+assert(#shards == nshards)
+
+for i = 1, nshards do
+    assert(select(2, thread.msg_recv()) == "ready")
+end
+
+period:start()
+for i = 1, nshards do
+    thread.msg_send(shards[i], "go")
+end
+local segments = {}
+for i = 1, nshards do
+    local _, index, seg = thread.msg_recv()
+    segments[index] = seg
+end
+s = table.join_segments(segments)
+print("parallel marshal: " .. period:get() / 1000 .. " ms")
+
+local offsets, lengths = table.segments(s)
+assert(#offsets == nshards)
+
+local buf = sys.mem.pointer():alloc(#s)
+buf:write(s)
+
+period:start()
+for i = 1, nshards do
+    thread.msg_send(shards[i], buf:getptr(), offsets[i], lengths[i])
+end
+for i = 1, nshards do
+    thread.msg_recv()  -- the last message of shard
+end
+print("parallel unmarshal: " .. period:get() / 1000 .. " ms")
+
+buf:free()
@@ -0,0 +1,187 @@
+#!/usr/bin/env lua
+
+-- Sharded reactor: every shard is vm-thread with own event_queue.
+-- Usage: reactor.lua [mode ("reuseport", "handoff")] [num_shards]
+--	[num_clients] [connections_per_client] [duration (msec)]
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+local thread = sys.thread
+
+thread.init()
+
+
+local mode = arg[1] or "reuseport"
+local nshards = tonumber(arg[2]) or 2
+local nclients = tonumber(arg[3]) or nshards
+local nconn = tonumber(arg[4]) or 50
+local duration = tonumber(arg[5]) or 2000
+
+local host, port = "127.0.0.1", 8090
+
+
+-- Server Shard VM-Thread
+local function shard(master, index, mode, host, port)
+    local sys = require"sys"
+    local sock = require"sys.sock"
+    local thread = sys.thread
+
+    local evq = assert(sys.event_queue())
+
+    local function on_read(evq, evid, fd, _, _, _, eof)
+	local line = not eof and fd:read()
+	if line then
+	    fd:write(line)
+	else
+	    evq:del(evid)
+	    fd:close()
+	end
+    end
+
+    local function on_accept(evq, evid, fd)
+	local newfd = sock.handle()
+	if fd:accept(newfd) then
+	    assert(evq:add_socket(newfd, 'r', on_read))
+	end
+    end
+
+    if mode == "reuseport" then
+	local fd = sock.handle()
+	assert(fd:socket())
+	assert(fd:sockopt("reuseport", 1))
+	assert(fd:bind(sock.addr():inet(port, sock.inet_pton(host))))
+	assert(fd:listen())
+	assert(evq:add_socket(fd, 'r', on_accept))
+    end
+
+    -- Work posted by other vm-threads
+    local msg_evid
+    local function on_message(evq)
+	while true do
+	    local src, sd = thread.msg_recv(0)
+	    if not src then break end
+	    if sd == "quit" then
+		evq:del(msg_evid)
+		evq:stop()
+		break
+	    end
+	    local fd = sock.handle()
+	    fd:setfd(sd)
+	    assert(evq:add_socket(fd, 'r', on_read))
+	end
+    end
+
+    msg_evid = assert(evq:add_trigger(thread.self(), thread, 'r', on_message))
+
+    thread.msg_send(master, "ready", index)
+    evq:loop()
+    thread.msg_send(master, "done", index)
+end
+
+-- Client VM-Thread
+local function client(master, index, host, port, nconn, duration)
+    local sys = require"sys"
+    local sock = require"sys.sock"
+    local thread = sys.thread
+
+    local evq = assert(sys.event_queue())
+    local running, nreq = true, 0
+
+    local function on_read(evq, evid, fd, _, _, _, eof)
+	local line = not eof and fd:read()
+	if line then
+	    nreq = nreq + 1
+	end
+	if line and running then
+	    fd:write("ping\n")
+	else
+	    evq:del(evid)
+	    fd:close()
+	end
+    end
+
+    local saddr = sock.addr():inet(port, sock.inet_pton(host))
+    for i = 1, nconn do
+	local fd = sock.handle()
+	assert(fd:socket())
+	assert(fd:connect(saddr))
+	assert(evq:add_socket(fd, 'r', on_read))
+	assert(fd:write("ping\n"))
+    end
+
+    assert(evq:add_timer(function(evq, evid)
+	running = false
+	evq:del(evid)
+    end, duration))
+
+    evq:loop()
+    thread.msg_send(master, "requests", nreq)
+end
+
+
+local function wait_messages(name, count)
+    local sum = 0
+    for i = 1, count do
+	local src, s, n = thread.msg_recv()
+	assert(s == name, s)
+	sum = sum + n
+    end
+    return sum
+end
+
+local shards = {assert(thread.runvms(nshards, string.dump(shard),
+    mode, host, port))}
+wait_messages("ready", nshards)
+
+-- Round-robin handoff of accepted sockets
+local evq, listen_fd
+if mode == "handoff" then
+    evq = assert(sys.event_queue())
+
+    local fd = sock.handle()
+    assert(fd:socket())
+    assert(fd:sockopt("reuseaddr", 1))
+    assert(fd:bind(sock.addr():inet(port, sock.inet_pton(host))))
+    assert(fd:listen())
+    listen_fd = fd
+
+    local naccepted, next_shard = 0, 1
+    local newfd = sock.handle()
+
+    assert(evq:add_socket(fd, 'r', function(evq, evid, fd)
+	if not fd:accept(newfd) then return end
+
+	thread.msg_send(shards[next_shard], newfd:getfd())
+	newfd:setfd(-1)
+	next_shard = next_shard % nshards + 1
+
+	naccepted = naccepted + 1
+	if naccepted == nclients * nconn then
+	    evq:del(evid)
+	end
+    end))
+end
+
+local start_time = sys.msec()
+
+assert(thread.runvms(nclients, string.dump(client),
+    host, port, nconn, duration))
+
+if evq then
+    evq:loop()
+    listen_fd:close()
+end
+
+local nreq = wait_messages("requests", nclients)
+local elapsed = sys.msec() - start_time
+
+for i = 1, nshards do
+    thread.msg_send(shards[i], "quit")
+end
+wait_messages("done", nshards)
+thread.sleep(100)  -- let shards close their VMs
+
+print(mode .. ": " .. nshards .. " shards, "
+    .. nclients * nconn .. " connections: "
+    .. math.floor(nreq * 1000 / elapsed) .. " requests/s")
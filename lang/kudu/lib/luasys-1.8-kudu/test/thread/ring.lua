@@ -0,0 +1,101 @@
+#!/usr/bin/env lua
+
+-- Small messages between threads: thread.ring vs thread.channel vs
+-- thread.data_pool.
+-- Usage: ring.lua [num_messages]
+
+local sys = require"sys"
+
+local thread = sys.thread
+
+thread.init()
+
+
+local num_msgs = tonumber(arg[1]) or 200000
+
+local period = sys.period()
+
+
+local function report(name, sum)
+    local elapsed = period:get() / 1000000
+    assert(sum == num_msgs * (num_msgs + 1) / 2, name .. ": lost messages")
+    print(name .. ": " .. math.floor(num_msgs / elapsed) .. " messages/s")
+end
+
+-- Producer and consumer are threads of the same VM
+local function bench(name, queue)
+    period:start()
+
+    assert(thread.run(function()
+	for i = 1, num_msgs do
+	    queue:put(i, "msg")
+	end
+    end))
+
+    local sum = 0
+    for i = 1, num_msgs do
+	local n, s = queue:get()
+	sum = sum + n
+    end
+    report(name, sum)
+end
+
+bench("channel", thread.channel())
+bench("data_pool", thread.data_pool())
+bench("ring", thread.ring())
+
+
+-- Producer is VM-Thread
+do
+    local function producer(master, ring, num_msgs)
+	local sys = require"sys"
+
+	ring = sys.thread.ring(ring)
+	for i = 1, num_msgs do
+	    ring:put(i, "msg")
+	end
+    end
+
+    local ring = thread.ring()
+
+    period:start()
+    assert(thread.runvm(string.dump(producer), ring:share(), num_msgs))
+
+    local sum = 0
+    for i = 1, num_msgs do
+	local n, s = ring:get()
+	sum = sum + n
+    end
+    report("ring (vm-threads)", sum)
+end
+
+
+-- Consumer is event_queue's trigger
+do
+    local evq = assert(sys.event_queue())
+    local ring = thread.ring(64)
+    local sum, count = 0, 0
+
+    assert(evq:add_trigger(ring, 'r', function(evq, evid)
+	while true do
+	    local n = ring:get(0)
+	    if not n then break end
+	    sum, count = sum + n, count + 1
+	    if count == num_msgs then
+		evq:del(evid)
+	    end
+	end
+    end))
+
+    period:start()
+    assert(thread.run(function()
+	for i = 1, num_msgs do
+	    ring:put(i)
+	end
+    end))
+
+    evq:loop()
+    report("ring (event_queue)", sum)
+end
+
+thread.sleep(100)  -- let threads close
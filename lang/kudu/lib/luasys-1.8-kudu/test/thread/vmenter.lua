@@ -0,0 +1,46 @@
+#!/usr/bin/env lua
+
+-- Cost of VM-mutex handoff around system calls: small pipe reads per second
+-- while the VM is owned by one thread and after a sibling thread is started.
+-- Usage: vmenter.lua [num_reads]
+
+local sys = require"sys"
+
+local thread = sys.thread
+
+thread.init()
+
+
+local num_reads = tonumber(arg[1]) or 1000000
+
+local fdi, fdo = sys.handle(), sys.handle()
+assert(fdi:pipe(fdo))
+
+local period = sys.period()
+
+local function bench(name)
+    period:start()
+    for i = 1, num_reads do
+	fdo:write"x"
+	fdi:read(1)
+    end
+    local elapsed = period:get() / 1000000
+
+    print(name .. ": " .. math.floor(num_reads / elapsed) .. " reads/s")
+end
+
+
+bench"single thread"
+
+-- Sibling thread makes the VM shared
+local running = true
+assert(thread.run(function()
+    while running do
+	thread.sleep(10)
+    end
+end))
+
+bench"shared vm"
+
+running = false
+thread.sleep(100)
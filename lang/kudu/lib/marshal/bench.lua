@@ -0,0 +1,98 @@
+-- marshal size and time per call on wide, deep, numeric and record tables,
+-- then the ratio and throughput (of raw bytes) with compression
+-- usage: lua bench.lua [iterations]
+
+require "marshal"
+
+local iterations = tonumber(arg and arg[1]) or 20
+
+local function wide(n)
+   local t = { }
+   for i=1, n do
+      t[i] = { id = i, name = "item" .. i, flag = (i % 2 == 0),
+         tags = { "a", "b", i } }
+   end
+   return t
+end
+
+local function deep(depth, width)
+   local root = { }
+   local node = root
+   for d=1, depth do
+      for i=1, width do
+         node[i] = d * i
+      end
+      node.name = "level" .. d
+      node.next = { }
+      node = node.next
+   end
+   return root
+end
+
+local function bench(name, t, intern, compress)
+   local s = table.marshal(t, nil, intern, compress)
+   collectgarbage()
+   local clock = os.clock()
+   for i=1, iterations do
+      s = table.marshal(t, nil, intern, compress)
+   end
+   local encode = os.clock() - clock
+
+   collectgarbage()
+   clock = os.clock()
+   for i=1, iterations do
+      table.unmarshal(s)
+   end
+   local decode = os.clock() - clock
+
+   print(string.format("%-6s %9d bytes  marshal %8.2f ms  unmarshal %8.2f ms",
+      name, #s, encode * 1000 / iterations, decode * 1000 / iterations))
+   return #s, encode / iterations, decode / iterations
+end
+
+local function numbers(n)
+   local t = { }
+   for i=1, n do
+      t[i] = (i % 3 == 0) and i * 1000 or (i % 3 == 1) and -i or i / 7
+   end
+   return t
+end
+
+local function records(n)
+   local status = { "active", "inactive", "suspended" }
+   local t = { }
+   for i=1, n do
+      t[i] = { id = i, username = "user" .. i, status = status[i % 3 + 1],
+         country = (i % 2 == 0) and "Netherlands" or "Germany",
+         created = "2024-01-0" .. (i % 9 + 1) .. "T00:00:00Z",
+         permissions = { "read", "write" } }
+   end
+   return t
+end
+
+bench("wide", wide(50000))
+bench("deep", deep(2000, 16))
+bench("number", numbers(200000))
+bench("record", records(50000))
+bench("intern", records(50000), true)
+
+local Record = { }
+table.schema("Record", Record, { "id", "username", "status", "country",
+   "created", "permissions" })
+local schema = records(50000)
+for i=1, #schema do setmetatable(schema[i], Record) end
+bench("schema", schema)
+bench("both", schema, true)
+
+print()
+for _, case in ipairs{ { "wide", wide(50000) }, { "deep", deep(2000, 16) },
+      { "number", numbers(200000) }, { "record", records(50000) },
+      { "schema", schema } } do
+   local name, t = case[1], case[2]
+   local raw, encode, decode = bench(name, t)
+   local size, zencode, zdecode = bench(name, t, nil, true)
+   local mb = raw / 1048576
+   print(string.format("%-6s ratio %5.2f  marshal %7.1f -> %7.1f MB/s"
+      .. "  unmarshal %7.1f -> %7.1f MB/s", name, raw / size,
+      mb / encode, mb / zencode, mb / decode, mb / zdecode))
+end
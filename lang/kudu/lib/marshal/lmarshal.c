@@ -4,8 +4,76 @@
 * Richard Hundt <richardhundt@gmail.com>
 *
 * Provides:
-* s = table.marshal(t)      - serializes a table to a byte stream
-* t = table.unmarshal(s)    - deserializes a byte stream to a table
+* s = table.marshal(t [, size_hint [, intern [, compress]]])
+*                           - serializes a table to a byte stream
+* n = table.marshal(t, writer [, chunk_size [, size_hint [, intern
+*                   [, compress]]]])
+*                           - streams serialized table to writer in chunks,
+*                             writer is a function(chunk) or an object with
+*                             the write method (sys.handle, sys.mem, file);
+*                             with intern (true or minimal length) the
+*                             repeated strings are written as references;
+*                             with compress the stream is compressed by
+*                             the built-in LZ block codec
+* e = table.encoder(t [, writer [, chunk_size [, intern [, compress]]]])
+*                           - incremental encoder of table, the output
+*                             is passed to writer or returned by step
+* r = e:step([budget])      - encodes about budget bytes, returns nil
+*                             until done, then the number of bytes
+*                             written or the serialized string; new
+*                             keys must not be added to the tables
+*                             being encoded between the steps
+* s = table.marshal_segments(t, n [, intern])
+*                           - serializes the top-level pairs of table
+*                             partitioned to n segments
+* s = table.join_segments(list)
+*                           - joins the serialized tables to segments
+* offsets, lengths = table.segments(s [, offset, length])
+*                           - the segment table, each segment is
+*                             decoded alone by table.unmarshal(s,
+*                             offsets[i], lengths[i])
+* table.schema(name, mt, fields [, types])
+*                           - registers the schema of records: tables
+*                             with metatable mt are written as the
+*                             name and values of fields (keys of any
+*                             type) in order, types are the names of
+*                             Lua types or "any"; the same schema
+*                             must be registered to unmarshal them
+* t = table.unmarshal(s [, lazy])
+* t = table.unmarshal(mem, offset, length [, lazy])
+*                           - deserializes a byte stream to a table,
+*                             the stream is a string, light userdata or
+*                             an object with the getptr method (sys.mem);
+*                             it is decoded in place, without a copy.
+*                             Lazy nested tables are filled on first
+*                             index (or __pairs), the stream must live
+*                             while they are not filled
+*
+* Format:
+* Version 2 is written: magic byte, version byte and the table.  A table
+* is the size of its array segment, the values 1..n of the array segment,
+* the other key/value pairs, the number of references inside and the
+* number of pairs (varints written backwards, so sizes are known before
+* the table is created and a lazy table can be skipped).  Values are tagged by
+* one byte; small integers and short strings are immediate, other integers
+* and lengths are varints, doubles are little-endian.  An interned string
+* gets the next reference as tables do, so repeats of it are references.
+* A record is the schema name (interned string), the other pairs ended
+* by nil and the values of fields.  Version 1 streams
+* (magic, endianness byte) are still read.
+*
+* Segments: magic byte, version byte 3, the number of segments and their
+* lengths (varints), then the segments, each is a version 2 stream.
+* References are not shared between segments: a table reached from two
+* segments is serialized (and unmarshaled) twice.  References to the
+* partitioned table are to the root of segment.  Unmarshaled whole, the
+* segments are merged to one table, the later pairs win.
+*
+* Compressed: magic byte, version byte 4, then frames of a version 2
+* stream: raw length and stored length (4 bytes little-endian each) and
+* the stored bytes, LZ4-style block (literal runs and matches of 16-bit
+* offset) or raw bytes when not smaller.  A frame is a flushed chunk or
+* up to 1MB.  Unmarshal decompresses to a buffer and decodes it in place.
 *
 * Limitations:
 * Coroutines are not serialized and nor are userdata, however support
@@ -46,6 +114,12 @@
 #include "lauxlib.h"
 
 
+#define MAR_MAGIC   0x8e
+#define MAR_VERSION 2  /* v1 has the endianness byte (0 or 1) here */
+#define MAR_SEGMENTS 3  /* container of version 2 streams */
+#define MAR_COMPRESSED 4  /* frames of compressed version 2 stream */
+
+/* v1 tags */
 #define MAR_TREF 1
 #define MAR_TVAL 2
 #define MAR_TUSR 3
@@ -54,35 +128,79 @@
 #define MAR_I32 4
 #define MAR_I64 8
 
-#define MAR_MAGIC 0x8e
+/* v2 tags */
+#define MAR2_FIXINT  0x00  /* 0x00..0x7f: integers 0..127 */
+#define MAR2_FIXSTR  0x80  /* 0x80..0x9f: strings of 0..31 bytes */
+#define MAR2_FALSE   0xa0
+#define MAR2_TRUE    0xa1
+#define MAR2_UINT    0xa2  /* varint n */
+#define MAR2_NINT    0xa3  /* varint -(n + 1) */
+#define MAR2_DOUBLE  0xa4  /* 8 bytes, little-endian */
+#define MAR2_STR     0xa5  /* varint length, bytes */
+#define MAR2_REF     0xa6  /* varint index of table, function, userdata */
+#define MAR2_TABLE   0xa7  /* varint length, table */
+#define MAR2_PERSIST 0xa8  /* constructor function from __persist */
+#define MAR2_FUNC    0xa9  /* varint length, dump, varint nups, upvalues */
+#define MAR2_NIL     0xaa  /* userdata without __persist, thread */
+#define MAR2_ISTR    0xab  /* varint length, bytes: interned string */
+#define MAR2_RECORD  0xac  /* schema name, other pairs, nil, fields */
+#define MAR2_NEGINT  0xe0  /* 0xe0..0xff: integers -32..-1 */
+
+#define MAR2_FIXMAX  0x7f
+#define MAR2_STRMAX  0x1f
+#define MAR2_NEGMIN  (-32)
+#define MAR2_INTMAX  9007199254740992.0  /* 2^53 */
+#define MAR2_LENPAD  5  /* bytes reserved for back-patched length */
+#define MAR2_INTERN  4  /* default minimal length of interned strings */
+
+static const int mar_one = 1;
+#define MAR_LITTLE_ENDIAN  (*(const char*)&mar_one)
+
+#define MAR_BUFSIZE   128
+#define MAR_CHUNKSIZE 65536
+
+#define MAR_ENCODER   "marshal.encoder"
 
 typedef struct mar_Buffer {
     size_t size;
     size_t seek;
     size_t head;
     char*  data;
+    int    writer; /* stack index of output stream, 0 for none */
+    size_t chunk;  /* flush the output stream by chunks of this size */
+    size_t total;  /* number of bytes flushed */
+    int    depth;  /* number of open length prefixes */
+    size_t intern; /* minimal length of interned strings, 0 for none */
+    int    compress; /* compress the flushed chunks to frames */
 } mar_Buffer;
 
-static int mar_pack(lua_State *L, mar_Buffer *buf, int idx);
-static int mar_unpack(lua_State *L, const char* buf, size_t len, int idx);
+static int mar_pack(lua_State *L, mar_Buffer *buf, int *idx);
+static int mar_unpack
+    (lua_State *L, const char *p, const char *end, int *idx, int lazy);
+static int mar_unpack_v1(lua_State *L, const char* buf, size_t len, int idx);
+static int buf_write(lua_State* L, const char* str, size_t len, mar_Buffer *buf);
 
-static void buf_init(lua_State *L, mar_Buffer *buf)
+static void buf_init_size(lua_State *L, mar_Buffer *buf, size_t size)
 {
-    buf->size = 128;
+    buf->size = size;
     buf->seek = 0;
     buf->head = 0;
+    buf->writer = 0;
+    buf->chunk = 0;
+    buf->total = 0;
+    buf->depth = 0;
+    buf->intern = 0;
+    buf->compress = 0;
     if (!(buf->data = malloc(buf->size))) luaL_error(L, "Out of memory!");
 }
 
-static void buf_done(lua_State* L, mar_Buffer *buf)
+static void buf_init(lua_State *L, mar_Buffer *buf)
 {
-    lua_pushlstring(L, buf->data, buf->head);
-    free(buf->data);
+    buf_init_size(L, buf, MAR_BUFSIZE);
 }
 
-static int buf_write(lua_State* L, const char* str, size_t len, mar_Buffer *buf)
+static void buf_reserve(lua_State *L, mar_Buffer *buf, size_t len)
 {
-    if (len > UINT32_MAX) luaL_error(L, "buffer too long");
     if (buf->size - buf->head < len) {
         size_t new_size = buf->size << 1;
         size_t cur_head = buf->head;
@@ -94,11 +212,351 @@ static int buf_write(lua_State* L, const char* str, size_t len, mar_Buffer *buf)
         }
         buf->size = new_size;
     }
+}
+
+/*
+ * LZ block codec: sequences of a token (literal run length, match
+ * length - 4), extra length bytes, the literals, 16-bit offset of the
+ * match and extra length bytes; the last 5 bytes are literals.
+ */
+#define MAR_LZ_HASHLOG   13
+#define MAR_LZ_MINMATCH  4
+#define MAR_LZ_LASTLIT   5   /* trailing literals */
+#define MAR_LZ_MFLIMIT   12  /* no match starts in the last bytes */
+#define MAR_LZ_MAXOFFSET 65535
+#define MAR_LZ_FRAME     (1 << 20)  /* maximal raw length of frame */
+#define MAR_LZ_HEADER    8
+#define mar_lz_bound(n)  ((n) + (n) / 255 + 16)
+
+static uint32_t lz_read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static unsigned lz_hash(uint32_t v)
+{
+    return (unsigned)((v * 2654435761U) >> (32 - MAR_LZ_HASHLOG));
+}
+
+static unsigned char* lz_putlen(unsigned char *op, size_t len)
+{
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* dst has mar_lz_bound(n) bytes, returns the compressed length */
+static size_t lz_compress(const char *src, size_t n, char *dst)
+{
+    uint32_t table[1 << MAR_LZ_HASHLOG];
+    const unsigned char *const base = (const unsigned char*)src;
+    const unsigned char *const iend = base + n;
+    const unsigned char *ip = base, *anchor = base;
+    unsigned char *op = (unsigned char*)dst;
+    size_t lit;
+
+    memset(table, 0, sizeof(table));
+    if (n > MAR_LZ_MFLIMIT) {
+        const unsigned char *const mflimit = iend - MAR_LZ_MFLIMIT;
+        const unsigned char *const matchlimit = iend - MAR_LZ_LASTLIT;
+
+        ip++;
+        while (ip < mflimit) {
+            const uint32_t seq = lz_read32(ip);
+            const unsigned h = lz_hash(seq);
+            const unsigned char *ref = base + table[h];
+            const unsigned char *mp;
+            unsigned char *token;
+            size_t len, off;
+
+            table[h] = (uint32_t)(ip - base);
+            if (ref >= ip || ip - ref > MAR_LZ_MAXOFFSET
+                    || lz_read32(ref) != seq) {
+                /* skip faster through the incompressible data */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            mp = ip + MAR_LZ_MINMATCH;
+            off = MAR_LZ_MINMATCH;
+            while (mp < matchlimit && *mp == ref[off]) {
+                mp++;
+                off++;
+            }
+
+            lit = ip - anchor;
+            len = mp - ip - MAR_LZ_MINMATCH;
+            token = op++;
+            *token = (unsigned char)((lit < 15 ? lit : 15) << 4);
+            if (lit >= 15) op = lz_putlen(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            off = ip - ref;
+            *op++ = (unsigned char)off;
+            *op++ = (unsigned char)(off >> 8);
+            *token |= (unsigned char)(len < 15 ? len : 15);
+            if (len >= 15) op = lz_putlen(op, len - 15);
+
+            ip = anchor = mp;
+            if (ip < mflimit) {
+                table[lz_hash(lz_read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+            }
+        }
+    }
+    lit = iend - anchor;
+    *op++ = (unsigned char)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15) op = lz_putlen(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - (unsigned char*)dst;
+}
+
+/* returns 0 unless the block decodes to exactly n bytes */
+static int lz_decompress(const char *src, size_t len, char *dst, size_t n)
+{
+    const unsigned char *ip = (const unsigned char*)src;
+    const unsigned char *const iend = ip + len;
+    unsigned char *op = (unsigned char*)dst;
+    unsigned char *const oend = op + n;
+
+    for (;;) {
+        const unsigned char *ref;
+        unsigned token;
+        size_t lit, mlen, off;
+        unsigned char b;
+
+        if (ip >= iend) return 0;
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= iend) return 0;
+                lit += b = *ip++;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return 0;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) return op == oend;
+
+        if (iend - ip < 2) return 0;
+        off = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (!off || off > (size_t)(op - (unsigned char*)dst)) return 0;
+        mlen = token & 15;
+        if (mlen == 15) {
+            do {
+                if (ip >= iend) return 0;
+                mlen += b = *ip++;
+            } while (b == 255);
+        }
+        mlen += MAR_LZ_MINMATCH;
+        if (mlen > (size_t)(oend - op)) return 0;
+        ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        }
+        else {
+            while (mlen--) *op++ = *ref++;
+        }
+    }
+}
+
+static void lz_put32(char *p, size_t v)
+{
+    p[0] = (char)v;
+    p[1] = (char)(v >> 8);
+    p[2] = (char)(v >> 16);
+    p[3] = (char)(v >> 24);
+}
+
+static size_t lz_get32(const char *p)
+{
+    const unsigned char *u = (const unsigned char*)p;
+    return u[0] | ((size_t)u[1] << 8) | ((size_t)u[2] << 16)
+        | ((size_t)u[3] << 24);
+}
+
+/* append the bytes as compressed frames */
+static void buf_frames(lua_State *L, mar_Buffer *out, const char *s,
+                       size_t len)
+{
+    while (len) {
+        const size_t n = len < MAR_LZ_FRAME ? len : MAR_LZ_FRAME;
+        char *hdr;
+        size_t z;
+
+        buf_reserve(L, out, MAR_LZ_HEADER + mar_lz_bound(n));
+        hdr = &out->data[out->head];
+        z = lz_compress(s, n, hdr + MAR_LZ_HEADER);
+        if (z >= n) {
+            memcpy(hdr + MAR_LZ_HEADER, s, n);
+            z = n;
+        }
+        lz_put32(hdr, n);
+        lz_put32(hdr + 4, z);
+        out->head += MAR_LZ_HEADER + z;
+        s += n;
+        len -= n;
+    }
+}
+
+/* push the buffer as a string (compressed) and free it */
+static void buf_done(lua_State* L, mar_Buffer *buf)
+{
+    static const char header[2] = { (char)MAR_MAGIC, MAR_COMPRESSED };
+
+    if (buf->compress) {
+        mar_Buffer z;
+        buf_init_size(L, &z, MAR_LZ_HEADER + mar_lz_bound(buf->head));
+        buf_write(L, header, sizeof(header), &z);
+        buf_frames(L, &z, buf->data, buf->head);
+        free(buf->data);
+        buf->data = z.data;
+        buf->head = z.head;
+    }
+    lua_pushlstring(L, buf->data, buf->head);
+    free(buf->data);
+}
+
+/* pass the buffered bytes to the output stream and reuse the buffer */
+static void buf_flush(lua_State *L, mar_Buffer *buf)
+{
+    static const char header[2] = { (char)MAR_MAGIC, MAR_COMPRESSED };
+    const char *s = buf->data;
+    size_t len = buf->head;
+    mar_Buffer z;
+
+    if (!buf->head) return;
+    z.data = NULL;
+    if (buf->compress) {
+        buf_init_size(L, &z, MAR_LZ_HEADER + mar_lz_bound(len) + 2);
+        if (!buf->total) buf_write(L, header, sizeof(header), &z);
+        buf_frames(L, &z, s, len);
+        s = z.data;
+        len = z.head;
+    }
+    if (lua_isfunction(L, buf->writer)) {
+        lua_pushvalue(L, buf->writer);
+        lua_pushlstring(L, s, len);
+        free(z.data);
+        lua_call(L, 1, 0);
+    }
+    else {
+        lua_getfield(L, buf->writer, "write");
+        lua_pushvalue(L, buf->writer);
+        lua_pushlstring(L, s, len);
+        free(z.data);
+        lua_call(L, 2, 2);
+        if (!lua_toboolean(L, -2)) {
+            free(buf->data);
+            buf->data = NULL;
+            luaL_error(L, "marshal write failed: %s",
+                lua_isstring(L, -1) ? lua_tostring(L, -1) : "incomplete");
+        }
+        lua_pop(L, 2);
+    }
+    buf->total += len;
+    buf->head = 0;
+    /* collect the passed chunks to keep memory bounded */
+    lua_gc(L, LUA_GCSTEP, (int)(buf->chunk >> 10));
+}
+
+/* flush by chunks, unless a length prefix is still open */
+static void buf_check_flush(lua_State *L, mar_Buffer *buf)
+{
+    if (buf->writer && !buf->depth && buf->head >= buf->chunk) {
+        buf_flush(L, buf);
+    }
+}
+
+static int buf_write(lua_State* L, const char* str, size_t len, mar_Buffer *buf)
+{
+    if (len > UINT32_MAX) luaL_error(L, "buffer too long");
+    buf_reserve(L, buf, len);
     memcpy(&buf->data[buf->head], str, len);
     buf->head += len;
     return 0;
 }
 
+static void buf_putc(lua_State *L, mar_Buffer *buf, int c)
+{
+    if (buf->head < buf->size) {
+        buf->data[buf->head++] = (char)c;
+    }
+    else {
+        const char ch = (char)c;
+        buf_write(L, &ch, 1, buf);
+    }
+}
+
+static void buf_varint(lua_State *L, mar_Buffer *buf, uint64_t v)
+{
+    char tmp[10];
+    size_t n = 0;
+    while (v >= 0x80) {
+        tmp[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    tmp[n++] = (char)v;
+    buf_write(L, tmp, n, buf);
+}
+
+/* varint to be read backwards from the end of table */
+static void buf_varint_back(lua_State *L, mar_Buffer *buf, uint64_t v)
+{
+    char tmp[10];
+    size_t n = sizeof(tmp);
+    do {
+        tmp[--n] = (char)(v | 0x80);
+        v >>= 7;
+    } while (v);
+    tmp[n] &= 0x7f;  /* the last byte read */
+    buf_write(L, tmp + n, sizeof(tmp) - n, buf);
+}
+
+/* reserve the length prefix of nested value, written in place */
+static size_t buf_open(lua_State *L, mar_Buffer *buf)
+{
+    static const char pad[MAR2_LENPAD];
+    const size_t pos = buf->head;
+    buf_write(L, pad, MAR2_LENPAD, buf);
+    buf->depth++;
+    return pos;
+}
+
+/* back-patch the length prefix with size of the nested value */
+static void buf_close(lua_State *L, mar_Buffer *buf, size_t pos)
+{
+    const size_t len = buf->head - pos - MAR2_LENPAD;
+    unsigned char *p = (unsigned char*)&buf->data[pos];
+
+    if (len <= MAR2_FIXMAX) {
+        /* one byte length: move the short value over the padding */
+        p[0] = (unsigned char)len;
+        memmove(p + 1, p + MAR2_LENPAD, len);
+        buf->head -= MAR2_LENPAD - 1;
+    }
+    else {
+        /* padded varint */
+        uint64_t l = len;
+        int i;
+        if (l >> (7 * MAR2_LENPAD)) luaL_error(L, "buffer too long");
+        for (i = 0; i < MAR2_LENPAD - 1; i++, l >>= 7) {
+            p[i] = (unsigned char)(l | 0x80);
+        }
+        p[i] = (unsigned char)l;
+    }
+    buf->depth--;
+}
+
 static const char* buf_read(lua_State *L, mar_Buffer *buf, size_t *len)
 {
     if (buf->seek < buf->head) {
@@ -110,216 +568,318 @@ static const char* buf_read(lua_State *L, mar_Buffer *buf, size_t *len)
     return NULL;
 }
 
-static void pack_value(lua_State *L, mar_Buffer *buf, int val, int *idx)
+static void pack_number(lua_State *L, mar_Buffer *buf, lua_Number n)
 {
-    size_t l;
-    int val_type = lua_type(L, val);
-    buf_write(L, (void*)&val_type, MAR_CHR, buf);
-    switch (val_type) {
-    case LUA_TBOOLEAN: {
-        int int_val = lua_toboolean(L, val);
-        buf_write(L, (void*)&int_val, MAR_CHR, buf);
-        break;
-    }
-    case LUA_TSTRING: {
-        const char *str_val = lua_tolstring(L, val, &l);
-        buf_write(L, (void*)&l, MAR_I32, buf);
-        buf_write(L, str_val, l, buf);
-        break;
-    }
-    case LUA_TNUMBER: {
-        lua_Number num_val = lua_tonumber(L, val);
-        buf_write(L, (void*)&num_val, MAR_I64, buf);
-        break;
+    static const lua_Number zero = 0;
+
+    if (n >= -MAR2_INTMAX && n <= MAR2_INTMAX && n == (lua_Number)(int64_t)n
+        && (n != 0 || !memcmp(&n, &zero, sizeof(n)))) {
+        const int64_t i = (int64_t)n;
+        if (i >= 0 && i <= MAR2_FIXMAX) {
+            buf_putc(L, buf, MAR2_FIXINT + (int)i);
+        }
+        else if (i < 0 && i >= MAR2_NEGMIN) {
+            buf_putc(L, buf, MAR2_NEGINT + (int)(i - MAR2_NEGMIN));
+        }
+        else if (i > 0) {
+            buf_putc(L, buf, MAR2_UINT);
+            buf_varint(L, buf, (uint64_t)i);
+        }
+        else {
+            buf_putc(L, buf, MAR2_NINT);
+            buf_varint(L, buf, (uint64_t)-(i + 1));
+        }
     }
-    case LUA_TTABLE: {
-        int tag, ref;
-        lua_pushvalue(L, val);
-        lua_rawget(L, 2);
-        if (!lua_isnil(L, -1)) {
-            ref = lua_tointeger(L, -1);
-            tag = MAR_TREF;
-            buf_write(L, (void*)&tag, MAR_CHR, buf);
-            buf_write(L, (void*)&ref, MAR_I32, buf);
-            lua_pop(L, 1);
+    else {
+        char tmp[1 + MAR_I64];
+        uint64_t u;
+        int i;
+        tmp[0] = (char)MAR2_DOUBLE;
+        if (MAR_LITTLE_ENDIAN) {
+            memcpy(&tmp[1], &n, MAR_I64);
         }
         else {
-            mar_Buffer rec_buf;
-            const char* rec_packed;
-            size_t rec_l;
-            lua_pop(L, 1);
-            if (luaL_getmetafield(L, val, "__persist")) {
-                tag = MAR_TUSR;
-
-                lua_pushvalue(L, val-1);
-                lua_pushinteger(L, (*idx)++);
-                lua_rawset(L, 2);
-
-                lua_pushvalue(L, val-1);
-                lua_call(L, 1, 1);
-                if (!lua_isfunction(L, -1)) {
-                    luaL_error(L, "__persist must return a function");
-                }
-                lua_newtable(L);
-                lua_pushvalue(L, -2);
-                lua_rawseti(L, -2, 1);
-                lua_remove(L, -2);
-
-                buf_init(L, &rec_buf);
-                mar_pack(L, &rec_buf, *idx);
-                buf_done(L, &rec_buf);
-
-                rec_packed = lua_tolstring(L, -1, &rec_l);
-                buf_write(L, (void*)&tag, MAR_CHR, buf);
-                buf_write(L, (void*)&rec_l, MAR_I32, buf);
-                buf_write(L, rec_packed, rec_l, buf);
-                lua_pop(L, 2);
+            memcpy(&u, &n, MAR_I64);
+            for (i = 1; i <= MAR_I64; i++, u >>= 8) {
+                tmp[i] = (char)u;
             }
-            else {
-                tag = MAR_TVAL;
+        }
+        buf_write(L, tmp, sizeof(tmp), buf);
+    }
+}
 
-                lua_pushvalue(L, val);
-                lua_pushinteger(L, (*idx)++);
-                lua_rawset(L, 2);
+/* write the back-reference to already seen value */
+static int pack_ref(lua_State *L, mar_Buffer *buf, int val)
+{
+    int found;
+    lua_pushvalue(L, val);
+    lua_rawget(L, 2);
+    found = !lua_isnil(L, -1);
+    if (found) {
+        buf_putc(L, buf, MAR2_REF);
+        buf_varint(L, buf, (uint64_t)lua_tointeger(L, -1));
+    }
+    lua_pop(L, 1);
+    return found;
+}
 
-                lua_pushvalue(L, val);
-                buf_init(L, &rec_buf);
-                mar_pack(L, &rec_buf, *idx);
-                buf_done(L, &rec_buf);
-
-                rec_packed = lua_tolstring(L, -1, &rec_l);
-                buf_write(L, (void*)&tag, MAR_CHR, buf);
-                buf_write(L, (void*)&rec_l, MAR_I32, buf);
-                buf_write(L, rec_packed, rec_l, buf);
-                lua_pop(L, 2);
-            }
-        }
-        break;
+static void set_ref(lua_State *L, int val, int *idx)
+{
+    lua_pushvalue(L, val);
+    lua_pushinteger(L, (*idx)++);
+    lua_rawset(L, 2);
+}
+
+static void pack_value(lua_State *L, mar_Buffer *buf, int val, int *idx);
+
+/* registry key of schemas: metatable -> schema, name -> schema */
+static char mar_schemas;
+
+enum {
+    MAR_SCHEMA_NAME = 1,
+    MAR_SCHEMA_META,   /* metatable of records */
+    MAR_SCHEMA_KEYS,   /* keys of fields in order */
+    MAR_SCHEMA_TYPES,  /* Lua types of fields (LUA_TNONE: any) or nil */
+    MAR_SCHEMA_INDEX   /* key of field -> position */
+};
+
+static void mar_pushschemas(lua_State *L)
+{
+    lua_pushlightuserdata(L, &mar_schemas);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+}
+
+/* push the schema of table at index, if its metatable has one */
+static int mar_getschema(lua_State *L, int val)
+{
+    if (!lua_getmetatable(L, val)) return 0;
+    mar_pushschemas(L);
+    lua_insert(L, -2);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
     }
-    case LUA_TFUNCTION: {
-        int tag, ref;
-        lua_pushvalue(L, val);
-        lua_rawget(L, 2);
-        if (!lua_isnil(L, -1)) {
-            ref = lua_tointeger(L, -1);
-            tag = MAR_TREF;
-            buf_write(L, (void*)&tag, MAR_CHR, buf);
-            buf_write(L, (void*)&ref, MAR_I32, buf);
-            lua_pop(L, 1);
+    return 1;
+}
+
+/* the schema of record at val is on the stack top */
+static void pack_record(lua_State *L, mar_Buffer *buf, int val, int *idx)
+{
+    const int schema = lua_gettop(L);
+    const int types = schema + 1, index = schema + 2, fields = schema + 3;
+    int n, i;
+
+    lua_rawgeti(L, schema, MAR_SCHEMA_TYPES);
+    lua_rawgeti(L, schema, MAR_SCHEMA_INDEX);
+    lua_rawgeti(L, schema, MAR_SCHEMA_KEYS);
+    n = (int)lua_objlen(L, -1);
+    lua_pop(L, 1);
+    luaL_checkstack(L, n + LUA_MINSTACK, "table too deep to marshal");
+    lua_settop(L, fields + n - 1);
+
+    /* the name is interned always */
+    buf_putc(L, buf, MAR2_RECORD);
+    lua_rawgeti(L, schema, MAR_SCHEMA_NAME);
+    if (!pack_ref(L, buf, fields + n)) {
+        size_t l;
+        const char *name = lua_tolstring(L, fields + n, &l);
+        set_ref(L, fields + n, idx);
+        buf_putc(L, buf, MAR2_ISTR);
+        buf_varint(L, buf, l);
+        buf_write(L, name, l, buf);
+    }
+
+    /* collect the fields, write other pairs in one traversal */
+    lua_pushnil(L);
+    while (lua_next(L, val)) {
+        lua_pushvalue(L, -2);
+        lua_rawget(L, index);
+        i = (int)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if (i) {
+            lua_replace(L, fields + i - 1);
         }
         else {
-            mar_Buffer rec_buf;
-            const char* rec_packed;
-            size_t rec_l;
-            int i;
-            lua_Debug ar;
+            const int top = lua_gettop(L);
+            pack_value(L, buf, top - 1, idx);
+            pack_value(L, buf, top, idx);
             lua_pop(L, 1);
+        }
+    }
+    buf_putc(L, buf, MAR2_NIL);
 
-            tag = MAR_TVAL;
-            lua_pushvalue(L, val);
-            lua_pushinteger(L, (*idx)++);
-            lua_rawset(L, 2);
+    for (i = 0; i < n; i++) {
+        const int field = fields + i;
+        if (!lua_isnil(L, field) && !lua_isnil(L, types)) {
+            int type;
+            lua_rawgeti(L, types, i + 1);
+            type = (int)lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            if (type != LUA_TNONE && type != lua_type(L, field)) {
+                luaL_error(L, "field %d of '%s' must be %s, got %s", i + 1,
+                    lua_tostring(L, fields + n), lua_typename(L, type),
+                    luaL_typename(L, field));
+            }
+        }
+        pack_value(L, buf, field, idx);
+    }
+    lua_settop(L, schema - 1);
+}
 
-            lua_pushvalue(L, val);
-            buf_init(L, &rec_buf);
-            lua_dump(L, (lua_Writer)buf_write, &rec_buf);
-            buf_done(L, &rec_buf);
-            rec_packed = lua_tolstring(L, -1, &rec_l);
+/* the __persist metamethod is on the stack top */
+static void pack_persist(lua_State *L, mar_Buffer *buf, int val, int *idx)
+{
+    lua_pushvalue(L, val);
+    lua_call(L, 1, 1);
+    if (!lua_isfunction(L, -1)) {
+        luaL_error(L, "__persist must return a function");
+    }
+    buf_putc(L, buf, MAR2_PERSIST);
+    pack_value(L, buf, lua_gettop(L), idx);
+    lua_pop(L, 1);
+}
 
-            buf_write(L, (void*)&tag, MAR_CHR, buf);
-            buf_write(L, (void*)&rec_l, MAR_I32, buf);
-            buf_write(L, rec_packed, rec_l, buf);
-            lua_pop(L, 2);
+static void pack_function(lua_State *L, mar_Buffer *buf, int val, int *idx)
+{
+    size_t rec_pos;
+    int i;
+    lua_Debug ar;
 
-            lua_pushvalue(L, val);
-            lua_getinfo(L, ">uS", &ar);
-            if (ar.what[0] != 'L') {
-                luaL_error(L, "attempt to persist a C function");
-            }
+    lua_pushvalue(L, val);
+    lua_getinfo(L, ">uS", &ar);
+    if (ar.what[0] != 'L') {
+        luaL_error(L, "attempt to persist a C function");
+    }
 
-            lua_newtable(L);
-            for (i=1; i <= ar.nups; i++) {
-                lua_getupvalue(L, -2, i);
-                lua_rawseti(L, -2, i);
-            }
+    buf_putc(L, buf, MAR2_FUNC);
+    rec_pos = buf_open(L, buf);
+    lua_pushvalue(L, val);
+    lua_dump(L, (lua_Writer)buf_write, buf);
+    buf_close(L, buf, rec_pos);
+    lua_pop(L, 1);
 
-            buf_init(L, &rec_buf);
-            mar_pack(L, &rec_buf, *idx);
-            buf_done(L, &rec_buf);
-            rec_packed = lua_tolstring(L, -1, &rec_l);
+    buf_varint(L, buf, ar.nups);
+    for (i = 1; i <= ar.nups; i++) {
+        lua_getupvalue(L, val, i);
+        pack_value(L, buf, lua_gettop(L), idx);
+        lua_pop(L, 1);
+    }
+}
 
-            buf_write(L, (void*)&rec_l, MAR_I32, buf);
-            buf_write(L, rec_packed, rec_l, buf);
-            lua_pop(L, 2);
+static void pack_value(lua_State *L, mar_Buffer *buf, int val, int *idx)
+{
+    switch (lua_type(L, val)) {
+    case LUA_TBOOLEAN:
+        buf_putc(L, buf, lua_toboolean(L, val) ? MAR2_TRUE : MAR2_FALSE);
+        break;
+    case LUA_TSTRING: {
+        size_t l;
+        const char *str_val = lua_tolstring(L, val, &l);
+        if (buf->intern && l >= buf->intern) {
+            if (pack_ref(L, buf, val)) break;
+            set_ref(L, val, idx);
+            buf_putc(L, buf, MAR2_ISTR);
+            buf_varint(L, buf, l);
         }
-
+        else if (l <= MAR2_STRMAX) {
+            buf_putc(L, buf, MAR2_FIXSTR + (int)l);
+        }
+        else {
+            buf_putc(L, buf, MAR2_STR);
+            buf_varint(L, buf, l);
+        }
+        buf_write(L, str_val, l, buf);
         break;
     }
-    case LUA_TUSERDATA: {
-        int tag, ref;
-        lua_pushvalue(L, val);
-        lua_rawget(L, 2);
-        if (!lua_isnil(L, -1)) {
-            ref = lua_tointeger(L, -1);
-            tag = MAR_TREF;
-            buf_write(L, (void*)&tag, MAR_CHR, buf);
-            buf_write(L, (void*)&ref, MAR_I32, buf);
-            lua_pop(L, 1);
+    case LUA_TNUMBER:
+        pack_number(L, buf, lua_tonumber(L, val));
+        break;
+    case LUA_TTABLE:
+        if (!pack_ref(L, buf, val)) {
+            set_ref(L, val, idx);
+            if (luaL_getmetafield(L, val, "__persist")) {
+                pack_persist(L, buf, val, idx);
+            }
+            else if (mar_getschema(L, val)) {
+                pack_record(L, buf, val, idx);
+            }
+            else {
+                size_t rec_pos;
+                buf_putc(L, buf, MAR2_TABLE);
+                rec_pos = buf_open(L, buf);
+                lua_pushvalue(L, val);
+                mar_pack(L, buf, idx);
+                buf_close(L, buf, rec_pos);
+                lua_pop(L, 1);
+            }
         }
-        else {
-            mar_Buffer rec_buf;
-            const char* rec_packed;
-            size_t rec_l;
-            lua_pop(L, 1);
+        break;
+    case LUA_TFUNCTION:
+        if (!pack_ref(L, buf, val)) {
+            set_ref(L, val, idx);
+            pack_function(L, buf, val, idx);
+        }
+        break;
+    case LUA_TUSERDATA:
+        if (!pack_ref(L, buf, val)) {
             if (luaL_getmetafield(L, val, "__persist")) {
-                tag = MAR_TUSR;
-
-                lua_pushvalue(L, val-1);
-                lua_pushinteger(L, (*idx)++);
-                lua_rawset(L, 2);
-
-                lua_pushvalue(L, val-1);
-                lua_call(L, 1, 1);
-                if (!lua_isfunction(L, -1)) {
-                    luaL_error(L, "__persist must return a function");
-                }
-                lua_newtable(L);
-                lua_pushvalue(L, -2);
-                lua_rawseti(L, -2, 1);
-                lua_remove(L, -2);
-
-                buf_init(L, &rec_buf);
-                mar_pack(L, &rec_buf, *idx);
-                buf_done(L, &rec_buf);
-
-                rec_packed = lua_tolstring(L, -1, &rec_l);
-                buf_write(L, (void*)&tag, MAR_CHR, buf);
-                buf_write(L, (void*)&rec_l, MAR_I32, buf);
-                buf_write(L, rec_packed, rec_l, buf);
-                lua_pop(L, 2);
+                set_ref(L, val, idx);
+                pack_persist(L, buf, val, idx);
             }
             else {
-                tag = MAR_TVAL;
-                buf_write(L, (void*)&tag, MAR_CHR, buf);
+                buf_putc(L, buf, MAR2_NIL);
             }
         }
         break;
-    }
-    case LUA_TTHREAD: break; /* just give them a nil during unpack */
+    case LUA_TNIL:
+    case LUA_TTHREAD: /* just give them a nil during unpack */
+        buf_putc(L, buf, MAR2_NIL);
+        break;
     default:
         luaL_error(L, "invalid value type");
     }
 }
 
-static int mar_pack(lua_State *L, mar_Buffer *buf, int idx)
+/* is the key at index in the array segment 1..narr? */
+static int mar_isindex(lua_State *L, int key, size_t narr)
+{
+    lua_Number n;
+    if (!narr || lua_type(L, key) != LUA_TNUMBER) return 0;
+    n = lua_tonumber(L, key);
+    return n >= 1 && n <= narr && n == (lua_Number)(size_t)n;
+}
+
+static int mar_pack(lua_State *L, mar_Buffer *buf, int *idx)
 {
-    /* size_t l; */
+    const int t = lua_gettop(L);
+    const size_t narr = lua_objlen(L, t);
+    const int idx0 = *idx;
+    size_t nrec = 0, i;
+
+    luaL_checkstack(L, LUA_MINSTACK, "table too deep to marshal");
+    buf_varint(L, buf, narr);
+
+    for (i = 1; i <= narr; i++) {
+        lua_rawgeti(L, t, (int)i);
+        pack_value(L, buf, t + 1, idx);
+        lua_pop(L, 1);
+        buf_check_flush(L, buf);
+    }
+
     lua_pushnil(L);
-    while (lua_next(L, -2) != 0) {
-        pack_value(L, buf, -2, &idx);
-        pack_value(L, buf, -1, &idx);
+    while (lua_next(L, t) != 0) {
+        if (!mar_isindex(L, t + 1, narr)) {
+            pack_value(L, buf, t + 1, idx);
+            pack_value(L, buf, t + 2, idx);
+            buf_check_flush(L, buf);
+            nrec++;
+        }
         lua_pop(L, 1);
     }
+    buf_varint_back(L, buf, *idx - idx0);
+    buf_varint_back(L, buf, nrec);
     return 1;
 }
 
@@ -330,7 +890,7 @@ static int mar_pack(lua_State *L, mar_Buffer *buf, int idx)
     if (((*p)-buf)+sizeof(T) > len) luaL_error(L, "bad code"); \
     l = *(T*)*p; (*p) += sizeof(T);
 
-static void unpack_value
+static void unpack_value_v1
     (lua_State *L, const char *buf, size_t len, const char **p, int *idx)
 {
     size_t l;
@@ -363,13 +923,13 @@ static void unpack_value
             lua_newtable(L);
             lua_pushvalue(L, -1);
             lua_rawseti(L, 2, (*idx)++);
-            mar_unpack(L, *p, l, *idx);
+            mar_unpack_v1(L, *p, l, *idx);
             mar_incr_ptr(l);
         }
         else if (tag == MAR_TUSR) {
             mar_next_len(l, uint32_t);
             lua_newtable(L);
-            mar_unpack(L, *p, l, *idx);
+            mar_unpack_v1(L, *p, l, *idx);
             lua_rawgeti(L, -1, 1);
             lua_call(L, 0, 1);
             lua_remove(L, -2);
@@ -407,7 +967,7 @@ static void unpack_value
 
             mar_next_len(l, uint32_t);
             lua_newtable(L);
-            mar_unpack(L, *p, l, *idx);
+            mar_unpack_v1(L, *p, l, *idx);
             nups = lua_objlen(L, -1);
             for (i=1; i <= nups; i++) {
                 lua_rawgeti(L, -1, i);
@@ -429,7 +989,7 @@ static void unpack_value
         else if (tag == MAR_TUSR) {
             mar_next_len(l, uint32_t);
             lua_newtable(L);
-            mar_unpack(L, *p, l, *idx);
+            mar_unpack_v1(L, *p, l, *idx);
             lua_rawgeti(L, -1, 1);
             lua_call(L, 0, 1);
             lua_remove(L, -2);
@@ -450,50 +1010,1220 @@ static void unpack_value
     }
 }
 
-static int mar_unpack(lua_State *L, const char* buf, size_t len, int idx)
+static int mar_unpack_v1(lua_State *L, const char* buf, size_t len, int idx)
 {
     const char* p;
 
+    luaL_checkstack(L, LUA_MINSTACK, "table too deep to unmarshal");
     p = buf;
     while (p - buf < len) {
-        unpack_value(L, buf, len, &p, &idx);
-        unpack_value(L, buf, len, &p, &idx);
+        unpack_value_v1(L, buf, len, &p, &idx);
+        unpack_value_v1(L, buf, len, &p, &idx);
         lua_settable(L, -3);
     }
     return 1;
 }
 
-static int tbl_marshal(lua_State* L)
+static uint64_t unpack_varint(lua_State *L, const char **p, const char *end)
 {
-    int x = 1;
-    int e = *(char*)&x;
-    const unsigned char m = MAR_MAGIC;
-    mar_Buffer buf;
-    lua_newtable(L);
-    lua_pushvalue(L, 1);
+    const unsigned char *s = (const unsigned char*)*p;
+    uint64_t v = 0;
+    int shift = 0;
 
-    buf_init(L, &buf);
-    buf_write(L, (void*)&m, 1, &buf);
-    buf_write(L, (void*)&e, 1, &buf);
-    mar_pack(L, &buf, 1);
+    if (end - *p >= 10) {
+        /* enough bytes for the longest varint, skip bounds checks */
+        do {
+            v |= (uint64_t)(*s & 0x7f) << shift;
+            shift += 7;
+        } while ((*s++ & 0x80) && shift < 70);
+        if (shift >= 70) luaL_error(L, "bad code");
+        *p = (const char*)s;
+        return v;
+    }
+    for (;;) {
+        unsigned char c;
+        if (*p >= end || shift > 63) luaL_error(L, "bad code");
+        c = (unsigned char)*(*p)++;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return v;
+        shift += 7;
+    }
+}
 
-    buf_done(L, &buf);
-    return 1;
+static uint64_t unpack_varint_back
+    (lua_State *L, const char *p, const char **end)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    for (;;) {
+        unsigned char c;
+        if (*end <= p || shift > 63) luaL_error(L, "bad code");
+        c = (unsigned char)*--(*end);
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return v;
+        shift += 7;
+    }
 }
 
-static int tbl_unmarshal(lua_State* L)
+static size_t unpack_len(lua_State *L, const char **p, const char *end)
 {
-    int x = 1;
-    size_t l;
-    const char *s = luaL_checklstring(L, -1, &l);
+    const uint64_t l = unpack_varint(L, p, end);
+    if (l > (uint64_t)(end - *p)) luaL_error(L, "bad code");
+    return (size_t)l;
+}
 
-    if (l < 2) luaL_error(L, "bad header");
-    if (*(unsigned char *)s++ != MAR_MAGIC) luaL_error(L, "bad magic");
-    l -= 2;
+static void unpack_value
+    (lua_State *L, const char **p, const char *end, int *idx, int lazy);
+static void unpack_lazy
+    (lua_State *L, const char *p, const char *end, int *idx, int lazy);
+static void unpack_lazy_ref(lua_State *L, int ref, int lazy);
+
+/* tables, functions and persisted values */
+static void unpack_object
+    (lua_State *L, int tag, const char **p, const char *end, int *idx,
+     int lazy)
+{
+    size_t l;
+
+    switch (tag) {
+    case MAR2_REF: {
+        const int ref = (int)unpack_varint(L, p, end);
+        lua_rawgeti(L, 2, ref);
+        if (lazy && lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            unpack_lazy_ref(L, ref, lazy);
+        }
+        break;
+    }
+    case MAR2_TABLE:
+        l = unpack_len(L, p, end);
+        if (lazy) {
+            unpack_lazy(L, *p, *p + l, idx, lazy);
+        }
+        else {
+            mar_unpack(L, *p, *p + l, idx, 0);
+        }
+        *p += l;
+        break;
+    case MAR2_RECORD: {
+        const int ref = (*idx)++;
+        size_t n, i;
+        int t;
+
+        luaL_checkstack(L, LUA_MINSTACK, "table too deep to unmarshal");
+        unpack_value(L, p, end, idx, lazy);
+        mar_pushschemas(L);
+        lua_pushvalue(L, -2);
+        lua_rawget(L, -2);
+        if (!lua_istable(L, -1)) {
+            luaL_error(L, "unknown schema '%s'",
+                lua_isstring(L, -3) ? lua_tostring(L, -3) : "?");
+        }
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+
+        /* schema, keys, record */
+        lua_rawgeti(L, -1, MAR_SCHEMA_KEYS);
+        n = lua_objlen(L, -1);
+        lua_createtable(L, 0, (int)n);
+        lua_rawgeti(L, -3, MAR_SCHEMA_META);
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, 2, ref);
+        t = lua_gettop(L);
+
+        for (;;) {
+            unpack_value(L, p, end, idx, lazy);
+            if (lua_isnil(L, -1)) break;
+            unpack_value(L, p, end, idx, lazy);
+            lua_rawset(L, t);
+        }
+        lua_pop(L, 1);
+        for (i = 1; i <= n; i++) {
+            unpack_value(L, p, end, idx, lazy);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+            }
+            else {
+                lua_rawgeti(L, t - 1, (int)i);
+                lua_insert(L, -2);
+                lua_rawset(L, t);
+            }
+        }
+        lua_replace(L, t - 2);
+        lua_pop(L, 1);
+        break;
+    }
+    case MAR2_PERSIST: {
+        const int ref = (*idx)++;
+        unpack_value(L, p, end, idx, lazy);
+        if (!lua_isfunction(L, -1)) luaL_error(L, "bad code");
+        lua_call(L, 0, 1);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, 2, ref);
+        break;
+    }
+    case MAR2_FUNC: {
+        mar_Buffer dec_buf;
+        size_t nups, i;
+
+        l = unpack_len(L, p, end);
+        dec_buf.data = (char*)*p;
+        dec_buf.size = l;
+        dec_buf.head = l;
+        dec_buf.seek = 0;
+        if (lua_load(L, (lua_Reader)buf_read, &dec_buf, "=marshal")) {
+            lua_error(L);
+        }
+        *p += l;
+
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, 2, (*idx)++);
+
+        nups = (size_t)unpack_varint(L, p, end);
+        for (i = 1; i <= nups; i++) {
+            unpack_value(L, p, end, idx, lazy);
+            if (!lua_setupvalue(L, -2, (int)i)) lua_pop(L, 1);
+        }
+        break;
+    }
+    default:
+        luaL_error(L, "bad code");
+    }
+}
+
+static void unpack_value
+    (lua_State *L, const char **p, const char *end, int *idx, int lazy)
+{
+    const char *s = *p;
+    size_t l;
+    int tag;
+
+    if (s >= end) luaL_error(L, "bad code");
+    tag = (unsigned char)*s++;
+
+    if (tag <= MAR2_FIXMAX) {
+        lua_pushnumber(L, tag - MAR2_FIXINT);
+    }
+    else if (tag >= MAR2_NEGINT) {
+        lua_pushnumber(L, tag - MAR2_NEGINT + MAR2_NEGMIN);
+    }
+    else if (tag <= MAR2_FIXSTR + MAR2_STRMAX) {
+        l = tag - MAR2_FIXSTR;
+        if (l > (size_t)(end - s)) luaL_error(L, "bad code");
+        lua_pushlstring(L, s, l);
+        s += l;
+    }
+    else switch (tag) {
+    case MAR2_FALSE:
+    case MAR2_TRUE:
+        lua_pushboolean(L, tag == MAR2_TRUE);
+        break;
+    case MAR2_UINT:
+        lua_pushnumber(L, (lua_Number)(int64_t)unpack_varint(L, &s, end));
+        break;
+    case MAR2_NINT:
+        lua_pushnumber(L, -1 - (lua_Number)(int64_t)unpack_varint(L, &s, end));
+        break;
+    case MAR2_DOUBLE: {
+        lua_Number n;
+        if (end - s < MAR_I64) luaL_error(L, "bad code");
+        if (MAR_LITTLE_ENDIAN) {
+            memcpy(&n, s, MAR_I64);
+        }
+        else {
+            uint64_t u = 0;
+            int i;
+            for (i = MAR_I64; i--; ) {
+                u = (u << 8) | (unsigned char)s[i];
+            }
+            memcpy(&n, &u, MAR_I64);
+        }
+        lua_pushnumber(L, n);
+        s += MAR_I64;
+        break;
+    }
+    case MAR2_STR:
+        l = unpack_len(L, &s, end);
+        lua_pushlstring(L, s, l);
+        s += l;
+        break;
+    case MAR2_ISTR:
+        l = unpack_len(L, &s, end);
+        lua_pushlstring(L, s, l);
+        s += l;
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, 2, (*idx)++);
+        break;
+    case MAR2_NIL:
+        lua_pushnil(L);
+        break;
+    default:
+        *p = s;
+        unpack_object(L, tag, p, end, idx, lazy);
+        return;
+    }
+    *p = s;
+}
+
+/* fill the table on stack top with array segment and pairs */
+static void unpack_fill(lua_State *L, const char *p, const char *end,
+                        uint64_t narr, int *idx, int lazy)
+{
+    uint64_t i;
+
+    for (i = 1; i <= narr; i++) {
+        unpack_value(L, &p, end, idx, lazy);
+        lua_rawseti(L, -2, (int)i);
+    }
+    while (p < end) {
+        unpack_value(L, &p, end, idx, lazy);
+        unpack_value(L, &p, end, idx, lazy);
+        if (lua_isnil(L, -2)) {
+            lua_pop(L, 2);  /* key was userdata without __persist */
+        }
+        else {
+            lua_rawset(L, -3);
+        }
+    }
+}
+
+/* read the sizes of table, leave the end of pairs in *end */
+static uint64_t unpack_sizes(lua_State *L, const char **p, const char **end,
+                             uint64_t *nrec, uint64_t *nref)
+{
+    uint64_t narr;
+
+    *nrec = unpack_varint_back(L, *p, end);
+    *nref = unpack_varint_back(L, *p, end);
+    narr = unpack_varint(L, p, *end);
+    if (narr > (uint64_t)(*end - *p) || *nrec > (uint64_t)(*end - *p) / 2
+        || *nref > (uint64_t)(*end - *p)) {
+        luaL_error(L, "bad code");
+    }
+    return narr;
+}
+
+/* push the presized table, registered as the next reference */
+static int mar_unpack
+    (lua_State *L, const char *p, const char *end, int *idx, int lazy)
+{
+    uint64_t narr, nrec, nref;
+
+    luaL_checkstack(L, LUA_MINSTACK, "table too deep to unmarshal");
+    narr = unpack_sizes(L, &p, &end, &nrec, &nref);
+    lua_createtable(L, (int)narr, (int)nrec);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, 2, (*idx)++);
+
+    unpack_fill(L, p, end, narr, idx, lazy);
+    return 1;
+}
+
+/* lazy state: the stream with placeholder tables pending to be filled */
+enum {
+    MAR_LAZY_SOURCE = 1,  /* string or sys.mem object to keep alive */
+    MAR_LAZY_REFS,        /* the refs table */
+    MAR_LAZY_META,        /* metatable of placeholders */
+    MAR_LAZY_PTR          /* start of the stream (light userdata) */
+};
+
+/* push the placeholder of nested table, its references are skipped */
+static void unpack_lazy
+    (lua_State *L, const char *p, const char *end, int *idx, int lazy)
+{
+    const char *s = p, *e = end;
+    const char *base;
+    uint64_t nrec, nref;
+
+    unpack_sizes(L, &s, &e, &nrec, &nref);
+
+    lua_rawgeti(L, lazy, MAR_LAZY_PTR);
+    base = lua_touserdata(L, -1);
+    lua_pop(L, 1);
 
     lua_newtable(L);
+    lua_rawgeti(L, lazy, MAR_LAZY_META);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, 2, *idx);
+
+    /* pending: placeholder -> {offset, length, reference} */
+    lua_pushvalue(L, -1);
+    lua_createtable(L, 3, 0);
+    lua_pushnumber(L, (lua_Number)(p - base));
+    lua_rawseti(L, -2, 1);
+    lua_pushnumber(L, (lua_Number)(end - p));
+    lua_rawseti(L, -2, 2);
+    lua_pushinteger(L, *idx);
+    lua_rawseti(L, -2, 3);
+    lua_rawset(L, lazy);
+
+    *idx += 1 + (int)nref;
+}
+
+/* fill the placeholder at index t, if it is pending */
+static void unpack_materialize(lua_State *L, int t, int lazy)
+{
+    const char *p, *end;
+    uint64_t narr, nrec, nref;
+    size_t pos, len;
+    int idx;
+
+    lua_pushvalue(L, t);
+    lua_rawget(L, lazy);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    lua_rawgeti(L, -3, 3);
+    pos = (size_t)lua_tonumber(L, -3);
+    len = (size_t)lua_tonumber(L, -2);
+    idx = lua_tointeger(L, -1) + 1;
+    lua_pop(L, 4);
+
+    lua_pushvalue(L, t);
+    lua_pushnil(L);
+    lua_rawset(L, lazy);
+    lua_pushnil(L);
+    lua_setmetatable(L, t);
+
+    lua_rawgeti(L, lazy, MAR_LAZY_PTR);
+    p = (const char*)lua_touserdata(L, -1) + pos;
+    end = p + len;
+    lua_pop(L, 1);
+
+    luaL_checkstack(L, LUA_MINSTACK, "table too deep to unmarshal");
+    narr = unpack_sizes(L, &p, &end, &nrec, &nref);
+    lua_pushvalue(L, t);
+    unpack_fill(L, p, end, narr, &idx, lazy);
+    lua_pop(L, 1);
+}
+
+/* push the referenced value from inside of pending placeholder */
+static void unpack_lazy_ref(lua_State *L, int ref, int lazy)
+{
+    for (;;) {
+        int i = ref;
+
+        lua_rawgeti(L, 2, ref);
+        if (!lua_isnil(L, -1)) return;
+        lua_pop(L, 1);
+
+        /* references are numbered in pre-order: the nearest registered
+           below is the innermost placeholder containing the value */
+        for (;;) {
+            if (--i <= 0) {
+                lua_pushnil(L);
+                return;
+            }
+            lua_rawgeti(L, 2, i);
+            if (!lua_isnil(L, -1)) break;
+            lua_pop(L, 1);
+        }
+
+        lua_pushvalue(L, -1);
+        lua_rawget(L, lazy);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 2);
+            lua_pushnil(L);
+            return;
+        }
+        lua_pop(L, 1);
+        unpack_materialize(L, lua_gettop(L), lazy);
+        lua_pop(L, 1);
+    }
+}
+
+/* Arguments: placeholder, key */
+static int lazy_index(lua_State *L)
+{
+    lua_settop(L, 2);
+    lua_rawgeti(L, lua_upvalueindex(1), MAR_LAZY_REFS);
+    lua_insert(L, 2);  /* the refs table must be at index 2 */
+    unpack_materialize(L, 1, lua_upvalueindex(1));
+    lua_rawget(L, 1);
+    return 1;
+}
+
+/* Arguments: placeholder, key, value */
+static int lazy_newindex(lua_State *L)
+{
+    lua_settop(L, 3);
+    lua_rawgeti(L, lua_upvalueindex(1), MAR_LAZY_REFS);
+    lua_insert(L, 2);
+    unpack_materialize(L, 1, lua_upvalueindex(1));
+    lua_rawset(L, 1);
+    return 0;
+}
+
+/* Arguments: placeholder */
+static int lazy_pairs(lua_State *L)
+{
+    lua_settop(L, 1);
+    lua_rawgeti(L, lua_upvalueindex(1), MAR_LAZY_REFS);
+    unpack_materialize(L, 1, lua_upvalueindex(1));
+    lua_getglobal(L, "next");
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+/* push the lazy state for stream at index */
+static void unpack_lazy_state(lua_State *L, int src, const char *ptr)
+{
+    static const luaL_reg meta[] = {
+        {"__index",     lazy_index},
+        {"__newindex",  lazy_newindex},
+        {"__pairs",     lazy_pairs},
+        {NULL,          NULL}
+    };
+    const luaL_reg *reg;
+
+    lua_createtable(L, 4, 0);
+    lua_pushvalue(L, src);
+    lua_rawseti(L, -2, MAR_LAZY_SOURCE);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, MAR_LAZY_REFS);
+    lua_pushlightuserdata(L, (void*)ptr);
+    lua_rawseti(L, -2, MAR_LAZY_PTR);
+
+    lua_createtable(L, 0, 3);
+    for (reg = meta; reg->name; reg++) {
+        lua_pushvalue(L, -2);
+        lua_pushcclosure(L, reg->func, 1);
+        lua_setfield(L, -2, reg->name);
+    }
+    lua_rawseti(L, -2, MAR_LAZY_META);
+}
+
+/* the intern option at index: true or minimal length of string */
+static size_t mar_optintern(lua_State *L, int i)
+{
+    lua_Integer n;
+
+    if (lua_isboolean(L, i)) {
+        return lua_toboolean(L, i) ? MAR2_INTERN : 0;
+    }
+    n = luaL_optinteger(L, i, 0);
+    return n > 0 ? (size_t)n : 0;
+}
+
+static int tbl_marshal(lua_State* L)
+{
+    static const char header[2] = { (char)MAR_MAGIC, MAR_VERSION };
+    int idx = 1;
+    const int stream = !lua_isnoneornil(L, 2) && !lua_isnumber(L, 2);
+    size_t hint = luaL_optinteger(L, stream ? 4 : 2, 0);
+    size_t chunk = stream ? luaL_optinteger(L, 3, MAR_CHUNKSIZE) : 0;
+    const size_t intern = mar_optintern(L, stream ? 5 : 3);
+    const int compress = lua_toboolean(L, stream ? 6 : 4);
+    mar_Buffer buf;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (stream && !lua_isfunction(L, 2)) {
+        luaL_argcheck(L, lua_isuserdata(L, 2) || lua_istable(L, 2), 2,
+            "function or stream expected");
+    }
+    if (chunk < MAR_BUFSIZE) chunk = MAR_BUFSIZE;
+    if (stream && hint > chunk) hint = chunk;
+    if (hint < MAR_BUFSIZE) hint = MAR_BUFSIZE;
+
+    /* the refs table must be at index 2 */
+    lua_settop(L, 2);
     lua_newtable(L);
+    lua_insert(L, 2);
+    set_ref(L, 1, &idx);
+    lua_pushvalue(L, 1);
+
+    buf_init_size(L, &buf, hint);
+    buf.intern = intern;
+    buf.compress = compress;
+    if (stream) {
+        buf.writer = 3;
+        buf.chunk = chunk;
+    }
+    buf_write(L, header, sizeof(header), &buf);
+    mar_pack(L, &buf, &idx);
+
+    if (stream) {
+        buf_flush(L, &buf);
+        free(buf.data);
+        lua_pushnumber(L, (lua_Number)buf.total);
+        return 1;
+    }
+    buf_done(L, &buf);
+    return 1;
+}
+
+/* table opened by the incremental encoder */
+typedef struct mar_Frame {
+    size_t narr;  /* size of array segment */
+    size_t i;     /* next index of array segment */
+    size_t nrec;  /* number of pairs written */
+    size_t pos;   /* position of the length prefix */
+    int    idx0;  /* the first reference inside */
+} mar_Frame;
+
+enum {
+    MAR_ENC_READY,
+    MAR_ENC_BUSY,  /* step is running or failed */
+    MAR_ENC_DONE
+};
+
+typedef struct mar_Encoder {
+    mar_Buffer buf;
+    mar_Frame *frames;  /* stack of open tables */
+    int        depth;   /* number of open tables */
+    int        size;    /* size of frames */
+    int        idx;     /* next reference */
+    int        state;
+} mar_Encoder;
+
+/*
+ * Environment of encoder at stack index 3: the refs table, writer and
+ * (table, next key) of every open table.
+ */
+#define MAR_ENC_REFS    1
+#define MAR_ENC_WRITER  2
+#define mar_enc_slot(depth)  (2 * (depth) + 1)
+
+/* open the table at stack top as the next frame, pops it */
+static void enc_open(lua_State *L, mar_Encoder *enc, size_t pos)
+{
+    mar_Frame *f;
+
+    if (enc->depth == enc->size) {
+        const int size = enc->size ? 2 * enc->size : 16;
+        f = realloc(enc->frames, size * sizeof(mar_Frame));
+        if (!f) luaL_error(L, "Out of memory!");
+        enc->frames = f;
+        enc->size = size;
+    }
+    f = &enc->frames[enc->depth++];
+    f->narr = lua_objlen(L, -1);
+    f->i = 1;
+    f->nrec = 0;
+    f->pos = pos;
+    f->idx0 = enc->idx;
+    buf_varint(L, &enc->buf, f->narr);
+
+    lua_rawseti(L, 3, mar_enc_slot(enc->depth));
+}
+
+/* finish the innermost table */
+static void enc_close(lua_State *L, mar_Encoder *enc)
+{
+    mar_Frame *f = &enc->frames[--enc->depth];
+
+    buf_varint_back(L, &enc->buf, enc->idx - f->idx0);
+    buf_varint_back(L, &enc->buf, f->nrec);
+    if (enc->depth) buf_close(L, &enc->buf, f->pos);
 
+    lua_pushnil(L);
+    lua_rawseti(L, 3, mar_enc_slot(enc->depth + 1));
+    lua_pushnil(L);
+    lua_rawseti(L, 3, mar_enc_slot(enc->depth + 1) + 1);
+}
+
+/* pack the value, a nested table is opened as the next frame */
+static void enc_value(lua_State *L, mar_Encoder *enc, int val)
+{
+    mar_Buffer *buf = &enc->buf;
+
+    if (lua_type(L, val) != LUA_TTABLE) {
+        pack_value(L, buf, val, &enc->idx);
+        return;
+    }
+    if (pack_ref(L, buf, val)) return;
+    set_ref(L, val, &enc->idx);
+    if (luaL_getmetafield(L, val, "__persist")) {
+        pack_persist(L, buf, val, &enc->idx);
+    }
+    else if (mar_getschema(L, val)) {
+        pack_record(L, buf, val, &enc->idx);
+    }
+    else {
+        buf_putc(L, buf, MAR2_TABLE);
+        lua_pushvalue(L, val);
+        enc_open(L, enc, buf_open(L, buf));
+    }
+}
+
+/*
+ * Arguments: table, [writer (function | stream), chunk_size (number),
+ *	intern (boolean | number), compress (boolean)]
+ * Returns: encoder_udata
+ */
+static int tbl_encoder(lua_State* L)
+{
+    static const char header[2] = { (char)MAR_MAGIC, MAR_VERSION };
+    const int stream = !lua_isnoneornil(L, 2);
+    size_t chunk = luaL_optinteger(L, 3, MAR_CHUNKSIZE);
+    const size_t intern = mar_optintern(L, 4);
+    const int compress = lua_toboolean(L, 5);
+    mar_Encoder *enc;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (stream && !lua_isfunction(L, 2)) {
+        luaL_argcheck(L, lua_isuserdata(L, 2) || lua_istable(L, 2), 2,
+            "function or stream expected");
+    }
+    if (chunk < MAR_BUFSIZE) chunk = MAR_BUFSIZE;
+
+    /* 1: table, 2: refs, 3: environment, 4: encoder */
+    lua_settop(L, 2);
+    lua_createtable(L, 8, 0);
+    lua_insert(L, 2);
+    lua_rawseti(L, 2, MAR_ENC_WRITER);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, 2, MAR_ENC_REFS);
+    lua_insert(L, 2);
+
+    enc = lua_newuserdata(L, sizeof(mar_Encoder));
+    memset(enc, 0, sizeof(mar_Encoder));
+    luaL_getmetatable(L, MAR_ENCODER);
+    lua_setmetatable(L, 4);
+    lua_pushvalue(L, 3);
+    lua_setfenv(L, 4);
+
+    buf_init_size(L, &enc->buf, stream ? chunk : MAR_BUFSIZE);
+    enc->buf.chunk = chunk;
+    enc->buf.intern = intern;
+    enc->buf.compress = compress;
+    enc->idx = 1;
+    buf_write(L, header, sizeof(header), &enc->buf);
+    set_ref(L, 1, &enc->idx);
+    lua_pushvalue(L, 1);
+    enc_open(L, enc, 0);
+
+    lua_settop(L, 4);
+    return 1;
+}
+
+/*
+ * Arguments: encoder_udata, [budget (number)]
+ * Returns: [number_of_bytes (number) | string]
+ */
+static int enc_step(lua_State* L)
+{
+    mar_Encoder *enc = luaL_checkudata(L, 1, MAR_ENCODER);
+    const size_t budget = luaL_optinteger(L, 2, MAR_CHUNKSIZE);
+    mar_Buffer *buf = &enc->buf;
+    const size_t start = buf->total + buf->head;
+
+    if (enc->state == MAR_ENC_BUSY) luaL_error(L, "encoder is broken");
+    if (enc->state == MAR_ENC_DONE) luaL_error(L, "encoder is done");
+    enc->state = MAR_ENC_BUSY;
+
+    /* 1: encoder, 2: refs, 3: environment, 4: writer */
+    lua_settop(L, 1);
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, 2, MAR_ENC_REFS);
+    lua_insert(L, 2);
+    lua_rawgeti(L, 3, MAR_ENC_WRITER);
+    buf->writer = lua_isnil(L, 4) ? 0 : 4;
+
+    while (enc->depth && buf->total + buf->head - start < budget) {
+        mar_Frame *f = &enc->frames[enc->depth - 1];
+        const int slot = mar_enc_slot(enc->depth);
+
+        lua_settop(L, 4);
+        lua_rawgeti(L, 3, slot);  /* 5: table */
+        if (f->i <= f->narr) {
+            lua_rawgeti(L, 5, (int)f->i++);
+            enc_value(L, enc, 6);
+        }
+        else {
+            lua_rawgeti(L, 3, slot + 1);
+            if (!lua_next(L, 5)) {
+                enc_close(L, enc);
+                continue;
+            }
+            lua_pushvalue(L, 6);
+            lua_rawseti(L, 3, slot + 1);
+            if (!mar_isindex(L, 6, f->narr)) {
+                f->nrec++;
+                pack_value(L, buf, 6, &enc->idx);
+                enc_value(L, enc, 7);
+            }
+        }
+        buf_check_flush(L, buf);
+    }
+
+    if (enc->depth) {
+        enc->state = MAR_ENC_READY;
+        return 0;
+    }
+    enc->state = MAR_ENC_DONE;
+    lua_pushnil(L);
+    lua_rawseti(L, 3, MAR_ENC_REFS);
+
+    if (buf->writer) {
+        buf_flush(L, buf);
+        free(buf->data);
+        lua_pushnumber(L, (lua_Number)buf->total);
+    }
+    else {
+        buf_done(L, buf);
+    }
+    buf->data = NULL;
+    return 1;
+}
+
+static int enc_gc(lua_State* L)
+{
+    mar_Encoder *enc = luaL_checkudata(L, 1, MAR_ENCODER);
+
+    free(enc->buf.data);
+    free(enc->frames);
+    enc->buf.data = NULL;
+    enc->frames = NULL;
+    return 0;
+}
+
+/* serialize the partition at index 3 as the stream of segment */
+static void pack_segment(lua_State *L, mar_Buffer *buf)
+{
+    static const char header[2] = { (char)MAR_MAGIC, MAR_VERSION };
+    int idx = 1;
+
+    lua_newtable(L);
+    lua_replace(L, 2);
+    set_ref(L, 1, &idx);  /* the partitioned table is the root */
+    lua_pushvalue(L, 3);
+    buf_write(L, header, sizeof(header), buf);
+    mar_pack(L, buf, &idx);
+    lua_pop(L, 1);
+}
+
+/* push the segments container: header, segment table and segments */
+static void pack_segments(lua_State *L, mar_Buffer *buf,
+                          const size_t *ends, int n)
+{
+    static const char header[2] = { (char)MAR_MAGIC, MAR_SEGMENTS };
+    mar_Buffer out;
+    size_t pos = 0;
+    int i;
+
+    buf_init_size(L, &out, MAR_BUFSIZE + buf->head);
+    buf_write(L, header, sizeof(header), &out);
+    buf_varint(L, &out, n);
+    for (i = 0; i < n; i++) {
+        buf_varint(L, &out, ends[i] - pos);
+        pos = ends[i];
+    }
+    buf_write(L, buf->data, buf->head, &out);
+    free(buf->data);
+    buf_done(L, &out);
+}
+
+/*
+ * Arguments: table, number_of_segments (number), [intern (boolean | number)]
+ * Returns: string
+ */
+static int tbl_marshal_segments(lua_State* L)
+{
+    const int n = luaL_checkint(L, 2);
+    const size_t intern = mar_optintern(L, 3);
+    size_t count = 0, per, k = 0;
+    size_t *ends;
+    mar_Buffer buf;
+    int seg = 0;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_argcheck(L, n > 0, 2, "positive number expected");
+
+    lua_pushnil(L);
+    while (lua_next(L, 1)) {
+        lua_pop(L, 1);
+        count++;
+    }
+    per = (count + n - 1) / n;
+
+    /* 1: table, 2: refs, 3: partition, 4: segment ends */
+    lua_settop(L, 1);
+    lua_newtable(L);
+    lua_createtable(L, 0, (int)per);
+    ends = lua_newuserdata(L, n * sizeof(size_t));
+
+    buf_init(L, &buf);
+    buf.intern = intern;
+    lua_pushnil(L);
+    while (lua_next(L, 1)) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, 3);
+        if (++k == per && seg < n - 1) {
+            pack_segment(L, &buf);
+            ends[seg++] = buf.head;
+            lua_createtable(L, 0, (int)per);
+            lua_replace(L, 3);
+            k = 0;
+        }
+    }
+    while (seg < n) {
+        pack_segment(L, &buf);
+        ends[seg++] = buf.head;
+        lua_newtable(L);
+        lua_replace(L, 3);
+    }
+    pack_segments(L, &buf, ends, n);
+    return 1;
+}
+
+/*
+ * Arguments: list of serialized tables (table)
+ * Returns: string
+ */
+static int tbl_join_segments(lua_State* L)
+{
+    size_t *ends;
+    mar_Buffer buf;
+    int n, i;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    n = lua_objlen(L, 1);
+    ends = lua_newuserdata(L, n * sizeof(size_t));
+
+    buf_init(L, &buf);
+    for (i = 0; i < n; i++) {
+        size_t l;
+        const char *s;
+
+        lua_rawgeti(L, 1, i + 1);
+        s = lua_tolstring(L, -1, &l);
+        if (!s || l < 2 || (unsigned char)s[0] != MAR_MAGIC
+            || s[1] != MAR_VERSION) {
+            free(buf.data);
+            luaL_argerror(L, 1, "list of marshaled tables expected");
+        }
+        buf_write(L, s, l, &buf);
+        ends[i] = buf.head;
+        lua_pop(L, 1);
+    }
+    pack_segments(L, &buf, ends, n);
+    return 1;
+}
+
+/*
+ * Arguments: name (string), metatable (table), fields (table),
+ *	[types (table)]
+ */
+static int tbl_schema(lua_State* L)
+{
+    size_t n, i;
+
+    luaL_checktype(L, 1, LUA_TSTRING);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    n = lua_objlen(L, 3);
+    lua_settop(L, 4);
+
+    /* type names to codes, LUA_TNONE for "any" */
+    if (!lua_isnil(L, 4)) {
+        luaL_checktype(L, 4, LUA_TTABLE);
+        luaL_argcheck(L, lua_objlen(L, 4) == n, 4, "a type per field expected");
+        lua_createtable(L, (int)n, 0);
+        for (i = 1; i <= n; i++) {
+            const char *name;
+            int type;
+            lua_rawgeti(L, 4, (int)i);
+            name = lua_tostring(L, -1);
+            luaL_argcheck(L, name != NULL, 4, "type names expected");
+            for (type = LUA_TTHREAD; type > LUA_TNIL; type--) {
+                if (!strcmp(name, lua_typename(L, type))) break;
+            }
+            if (type == LUA_TNIL) {
+                luaL_argcheck(L, !strcmp(name, "any"), 4, "unknown type name");
+                type = LUA_TNONE;
+            }
+            lua_pop(L, 1);
+            lua_pushinteger(L, type);
+            lua_rawseti(L, -2, (int)i);
+        }
+        lua_replace(L, 4);
+    }
+
+    /* 5: schema */
+    lua_createtable(L, 5, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, 5, MAR_SCHEMA_NAME);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, 5, MAR_SCHEMA_META);
+    lua_pushvalue(L, 4);
+    lua_rawseti(L, 5, MAR_SCHEMA_TYPES);
+    lua_createtable(L, (int)n, 0);
+    lua_createtable(L, 0, (int)n);
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, 3, (int)i);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -3);
+        luaL_argcheck(L, lua_isnil(L, -1), 3, "duplicate field");
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -4, (int)i);
+        lua_pushinteger(L, (lua_Integer)i);
+        lua_rawset(L, -3);
+    }
+    lua_rawseti(L, 5, MAR_SCHEMA_INDEX);
+    lua_rawseti(L, 5, MAR_SCHEMA_KEYS);
+
+    /* replace the schemas of name and metatable */
+    mar_pushschemas(L);
+    lua_pushvalue(L, 1);
+    lua_rawget(L, -2);
+    if (lua_istable(L, -1)) {
+        lua_rawgeti(L, -1, MAR_SCHEMA_META);
+        lua_pushnil(L);
+        lua_rawset(L, -4);
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    if (lua_istable(L, -1)) {
+        lua_rawgeti(L, -1, MAR_SCHEMA_NAME);
+        lua_pushnil(L);
+        lua_rawset(L, -4);
+    }
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 5);
+    lua_rawset(L, -3);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 5);
+    lua_rawset(L, -3);
+    return 0;
+}
+
+/* the stream at index 1: string, light userdata or sys.mem object */
+static const char* unpack_source(lua_State *L, size_t *len)
+{
+    const char *s;
+    size_t l = 0, off, n;
+    int known = 1;
+
+    switch (lua_type(L, 1)) {
+    case LUA_TSTRING:
+        s = lua_tolstring(L, 1, &l);
+        break;
+    case LUA_TLIGHTUSERDATA:
+        s = lua_touserdata(L, 1);
+        known = 0;
+        break;
+    default:
+        if (!luaL_getmetafield(L, 1, "getptr")) {
+            luaL_argerror(L, 1, "string or memory expected");
+        }
+        lua_pushvalue(L, 1);
+        lua_call(L, 1, 1);
+        s = lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        known = luaL_getmetafield(L, 1, "length");
+        if (known) {
+            lua_pushvalue(L, 1);
+            lua_call(L, 1, 1);
+            l = (size_t)lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+    }
+    if (!s) luaL_argerror(L, 1, "null pointer");
+
+    off = (size_t)luaL_optnumber(L, 2, 0);
+    if (known && off > l) luaL_argerror(L, 2, "out of range");
+    if (!known || !lua_isnoneornil(L, 3)) {
+        n = (size_t)luaL_checknumber(L, 3);
+        if (known && n > l - off) luaL_argerror(L, 3, "out of range");
+    }
+    else {
+        n = l - off;
+    }
+    *len = n;
+    return s + off;
+}
+
+/* push the buffer of decompressed frames, return it */
+static const char* unpack_compressed(lua_State *L, const char *p,
+                                     const char *end, size_t *len)
+{
+    const char *q;
+    size_t total = 0;
+    char *data;
+
+    for (q = p; q != end; ) {
+        size_t n, z;
+        if (end - q < MAR_LZ_HEADER) luaL_error(L, "bad frame");
+        n = lz_get32(q);
+        z = lz_get32(q + 4);
+        q += MAR_LZ_HEADER;
+        if (z > n || z > (size_t)(end - q)) luaL_error(L, "bad frame");
+        total += n;
+        q += z;
+    }
+
+    data = lua_newuserdata(L, total ? total : 1);
+    for (q = p, *len = 0; q != end; ) {
+        const size_t n = lz_get32(q), z = lz_get32(q + 4);
+        q += MAR_LZ_HEADER;
+        if (z == n) {
+            memcpy(data + *len, q, n);
+        }
+        else if (!lz_decompress(q, z, data + *len, n)) {
+            luaL_error(L, "bad frame");
+        }
+        *len += n;
+        q += z;
+    }
+    return data;
+}
+
+/* read the segment table, return the start of first segment */
+static const char* unpack_segtable(lua_State *L, const char *p,
+                                   const char *end, uint64_t *n,
+                                   const char **lens)
+{
+    uint64_t i, total = 0;
+
+    *n = unpack_varint(L, &p, end);
+    if (*n > (uint64_t)(end - p)) luaL_error(L, "bad code");
+    *lens = p;
+    for (i = 0; i < *n; i++) {
+        const uint64_t l = unpack_varint(L, &p, end);
+        if (l < 2 || l > (uint64_t)(end - p)) luaL_error(L, "bad code");
+        total += l;
+    }
+    if (total > (uint64_t)(end - p)) luaL_error(L, "bad code");
+    return p;
+}
+
+/* push the table merged from segments */
+static int mar_unpack_segments(lua_State *L, const char *p, const char *end)
+{
+    const char *lens, *q, *s, *e;
+    uint64_t n, i, narr = 0, nrec = 0;
+
+    /* presize by the sizes of segments */
+    p = unpack_segtable(L, p, end, &n, &lens);
+    for (i = 0, q = lens, e = p; i < n; i++) {
+        const char *next = e + unpack_varint(L, &q, end);
+        uint64_t rec, ref;
+        if ((unsigned char)e[0] != MAR_MAGIC || e[1] != MAR_VERSION) {
+            luaL_error(L, "bad segment");
+        }
+        s = e + 2;
+        e = next;
+        narr += unpack_sizes(L, &s, &e, &rec, &ref);
+        nrec += rec;
+        e = next;
+    }
+    lua_createtable(L, (int)narr, (int)nrec);
+
+    for (i = 0, q = lens; i < n; i++) {
+        uint64_t a, rec, ref;
+        int idx = 2;
+
+        s = p + 2;
+        e = p = p + unpack_varint(L, &q, end);
+        lua_newtable(L);
+        lua_replace(L, 2);
+        lua_pushvalue(L, 3);
+        lua_rawseti(L, 2, 1);
+        a = unpack_sizes(L, &s, &e, &rec, &ref);
+        lua_pushvalue(L, 3);
+        unpack_fill(L, s, e, a, &idx, 0);
+        lua_pop(L, 1);
+    }
+    return 1;
+}
+
+/*
+ * Arguments: string | lightuserdata | memory, [offset (number),
+ *	length (number)]
+ * Returns: offsets (table), lengths (table)
+ */
+static int tbl_segments(lua_State* L)
+{
+    const size_t off = (size_t)luaL_optnumber(L, 2, 0);
+    const char *lens, *p, *s;
+    uint64_t n, i;
+    size_t l;
+
+    s = unpack_source(L, &l);
+    if (l < 2 || (unsigned char)s[0] != MAR_MAGIC || s[1] != MAR_SEGMENTS) {
+        luaL_error(L, "bad header");
+    }
+    p = unpack_segtable(L, s + 2, s + l, &n, &lens);
+
+    lua_createtable(L, (int)n, 0);
+    lua_createtable(L, (int)n, 0);
+    for (i = 1; i <= n; i++) {
+        const size_t len = (size_t)unpack_varint(L, &lens, p);
+        lua_pushnumber(L, (lua_Number)(off + (p - s)));
+        lua_rawseti(L, -3, (int)i);
+        lua_pushnumber(L, (lua_Number)len);
+        lua_rawseti(L, -2, (int)i);
+        p += len;
+    }
+    return 2;
+}
+
+static int tbl_unmarshal(lua_State* L)
+{
+    int x = 1;
+    size_t l;
+    const char *s;
+    int lazy;
+
+    if (lua_isstring(L, 1) && !lua_isnumber(L, 2)) {
+        /* unmarshal(s [, lazy]) */
+        s = luaL_checklstring(L, 1, &l);
+        lazy = lua_toboolean(L, 2);
+    }
+    else {
+        s = unpack_source(L, &l);
+        lazy = lua_toboolean(L, 4);
+    }
+
+    if (l < 2) luaL_error(L, "bad header");
+    if ((unsigned char)s[0] == MAR_MAGIC && s[1] == MAR_COMPRESSED) {
+        /* the buffer is the source of lazy tables */
+        s = unpack_compressed(L, s + 2, s + l, &l);
+        lua_replace(L, 1);
+        if (l < 2 || s[1] == MAR_COMPRESSED) luaL_error(L, "bad header");
+    }
+    if (*(unsigned char *)s++ != MAR_MAGIC) luaL_error(L, "bad magic");
+    l -= 2;
+
+    /* the refs table must be at index 2 */
+    lua_settop(L, 1);
+
+    if (*s == MAR_VERSION) {
+        int idx = 1;
+        if (lazy) {
+            lua_newtable(L);
+            unpack_lazy_state(L, 1, s + 1);
+            mar_unpack(L, s + 1, s + 1 + l, &idx, 3);
+        }
+        else {
+            /* presize by the number of references inside the root */
+            const char *p = s + 1, *e = s + 1 + l;
+            uint64_t nrec, nref;
+            unpack_sizes(L, &p, &e, &nrec, &nref);
+            lua_createtable(L, (int)nref + 1, 0);
+            mar_unpack(L, s + 1, s + 1 + l, &idx, 0);
+        }
+        return 1;
+    }
+    lua_newtable(L);
+    if (*s == MAR_SEGMENTS) {
+        return mar_unpack_segments(L, s + 1, s + 1 + l);
+    }
+
+    lua_newtable(L);
     if (*(char*)&x != *s++) {
         /* endianness mismatch so reverse the bytes */
         char *p;
@@ -507,11 +2237,11 @@ static int tbl_unmarshal(lua_State* L)
         for (i=0, j=n-1, n=n/2; n--; i++, j--) {
             char t=p[i]; p[i]=p[j]; p[j]=t;
         }
-        mar_unpack(L, p, l, 1);
+        mar_unpack_v1(L, p, l, 1);
         free(buf.data);
     }
     else {
-        mar_unpack(L, s, l, 1);
+        mar_unpack_v1(L, s, l, 1);
     }
 
     return 1;
@@ -519,7 +2249,9 @@ static int tbl_unmarshal(lua_State* L)
 
 static int tbl_clone(lua_State* L)
 {
+    lua_settop(L, 1);
     tbl_marshal(L);
+    lua_replace(L, 1);
     tbl_unmarshal(L);
     return 1;
 }
@@ -529,11 +2261,37 @@ static const luaL_reg R[] =
     {"marshal",     tbl_marshal},
     {"unmarshal",   tbl_unmarshal},
     {"clone",       tbl_clone},
+    {"marshal_segments", tbl_marshal_segments},
+    {"join_segments",    tbl_join_segments},
+    {"segments",    tbl_segments},
+    {"encoder",     tbl_encoder},
+    {"schema",      tbl_schema},
+    {NULL,	    NULL}
+};
+
+static const luaL_reg encoder_meth[] =
+{
+    {"step",        enc_step},
+    {"__gc",        enc_gc},
     {NULL,	    NULL}
 };
 
 int luaopen_marshal(lua_State *L)
 {
+    mar_pushschemas(L);
+    if (lua_isnil(L, -1)) {
+        lua_pushlightuserdata(L, &mar_schemas);
+        lua_newtable(L);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MAR_ENCODER);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_register(L, NULL, encoder_meth);
+    lua_pop(L, 1);
+
     luaL_openlib(L, LUA_TABLIBNAME, R, 0);
     return 1;
 }
@@ -112,6 +112,234 @@ assert(t1[1] == t2[1])
 assert(t1[2] == t2[2])
 assert(t1.b == t2.b)
 
+-- v2 values
+local nums = { 0, 1, 127, 128, 300, -1, -32, -33, -1000, 2^31, -2^31, 2^53,
+   -2^53, 2^53 + 2, 1.5, -0.25, 1e300, 1/0, -1/0 }
+local strs = { "", "x", string.rep("s", 31), string.rep("s", 32),
+   string.rep("l", 1000), string.rep("h", 70000) }
+local t = table.unmarshal(table.marshal{ nums = nums, strs = strs })
+for i = 1, #nums do assert(t.nums[i] == nums[i]) end
+for i = 1, #strs do assert(t.strs[i] == strs[i]) end
+local z = 0
+local t = table.unmarshal(table.marshal{ -z, z/z })
+assert(1/t[1] < 0 and t[2] ~= t[2])
+
+local small, large = { 1 }, { string.rep("x", 200) }
+local a = { small, large, small, large, { large } }
+a.self = a
+local t = table.unmarshal(table.marshal(a))
+assert(t.self == t and t[1] == t[3] and t[2] == t[4] and t[5][1] == t[2])
+assert(t[1][1] == 1 and t[2][1] == large[1])
+
+local x, y = nil, 7
+local f = function() return x, y end
+local g = table.unmarshal(table.marshal{ f })[1]
+assert(select(1, g()) == nil and select(2, g()) == 7)
+
+-- array segments
+local holes = { 1, nil, 3, [5] = 5, [0] = 0, [-1] = -1, [2.5] = 2.5, x = "x" }
+local seq = { }
+for i = 1, 1000 do seq[i] = i % 7 == 0 and { i } or i end
+local rec = { }
+for i = 1, 300 do rec["f" .. i] = i end
+local t = table.unmarshal(table.marshal{ holes = holes, seq = seq, rec = rec })
+for k, v in pairs(holes) do assert(t.holes[k] == v) end
+for k, v in pairs(t.holes) do assert(holes[k] == v) end
+assert(#t.seq == 1000 and t.seq[700][1] == 700 and t.seq[999] == 999)
+for i = 1, 300 do assert(t.rec["f" .. i] == i) end
+
+-- lazy
+local shared = { "shared" }
+local doc = { a = { x = 1, deep = { shared } }, b = { 1, 2, 3, shared },
+   c = { shared = shared }, d = { 1, k = "v" }, n = 42 }
+doc.a.up = doc
+local s = table.marshal(doc)
+local t = table.unmarshal(s, true)
+assert(t.n == 42 and getmetatable(t.b) and rawget(t.b, 1) == nil)
+assert(t.b[4][1] == "shared" and not getmetatable(t.b))
+assert(getmetatable(t.d) and t.d[1] == 1)
+assert(t.c.shared == t.b[4] and t.a.up == t)
+assert(t.a.deep[1] == t.b[4])
+local l = table.unmarshal(s, true)
+l.c.new = true
+assert(l.c.new and l.c.shared[1] == "shared")
+local n = 0
+for k, v in getmetatable(l.d).__pairs(l.d) do n = n + 1 end
+assert(n == 2 and not getmetatable(l.d))
+assert(table.unmarshal("xx" .. s .. "yy", 2, #s).b[3] == 3)
+assert(not pcall(table.unmarshal, s, 2, #s))
+
+-- segments
+local t = { }
+for i = 1, 1000 do t["k" .. i] = { i } end
+for i = 1, 50 do t[i] = i * 2 end
+t.a, t.self = shared, t
+local s = table.marshal_segments(t, 4)
+local offsets, lengths = table.segments(s)
+local n = 0
+for i = 1, #offsets do
+   for k, v in pairs(table.unmarshal(s, offsets[i], lengths[i])) do n = n + 1 end
+end
+assert(#offsets == 4 and n == 1052)
+local u = table.unmarshal(s)
+for i = 1, 50 do assert(u[i] == i * 2) end
+assert(u.k500[1] == 500 and u.a[1] == "shared" and u.self == u)
+local u = table.unmarshal(table.join_segments{
+   table.marshal{ x = 1, 7 }, table.marshal{ y = 2, 8 } })
+assert(u.x == 1 and u.y == 2 and u[1] == 8)
+assert(next(table.unmarshal(table.marshal_segments({ }, 3))) == nil)
+assert(not pcall(table.join_segments, { "xx" }))
+
+-- interned strings
+local recs = { }
+for i = 1, 100 do
+   recs[i] = { status = i % 2 == 0 and "active" or "inactive", name = "n" .. i,
+      [string.rep("k", 40)] = "abc", tag = "x" }
+end
+recs.first = recs[1]
+local plain, interned = table.marshal(recs), table.marshal(recs, nil, true)
+assert(#interned < #plain / 2)
+assert(#table.marshal(recs, nil, 1000) == #plain)
+for _, s in ipairs{ interned, table.marshal(recs, nil, 1) } do
+   local t = table.unmarshal(s)
+   for i = 1, 100 do
+      for k, v in pairs(recs[i]) do assert(t[i][k] == v) end
+   end
+   assert(t.first == t[1])
+   local l = table.unmarshal(s, true)
+   assert(l[100].status == "active" and l[99].status == "inactive")
+   assert(l[100][string.rep("k", 40)] == "abc" and l.first == l[1])
+end
+local enc = table.encoder(recs, nil, nil, true)
+local r
+repeat r = enc:step(64) until r
+assert(r == interned)
+local u = table.unmarshal(table.marshal_segments(recs, 3, true))
+assert(u[50].status == "active" and u.first.name == "n1")
+
+-- schemas
+local Point = { }
+Point.__index = Point
+function Point:norm() return self.x * self.x + self.y * self.y end
+local attr = { "label" }
+table.schema("Point", Point, { "x", "y", attr }, { "number", "number", "any" })
+local pts = { }
+for i = 1, 100 do
+   local label = i % 3 == 0 and "p" .. i or nil
+   pts[i] = setmetatable({ x = i, y = -i, [attr] = label }, Point)
+end
+pts[7].extra, pts.first = { 7 }, pts[1]
+local plain = table.marshal(pts)
+local t = table.unmarshal(plain)
+assert(getmetatable(t[1]) == Point and t[10]:norm() == 200)
+assert(t[3][attr] == "p3" and t[4][attr] == nil and rawget(t[4], attr) == nil)
+assert(t[7].extra[1] == 7 and t.first == t[1])
+local l = table.unmarshal(plain, true)
+assert(getmetatable(l[9]) == Point and l[9][attr] == "p9")
+local enc = table.encoder(pts)
+local r
+repeat r = enc:step(32) until r
+assert(r == plain)
+pts[5].x = "5"
+assert(not pcall(table.marshal, pts))
+pts[5].x = 5
+table.schema("Point2", Point, { "x", "y" })
+assert(not pcall(table.unmarshal, plain))
+assert(#table.marshal(pts) > #plain)
+
+-- v1 payload
+local v1 = table.unmarshal(
+   "\142\001\003\000\000\000\000\000\000\240\063\003\000\000\000" ..
+   "\000\000\000\240\063\003\000\000\000\000\000\000\000\064\003" ..
+   "\000\000\000\000\000\000\004\064\003\000\000\000\000\000\000" ..
+   "\008\064\003\000\000\000\000\000\000\028\192\003\000\000\000" ..
+   "\000\000\000\016\064\004\003\000\000\000str\003\000\000\000" ..
+   "\000\000\000\020\064\001\001\003\000\000\000\000\000\000\024" ..
+   "\064\001\000\004\004\000\000\000self\005\002\062\000\000\000" ..
+   "\003\000\000\000\000\000\000\240\063\003\000\000\000\000\000" ..
+   "\000\240\063\003\000\000\000\000\000\000\000\064\003\000\000" ..
+   "\000\000\000\000\000\064\004\003\000\000\000sub\005\002\012" ..
+   "\000\000\000\004\001\000\000\000x\004\001\000\000\000y\003" ..
+   "\000\000\000\000\000\000\036\064\003\156u\000\136\060\228" ..
+   "\055\126\004\001\000\000\000k\005\001\001\000\000\000")
+assert(v1[1] == 1 and v1[2] == 2.5 and v1[3] == -7 and v1[4] == "str")
+assert(v1[5] == true and v1[6] == false and v1[10] == 1e300)
+assert(v1.k[2] == 2 and v1.k.sub.x == "y" and v1.self[1] == 1)
+
+-- streaming
+local big = { }
+for i=1, 1000 do
+   big["k" .. i] = { i, string.rep("v", i % 100), sub = { i } }
+end
+local s = table.marshal(big)
+
+local chunks = { }
+local n = table.marshal(big, function(chunk)
+   assert(#chunk <= 1024 + 400)
+   chunks[#chunks + 1] = chunk
+end, 1024)
+assert(n == #s)
+assert(#chunks > 1)
+assert(table.concat(chunks) == s)
+
+local stream = { n = 0 }
+function stream:write(chunk)
+   self.n = self.n + #chunk
+   self[#self + 1] = chunk
+   return self
+end
+assert(table.marshal(big, stream, 4096, #s) == #s)
+local t = table.unmarshal(table.concat(stream))
+assert(t.k10[1] == 10 and t.k10.sub[1] == 10)
+
+local failed = { write = function() return nil, "disk full" end }
+assert(not pcall(table.marshal, big, failed))
+
+assert(table.marshal(big, #s) == s)
+
+-- compressed
+local z = table.marshal(big, nil, nil, true)
+assert(#z < #s / 2 and table.unmarshal(z).k10.sub[1] == 10)
+assert(table.unmarshal(z, true).k99[2] == string.rep("v", 99))
+local chunks = { }
+local n = table.marshal(big, function(chunk)
+   chunks[#chunks + 1] = chunk
+end, 1024, nil, nil, true)
+assert(n == #table.concat(chunks) and #chunks > 1)
+assert(table.unmarshal(table.concat(chunks)).k500[1] == 500)
+local enc = table.encoder(big, nil, nil, nil, true)
+local r
+repeat r = enc:step(4096) until r
+assert(r == z)
+assert(not pcall(table.unmarshal, z:sub(1, -2)))
+
+-- incremental encoder
+local enc = table.encoder(big)
+local steps, r = 0
+repeat
+   steps = steps + 1
+   r = enc:step(512)
+until r
+assert(r == s and steps > 10)
+assert(not pcall(enc.step, enc))
+
+local chunks = { }
+local enc = table.encoder(big, function(chunk)
+   chunks[#chunks + 1] = chunk
+end, 1024)
+while not enc:step(100) do end
+assert(table.concat(chunks) == s)
+
+local deep = { 1, 2, { 3, { 4, { 5 } } }, f = function() return big end }
+deep.o, deep.self = o, deep
+deep[3][2].up = deep[3]
+local enc = table.encoder(deep)
+local r
+repeat r = enc:step(1) until r
+assert(r == table.marshal(deep))
+local t = table.unmarshal(r)
+assert(t[3][2][2][1] == 5 and t[3][2].up == t[3] and t.self == t)
+
 print "OK"
 
 --[[ micro-bench (~4.2 seconds on my laptop)